@@ -7,6 +7,8 @@
 #include <algorithm>
 #include <fcntl.h>
 #include <filesystem>
+#include <grp.h>
+#include <pwd.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -20,6 +22,15 @@
 namespace {
 
 constexpr std::size_t max_argument_length = 256;
+constexpr unsigned long max_reactor_threads_limit = 256;
+constexpr unsigned long max_in_flight_requests_limit = 1024;
+constexpr unsigned long max_pending_output_bytes_limit = 16 * 1024 * 1024;
+constexpr unsigned long max_listen_backlog_limit = 65535;
+constexpr unsigned long max_clients_limit = 1024 * 1024;
+constexpr unsigned long max_idle_timeout_seconds_limit = 24 * 60 * 60;
+constexpr unsigned long max_rate_limit_per_minute_limit = 1000000;
+constexpr unsigned long max_rate_limit_burst_limit = 1000000;
+constexpr unsigned long max_busy_timeout_ms_limit = 60 * 1000;
 
 bool sane_argument(char const* arg)
 {
@@ -35,6 +46,24 @@ bool sane_argument(char const* arg)
   return true;
 }
 
+// Split a config list value like "[a, b]" or "a, b" into its (unquoted) items.
+std::vector<std::string_view> parse_config_list(std::string_view raw_value)
+{
+  std::vector<std::string_view> items;
+  std::string_view list = remountd::unquote(raw_value);
+  if (list.starts_with('[') && list.ends_with(']'))
+    list = list.substr(1, list.size() - 2);
+  while (!list.empty())
+  {
+    std::size_t const comma = list.find(',');
+    std::string_view const item = remountd::unquote(remountd::trim(list.substr(0, comma)));
+    list = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+    if (!item.empty())
+      items.push_back(item);
+  }
+  return items;
+}
+
 std::optional<std::string> parse_long_option_with_value(int argc, char* argv[], int* index)
 {
   int const i = *index + 1;
@@ -166,9 +195,58 @@ void Application::load_config()
 
   configured_socket_path_.clear();
   allowed_mount_points_.clear();
+  reactor_threads_ = 1;
+  max_in_flight_requests_ = default_max_in_flight_requests_c;
+  max_pending_output_bytes_ = default_max_pending_output_bytes_c;
+  listen_backlog_ = default_listen_backlog_c;
+  max_clients_ = default_max_clients_c;
+  idle_timeout_seconds_ = default_idle_timeout_seconds_c;
+  exit_on_idle_seconds_ = 0;
+  attach_directory_ = default_attach_directory_c;
+  state_file_ = default_state_file_c;
+  rate_limit_per_minute_ = 0;
+  rate_limit_burst_ = default_rate_limit_burst_c;
+  busy_timeout_ms_ = default_busy_timeout_ms_c;
+
+  // Parse the value of a numeric config key and check that it lies in [min_value, max_value].
+  auto parse_config_unsigned = [this](std::string_view key, std::string_view raw_value, unsigned long min_value, unsigned long max_value)
+  {
+    std::optional<unsigned long> const value = parse_unsigned(unquote(raw_value));
+    if (!value.has_value() || *value < min_value || *value > max_value)
+      throw_error(errc::config_invalid_value, "config key '" + std::string(key) + "' must be a number between " +
+          std::to_string(min_value) + " and " + std::to_string(max_value) + " in '" + config_path_.native() + "'");
+    return *value;
+  };
+
+  // Parse a list of user or group names and/or numeric ids, like "[alice, 1001]" or "alice, 1001".
+  auto parse_config_ids = [this]<typename Id>(std::string_view key, std::string_view raw_value, std::vector<Id>& ids, auto lookup_name)
+  {
+    for (std::string_view const item : parse_config_list(raw_value))
+    {
+      std::optional<unsigned long> id = parse_unsigned(item);
+      if (!id.has_value())
+        id = lookup_name(std::string(item));
+      if (!id.has_value() || *id >= static_cast<Id>(-1))
+        throw_error(errc::config_invalid_value, "config key '" + std::string(key) + "' contains unknown name or invalid id '" +
+            std::string(item) + "' in '" + config_path_.native() + "'");
+      ids.push_back(static_cast<Id>(*id));
+    }
+  };
+  auto lookup_user = [](std::string const& name) -> std::optional<unsigned long>
+  {
+    if (passwd const* const pw = getpwnam(name.c_str()))
+      return pw->pw_uid;
+    return std::nullopt;
+  };
+  auto lookup_group = [](std::string const& name) -> std::optional<unsigned long>
+  {
+    if (group const* const gr = getgrnam(name.c_str()))
+      return gr->gr_gid;
+    return std::nullopt;
+  };
 
   bool in_allow_section = false;
-  std::string current_allow_name;
+  AllowedMountPoint* current_allow_entry = nullptr;
   std::string line;
   while (std::getline(config, line))
   {
@@ -191,7 +269,7 @@ void Application::load_config()
     if (indent == 0)
     {
       in_allow_section = false;
-      current_allow_name.clear();
+      current_allow_entry = nullptr;
     }
 
     std::size_t const colon = content.find(':');
@@ -212,6 +290,84 @@ void Application::load_config()
         continue;
       }
 
+      if (key == "threads")
+      {
+        reactor_threads_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 1, max_reactor_threads_limit));
+        continue;
+      }
+
+      if (key == "max_in_flight_requests")
+      {
+        max_in_flight_requests_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 1, max_in_flight_requests_limit));
+        continue;
+      }
+
+      if (key == "max_pending_output_bytes")
+      {
+        max_pending_output_bytes_ = parse_config_unsigned(key, raw_value, 1, max_pending_output_bytes_limit);
+        continue;
+      }
+
+      if (key == "listen_backlog")
+      {
+        listen_backlog_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 1, max_listen_backlog_limit));
+        continue;
+      }
+
+      if (key == "max_clients")
+      {
+        max_clients_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 1, max_clients_limit));
+        continue;
+      }
+
+      if (key == "idle_timeout")
+      {
+        idle_timeout_seconds_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 0, max_idle_timeout_seconds_limit));
+        continue;
+      }
+
+      if (key == "exit_on_idle")
+      {
+        exit_on_idle_seconds_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 0, max_idle_timeout_seconds_limit));
+        continue;
+      }
+
+      if (key == "busy_timeout_ms")
+      {
+        busy_timeout_ms_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 0, max_busy_timeout_ms_limit));
+        continue;
+      }
+
+      if (key == "attach_directory")
+      {
+        std::string_view const value = unquote(raw_value);
+        if (value.empty() || value.front() != '/')
+          throw_error(errc::config_invalid_value, "config key 'attach_directory' must be an absolute path in '" + config_path_.native() + "'");
+        attach_directory_ = std::string(value);
+        continue;
+      }
+
+      if (key == "state_file")
+      {
+        std::string_view const value = unquote(raw_value);
+        if (!value.empty() && value.front() != '/')
+          throw_error(errc::config_invalid_value, "config key 'state_file' must be an absolute path or empty in '" + config_path_.native() + "'");
+        state_file_ = std::string(value);
+        continue;
+      }
+
+      if (key == "rate_limit_per_minute")
+      {
+        rate_limit_per_minute_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 0, max_rate_limit_per_minute_limit));
+        continue;
+      }
+
+      if (key == "rate_limit_burst")
+      {
+        rate_limit_burst_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 1, max_rate_limit_burst_limit));
+        continue;
+      }
+
       if (key == "allow" && raw_value.empty())
       {
         in_allow_section = true;
@@ -231,22 +387,60 @@ void Application::load_config()
 
       if (!key.empty())
       {
-        current_allow_name = std::string(key);
+        current_allow_entry = &allowed_mount_points_.emplace_back();
+        current_allow_entry->name_ = std::string(key);
         continue;
       }
     }
 
-    if (indent >= 4 && !current_allow_name.empty() && key == "path")
+    if (indent < 4 || !current_allow_entry)
+      continue;
+
+    if (key == "path")
     {
       std::string_view const value = unquote(raw_value);
-      if (value.empty())
+      if (value.empty() || !current_allow_entry->path_.empty())
         continue;
 
-      allowed_mount_points_.push_back({current_allow_name, std::filesystem::path(value)});
-      current_allow_name.clear();
+      current_allow_entry->path_ = std::filesystem::path(value);
+      continue;
+    }
+
+    if (key == "rate_limit_per_minute")
+    {
+      current_allow_entry->rate_limit_per_minute_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 0, max_rate_limit_per_minute_limit));
+      continue;
+    }
+
+    if (key == "sockets")
+    {
+      for (std::string_view const socket_name : parse_config_list(raw_value))
+        current_allow_entry->sockets_.emplace_back(socket_name);
+      continue;
+    }
+
+    if (key == "users")
+    {
+      parse_config_ids(key, raw_value, current_allow_entry->users_, lookup_user);
+      continue;
+    }
+
+    if (key == "groups")
+    {
+      parse_config_ids(key, raw_value, current_allow_entry->groups_, lookup_group);
+      continue;
+    }
+
+    if (key == "rate_limit_burst")
+    {
+      current_allow_entry->rate_limit_burst_ = static_cast<unsigned int>(parse_config_unsigned(key, raw_value, 1, max_rate_limit_burst_limit));
+      continue;
     }
   }
 
+  // Names without a path are ignored.
+  std::erase_if(allowed_mount_points_, [](AllowedMountPoint const& allowed_mount_point){ return allowed_mount_point.path_.empty(); });
+
   if (configured_socket_path_.empty())
     throw_error(errc::config_socket_missing, "config file '" + config_path_.native() + "' does not define a 'socket' key");
 
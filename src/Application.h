@@ -3,6 +3,9 @@
 #include "ScopedFd.h"
 #include "ApplicationInfo.h"
 
+#include <sys/types.h>
+
+#include <cstddef>
 #include <cstdint>
 #include <filesystem>
 #include <iosfwd>
@@ -22,17 +25,32 @@ namespace remountd {
 class Application
 {
  public:
+  static constexpr unsigned int default_rate_limit_burst_c = 10;
+
   // AllowedMountPoint
   //
   // One configured allow-entry that maps an external name to a mount path.
   struct AllowedMountPoint
   {
-    std::string name_;             // Configured public name (for example: "codex").
-    std::filesystem::path path_;   // Filesystem path represented by this name.
+    std::string name_;                          // Configured public name (for example: "codex").
+    std::filesystem::path path_;                // Filesystem path represented by this name.
+    unsigned int rate_limit_per_minute_ = 0;    // Requests per minute per uid on this name, or 0 if only the global limit applies.
+    unsigned int rate_limit_burst_ = default_rate_limit_burst_c;        // Number of requests per uid on this name that may be done at once.
+    std::vector<uid_t> users_;                  // Users that may use this name; if both users_ and groups_ are empty then everyone may.
+    std::vector<gid_t> groups_;                 // Groups whose members may use this name.
+    std::vector<std::string> sockets_;          // FileDescriptorName= of the systemd sockets that serve this name; if empty then all sockets do.
   };
 
  public:
   static constexpr char const* default_config_path_c = "/etc/remountd/config.yaml";
+  static constexpr char const* default_attach_directory_c = "/run/remountd/attached";
+  static constexpr char const* default_state_file_c = "/run/remountd/state";
+  static constexpr unsigned int default_max_in_flight_requests_c = 4;
+  static constexpr std::size_t default_max_pending_output_bytes_c = 65536;
+  static constexpr unsigned int default_listen_backlog_c = 128;
+  static constexpr unsigned int default_max_clients_c = 1024;
+  static constexpr unsigned int default_idle_timeout_seconds_c = 60;
+  static constexpr unsigned int default_busy_timeout_ms_c = 2000;
   static Application& instance() { return *s_instance_; }
 
  private:
@@ -44,6 +62,18 @@ class Application
   bool config_loaded_ = false;                                  // True after config values were parsed and cached.
   std::filesystem::path configured_socket_path_;                // Parsed `socket` value from config.
   std::vector<AllowedMountPoint> allowed_mount_points_;         // Parsed `allow` entries from config.
+  unsigned int reactor_threads_ = 1;                            // Parsed `threads` value from config: number of epoll reactor threads.
+  unsigned int max_in_flight_requests_ = default_max_in_flight_requests_c;     // Parsed `max_in_flight_requests` value from config.
+  std::size_t max_pending_output_bytes_ = default_max_pending_output_bytes_c;  // Parsed `max_pending_output_bytes` value from config.
+  unsigned int listen_backlog_ = default_listen_backlog_c;                     // Parsed `listen_backlog` value from config.
+  unsigned int max_clients_ = default_max_clients_c;                           // Parsed `max_clients` value from config.
+  unsigned int idle_timeout_seconds_ = default_idle_timeout_seconds_c;         // Parsed `idle_timeout` value from config (0: disabled).
+  unsigned int exit_on_idle_seconds_ = 0;                                      // Parsed `exit_on_idle` value from config (0: disabled).
+  std::filesystem::path attach_directory_ = default_attach_directory_c;       // Parsed `attach_directory` value from config.
+  std::filesystem::path state_file_ = default_state_file_c;                   // Parsed `state_file` value from config (empty: disabled).
+  unsigned int rate_limit_per_minute_ = 0;                                     // Parsed `rate_limit_per_minute` value from config (0: unlimited).
+  unsigned int rate_limit_burst_ = default_rate_limit_burst_c;                 // Parsed `rate_limit_burst` value from config.
+  unsigned int busy_timeout_ms_ = default_busy_timeout_ms_c;                   // Parsed `busy_timeout_ms` value from config (0: do not retry).
   bool initialized_ = false;                                    // True after successful initialize().
   ScopedFd terminate_read_fd_;                                  // Read-end of termination self-pipe.
   ScopedFd terminate_write_fd_;                                 // Write-end of termination self-pipe.
@@ -111,6 +141,42 @@ class Application
   // Return parsed mount points from the config.
   std::vector<AllowedMountPoint> const& allowed_mount_points() const { return allowed_mount_points_; }
 
+  // Return the configured number of reactor threads (at least one).
+  unsigned int reactor_threads() const { return reactor_threads_; }
+
+  // Return the maximum number of requests that one client may have in flight (at least one).
+  unsigned int max_in_flight_requests() const { return max_in_flight_requests_; }
+
+  // Return the number of pending reply bytes of one client above which its input is paused.
+  std::size_t max_pending_output_bytes() const { return max_pending_output_bytes_; }
+
+  // Return the backlog passed to listen() for the standalone socket.
+  unsigned int listen_backlog() const { return listen_backlog_; }
+
+  // Return the maximum number of concurrently connected clients, over all reactors.
+  unsigned int max_clients() const { return max_clients_; }
+
+  // Return the number of seconds after which a connection without activity is closed, or 0 if idle connections are kept.
+  unsigned int idle_timeout_seconds() const { return idle_timeout_seconds_; }
+
+  // Return the number of seconds without clients and requests after which a socket-activated daemon exits, or 0 if it keeps running.
+  unsigned int exit_on_idle_seconds() const { return exit_on_idle_seconds_; }
+
+  // Return the directory in which the sockets of the `attach` command are created.
+  std::filesystem::path const& attach_directory() const { return attach_directory_; }
+
+  // Return the file in which the ro/rw state of the remounted mount points is published, or an empty path if it is not.
+  std::filesystem::path const& state_file() const { return state_file_; }
+
+  // Return the number of remount requests per minute that one uid may do, or 0 if that is unlimited.
+  unsigned int rate_limit_per_minute() const { return rate_limit_per_minute_; }
+
+  // Return the number of remount requests that one uid may do at once.
+  unsigned int rate_limit_burst() const { return rate_limit_burst_; }
+
+  // Return the number of milliseconds during which a read-only remount that fails with EBUSY is retried, or 0 if it is not.
+  unsigned int busy_timeout_ms() const { return busy_timeout_ms_; }
+
   // Format parsed mount points as lines "name path", optionally with a header.
   std::string format_allowed_mount_points(bool include_header) const;
 
@@ -0,0 +1,149 @@
+#include "sys.h"
+#include "Attachment.h"
+#include "Application.h"
+#include "remountd_error.h"
+#include "utils.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <system_error>
+
+#include "debug.h"
+
+namespace remountd {
+namespace {
+
+// The id of the next attachment; 0 means "no attachment" to the executor.
+std::atomic<uint64_t> s_next_attachment_id{1};
+
+} // namespace
+
+Attachment::Attachment(pid_t pid, std::vector<std::string_view> const& names) : id_(s_next_attachment_id++), pid_(pid)
+{
+  DoutEntering(dc::notice, "Attachment::Attachment(" << pid << ", {" << names.size() << " names})");
+
+  Application const& application = Application::instance();
+  std::vector<Application::AllowedMountPoint> const& allowed_mount_points = application.allowed_mount_points();
+  allow_mask_.assign((allowed_mount_points.size() + 63) / 64, 0);
+  for (std::string_view const name : names)
+  {
+    Application::AllowedMountPoint const* const allowed_mount_point = find_allowed_mount_point(name);
+    if (!allowed_mount_point)
+      throw_error(errc::invalid_argument, std::string(name) + " is not an allowed identifier");
+    std::size_t const allow_index = allowed_mount_point - allowed_mount_points.data();
+    allow_mask_[allow_index / 64] |= uint64_t{1} << (allow_index % 64);
+  }
+  set_list_reply();
+
+  pidfd_.reset(static_cast<int>(syscall(SYS_pidfd_open, pid, 0)));
+  if (!pidfd_.valid())
+    throw std::system_error(errno, std::generic_category(), "pidfd_open(" + std::to_string(pid) + ") failed");
+
+  // Only root may enter the directory; the sandbox gets to see the socket through a bind-mount.
+  std::filesystem::path const& directory = application.attach_directory();
+  if (mkdir(directory.c_str(), 0700) != 0 && errno != EEXIST)
+    throw std::system_error(errno, std::generic_category(), "mkdir('" + directory.native() + "') failed");
+
+  socket_path_ = directory / (std::to_string(pid) + "." + std::to_string(id_) + ".sock");
+  std::string const& socket_native_path = socket_path_.native();
+  if (socket_native_path.size() >= sizeof(sockaddr_un::sun_path))
+    throw_error(errc::socket_path_too_long, "socket path is too long for AF_UNIX: '" + socket_native_path + "'");
+
+  ScopedFd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0));
+  if (!fd.valid())
+    throw std::system_error(errno, std::generic_category(), "socket(AF_UNIX) failed");
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::copy(socket_native_path.begin(), socket_native_path.end(), addr.sun_path);
+
+  // A socket with the same name can only be left over from a previous run.
+  unlink(socket_native_path.c_str());
+  if (bind(fd.get(), reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0)
+    throw std::system_error(errno, std::generic_category(), "bind('" + socket_native_path + "') failed");
+  listener_fd_ = std::move(fd);
+
+  // Every process that can reach the socket may use it: that is the sandbox.
+  if (chmod(socket_native_path.c_str(), 0666) != 0)
+  {
+    int const err = errno;
+    close_listener();
+    throw std::system_error(err, std::generic_category(), "chmod('" + socket_native_path + "') failed");
+  }
+
+  if (listen(listener_fd_.get(), static_cast<int>(application.listen_backlog())) != 0)
+  {
+    int const err = errno;
+    close_listener();
+    throw std::system_error(err, std::generic_category(), "listen('" + socket_native_path + "') failed");
+  }
+}
+
+Attachment::Attachment(uint64_t id, pid_t pid, ScopedFd pidfd, ScopedFd listener_fd, std::vector<uint64_t> allow_mask) :
+  id_(id), pid_(pid), pidfd_(std::move(pidfd)), listener_fd_(std::move(listener_fd)), allow_mask_(std::move(allow_mask))
+{
+  DoutEntering(dc::notice, "Attachment::Attachment(" << id << ", " << pid << ", ...)");
+
+  // New attachments must not get the id, and with it the socket name, of this one.
+  uint64_t next_id = s_next_attachment_id;
+  while (next_id <= id && !s_next_attachment_id.compare_exchange_weak(next_id, id + 1))
+    ;
+
+  sockaddr_un addr{};
+  socklen_t addr_length = sizeof(addr);
+  if (getsockname(listener_fd_.get(), reinterpret_cast<sockaddr*>(&addr), &addr_length) != 0)
+    throw std::system_error(errno, std::generic_category(), "getsockname failed");
+  if (addr.sun_family != AF_UNIX || addr_length <= offsetof(sockaddr_un, sun_path) || addr.sun_path[0] == '\0')
+    throw_error(errc::socket_path_not_socket, "the handed over socket of attachment " + std::to_string(id) + " is not bound to a path");
+  socket_path_ = std::string(addr.sun_path, strnlen(addr.sun_path, addr_length - offsetof(sockaddr_un, sun_path)));
+
+  // Allow-entries that no longer exist are dropped.
+  std::size_t const number_of_allowed_mount_points = Application::instance().allowed_mount_points().size();
+  allow_mask_.resize((number_of_allowed_mount_points + 63) / 64);
+  if (number_of_allowed_mount_points % 64 != 0)
+    allow_mask_.back() &= (uint64_t{1} << (number_of_allowed_mount_points % 64)) - 1;
+  set_list_reply();
+}
+
+Attachment::~Attachment()
+{
+  DoutEntering(dc::notice, "Attachment::~Attachment() [" << pid_ << "]");
+  close_listener();
+}
+
+void Attachment::set_list_reply()
+{
+  std::vector<Application::AllowedMountPoint> const& allowed_mount_points = Application::instance().allowed_mount_points();
+  list_reply_.clear();
+  for (std::size_t allow_index = 0; allow_index < allowed_mount_points.size(); ++allow_index)
+    if (serves(allow_index))
+      list_reply_.append(allowed_mount_points[allow_index].name_).append(" ").append(allowed_mount_points[allow_index].path_.native()).append("\n");
+}
+
+bool Attachment::exited() const
+{
+  pollfd poll_fd{pidfd_.get(), POLLIN, 0};
+  return poll(&poll_fd, 1, 0) > 0;
+}
+
+void Attachment::close_listener()
+{
+  if (!listener_fd_.valid())
+    return;
+
+  listener_fd_.reset();
+  std::error_code ec;
+  std::filesystem::remove(socket_path_, ec);
+}
+
+} // namespace remountd
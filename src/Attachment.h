@@ -0,0 +1,98 @@
+#pragma once
+
+#include "ScopedFd.h"
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace remountd {
+
+// Attachment
+//
+// A listening socket that remountd created for one sandbox with the
+// privileged `attach` command.
+//
+// The socket is bound to the mount namespace of the sandbox and to a fixed
+// subset of the allow-entries:
+// requests that arrive on it always remount in that namespace and may use
+// exactly those names, so neither the pid of the request nor the users and
+// groups of the allow-entry are looked up. Access control is the socket
+// itself: it is created in Application::attach_directory(), which only root
+// can enter, so that only the sandbox that it is bind-mounted into can
+// reach it.
+//
+// The executor pins the mount namespace and root directory of the process
+// under id(), when the attachment is made (see PrivilegedExecutor), so that
+// a request can not end up in another namespace when the pid is reused.
+//
+// The attachment lasts as long as that one process: the socket is served
+// by the Reactor that handled the `attach` command until the process exits;
+// then the socket is closed and unlinked, the connected clients are closed
+// and requests that are still on their way are refused. The pid should
+// therefore be the init process of the sandbox (or another process that
+// lives as long as the sandbox), not an arbitrary member of it.
+//
+// A restart does not end an attachment: the AttachmentRegistry passes the
+// socket to the next instance, which continues serving it.
+class Attachment
+{
+ private:
+  uint64_t id_;                         // Identifies the attachment to the executor; unique within the daemon.
+  pid_t pid_;                           // The process whose mount namespace requests are executed in.
+  ScopedFd pidfd_;                      // pidfd of pid_; becomes readable when the process exits.
+  ScopedFd listener_fd_;                // The listening socket.
+  std::filesystem::path socket_path_;   // Path that listener_fd_ is bound to.
+  std::vector<uint64_t> allow_mask_;    // Bitset of the indices of the allow-entries that may be used.
+  std::string list_reply_;              // Reply to `list` on this socket.
+
+  // Set list_reply_ from allow_mask_.
+  void set_list_reply();
+
+ public:
+  // Create and bind the socket for the sandbox that process `pid` belongs to, serving the allow-entries with the given names.
+  // Throws std::system_error on failure.
+  Attachment(pid_t pid, std::vector<std::string_view> const& names);
+
+  // Continue attachment `id` of process `pid`, that a previous instance handed over: with `pidfd` of pid, the bound and listening
+  // `listener_fd`, and the allow-entries in `allow_mask`. Throws std::system_error on failure.
+  Attachment(uint64_t id, pid_t pid, ScopedFd pidfd, ScopedFd listener_fd, std::vector<uint64_t> allow_mask);
+
+  // Close and unlink the socket.
+  ~Attachment();
+
+  Attachment(Attachment const&) = delete;
+  Attachment& operator=(Attachment const&) = delete;
+
+  // Accessors.
+  uint64_t id() const { return id_; }
+  pid_t pid() const { return pid_; }
+  int pidfd() const { return pidfd_.get(); }
+  int listener_fd() const { return listener_fd_.get(); }
+  std::filesystem::path const& socket_path() const { return socket_path_; }
+  std::string const& list_reply() const { return list_reply_; }
+  std::vector<uint64_t> const& allow_mask() const { return allow_mask_; }
+
+  // Return true if the process exited.
+  bool exited() const;
+
+  // Close the listening socket and remove it from the filesystem.
+  void close_listener();
+
+  // Close the listening socket but leave it in the filesystem, because the next instance continues it.
+  void release_listener() { listener_fd_.reset(); }
+
+  // Return true if the allow-entry with index `allow_index` may be used through this socket.
+  bool serves(std::size_t allow_index) const
+  {
+    return (allow_mask_[allow_index / 64] & (uint64_t{1} << (allow_index % 64))) != 0;
+  }
+};
+
+} // namespace remountd
@@ -0,0 +1,145 @@
+#include "sys.h"
+#include "AttachmentRegistry.h"
+#include "Attachment.h"
+#include "ScopedFd.h"
+#include "ServiceNotifier.h"
+#include "SocketServer.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "debug.h"
+
+namespace remountd {
+namespace {
+
+// Names in the systemd FD store.
+constexpr std::string_view stored_attachments_name_c = "state.attachments";                 // memfd that describes the stored attachments.
+constexpr std::string_view stored_attachment_name_prefix_c = "state.attachment.";          // Followed by the id, and ".listener" or ".pidfd".
+static_assert(stored_attachments_name_c.starts_with(SocketServer::stored_fd_prefix_c));
+static_assert(stored_attachment_name_prefix_c.starts_with(SocketServer::stored_fd_prefix_c));
+
+// Return the name of the stored fd `what` of attachment `id`.
+std::string stored_fd_name(uint64_t id, std::string_view what)
+{
+  return std::string(stored_attachment_name_prefix_c).append(std::to_string(id)).append(".").append(what);
+}
+
+} // namespace
+
+void AttachmentRegistry::add(std::shared_ptr<Attachment> attachment)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  attachments_.push_back(std::move(attachment));
+}
+
+void AttachmentRegistry::remove(Attachment const& attachment)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::erase_if(attachments_, [&attachment](std::shared_ptr<Attachment> const& registered){ return registered.get() == &attachment; });
+}
+
+void AttachmentRegistry::hand_over()
+{
+  DoutEntering(dc::notice, "AttachmentRegistry::hand_over()");
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string records;
+  uint32_t number_of_stored_attachments = 0;
+  for (std::shared_ptr<Attachment> const& attachment : attachments_)
+  {
+    if (attachment->listener_fd() < 0 || attachment->exited())
+      continue;
+    if (!ServiceNotifier::store_fd(stored_fd_name(attachment->id(), "pidfd"), attachment->pidfd()))
+      continue;
+    if (!ServiceNotifier::store_fd(stored_fd_name(attachment->id(), "listener"), attachment->listener_fd()))
+    {
+      ServiceNotifier::remove_stored_fd(stored_fd_name(attachment->id(), "pidfd"));
+      continue;
+    }
+    // The FD store keeps the socket open; the next instance continues on the same socket file.
+    attachment->release_listener();
+
+    std::vector<uint64_t> const& allow_mask = attachment->allow_mask();
+    StateRecord const record{attachment->id(), attachment->pid(), static_cast<uint32_t>(allow_mask.size())};
+    records.append(reinterpret_cast<char const*>(&record), sizeof(record));
+    records.append(reinterpret_cast<char const*>(allow_mask.data()), allow_mask.size() * sizeof(uint64_t));
+    ++number_of_stored_attachments;
+  }
+  if (number_of_stored_attachments == 0)
+    return;
+
+  ScopedFd const memfd(memfd_create("remountd-attachments", MFD_CLOEXEC));
+  if (!memfd.valid())
+    throw std::system_error(errno, std::generic_category(), "memfd_create failed");
+  StateHeader const header{state_magic_c, number_of_stored_attachments};
+  if (write(memfd.get(), &header, sizeof(header)) != sizeof(header) ||
+      write(memfd.get(), records.data(), records.size()) != static_cast<ssize_t>(records.size()))
+    throw std::system_error(errno, std::generic_category(), "write(memfd) failed");
+  ServiceNotifier::store_fd(stored_attachments_name_c, memfd.get());
+
+  syslog(LOG_INFO, "Handed over %u attachment(s) to the next instance.", number_of_stored_attachments);
+}
+
+void AttachmentRegistry::restore(SocketServer& socket_server)
+{
+  ScopedFd const memfd = socket_server.take_stored_fd(stored_attachments_name_c);
+  if (!memfd.valid())
+    return;
+
+  DoutEntering(dc::notice, "AttachmentRegistry::restore()");
+
+  struct stat memfd_stat;
+  StateHeader header;
+  if (fstat(memfd.get(), &memfd_stat) != 0 || pread(memfd.get(), &header, sizeof(header), 0) != sizeof(header) || header.magic_ != state_magic_c)
+  {
+    syslog(LOG_WARNING, "Ignoring the handed over attachments: unknown format.");
+    return;
+  }
+
+  off_t offset = sizeof(header);
+  for (uint32_t i = 0; i < header.number_of_attachments_; ++i)
+  {
+    StateRecord record;
+    if (pread(memfd.get(), &record, sizeof(record), offset) != sizeof(record) ||
+        record.number_of_words_ > (memfd_stat.st_size - offset - sizeof(record)) / sizeof(uint64_t))
+    {
+      syslog(LOG_WARNING, "The state of the handed over attachments is truncated.");
+      break;
+    }
+    offset += sizeof(record);
+    std::vector<uint64_t> allow_mask(record.number_of_words_);
+    std::size_t const size = allow_mask.size() * sizeof(uint64_t);
+    if (pread(memfd.get(), allow_mask.data(), size, offset) != static_cast<ssize_t>(size))
+    {
+      syslog(LOG_WARNING, "The state of the handed over attachments is truncated.");
+      break;
+    }
+    offset += size;
+
+    ScopedFd pidfd = socket_server.take_stored_fd(stored_fd_name(record.id_, "pidfd"));
+    ScopedFd listener_fd = socket_server.take_stored_fd(stored_fd_name(record.id_, "listener"));
+    if (!pidfd.valid() || !listener_fd.valid())
+      continue;
+    try
+    {
+      restored_.push_back(std::make_shared<Attachment>(record.id_, record.pid_, std::move(pidfd), std::move(listener_fd), std::move(allow_mask)));
+    }
+    catch (std::system_error const& error)
+    {
+      syslog(LOG_WARNING, "Dropping handed over attachment %llu: %s", static_cast<unsigned long long>(record.id_), error.what());
+    }
+  }
+
+  syslog(LOG_INFO, "Continuing %zu attachment(s) of the previous instance.", restored_.size());
+}
+
+} // namespace remountd
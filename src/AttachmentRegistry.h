@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace remountd {
+
+class Attachment;
+class SocketServer;
+
+// AttachmentRegistry
+//
+// The attachments that are being served, shared by all reactors.
+//
+// Attachments are served by coroutines of the reactors, which are destroyed
+// when the daemon exits. The registry keeps the attachments alive beyond
+// that, so that on a restart hand_over() can pass their sockets and pidfds
+// to the systemd FD store, together with a memfd that describes them. The
+// next instance takes them back with restore(), and serves them again after
+// the executor pinned their namespaces once more. The sandboxes keep the
+// same socket (the inode that they bind-mounted) and only lose the
+// connections that were open.
+class AttachmentRegistry
+{
+ private:
+  // The format of the memfd in the FD store: a StateHeader followed by, per attachment, a StateRecord and its allow mask.
+  static constexpr uint32_t state_magic_c = 0x52415431;        // "RAT1".
+
+  struct StateHeader
+  {
+    uint32_t magic_;                    // state_magic_c.
+    uint32_t number_of_attachments_;    // The number of StateRecord's that follow.
+  };
+
+  struct StateRecord
+  {
+    uint64_t id_;                       // Attachment::id().
+    int32_t pid_;                       // Attachment::pid().
+    uint32_t number_of_words_;          // The number of uint64_t words of Attachment::allow_mask() that follow.
+  };
+
+  std::mutex mutex_;                                    // Protects attachments_.
+  std::vector<std::shared_ptr<Attachment>> attachments_;        // The attachments that are being served.
+  std::vector<std::shared_ptr<Attachment>> restored_;           // The attachments of the previous instance, until take_restored().
+
+ public:
+  // Register `attachment`, which is being served.
+  void add(std::shared_ptr<Attachment> attachment);
+
+  // Forget `attachment`, which is no longer served.
+  void remove(Attachment const& attachment);
+
+  // Pass the attachments whose process is still alive to the systemd FD store (after the reactors stopped).
+  void hand_over();
+
+  // Take the attachments that the previous instance handed over from the FD store of `socket_server`.
+  void restore(SocketServer& socket_server);
+
+  // Return the restored attachments, which the caller has to serve (and add()).
+  std::vector<std::shared_ptr<Attachment>> take_restored() { return std::move(restored_); }
+};
+
+} // namespace remountd
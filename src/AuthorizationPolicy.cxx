@@ -0,0 +1,113 @@
+#include "sys.h"
+#include "AuthorizationPolicy.h"
+#include "Application.h"
+#include <syslog.h>
+#include <algorithm>
+#include "debug.h"
+
+namespace remountd {
+namespace {
+
+// Return the number of 64-bit words needed for `bits` bits.
+std::size_t words_for(std::size_t bits)
+{
+  return (bits + 63) / 64;
+}
+
+// Return the position of `id` in the sorted array `ids`, or AuthorizationPolicy::npos.
+template<typename T>
+std::size_t bit_index(std::vector<T> const& ids, T id)
+{
+  auto const iter = std::lower_bound(ids.begin(), ids.end(), id);
+  if (iter == ids.end() || *iter != id)
+    return AuthorizationPolicy::npos;
+  return static_cast<std::size_t>(iter - ids.begin());
+}
+
+void set_bit(uint64_t* words, std::size_t bit)
+{
+  words[bit / 64] |= uint64_t{1} << (bit % 64);
+}
+
+} // namespace
+
+AuthorizationPolicy::AuthorizationPolicy(std::vector<std::string> const& listener_names)
+{
+  std::vector<Application::AllowedMountPoint> const& allowed_mount_points = Application::instance().allowed_mount_points();
+
+  for (Application::AllowedMountPoint const& allowed_mount_point : allowed_mount_points)
+  {
+    uids_.insert(uids_.end(), allowed_mount_point.users_.begin(), allowed_mount_point.users_.end());
+    gids_.insert(gids_.end(), allowed_mount_point.groups_.begin(), allowed_mount_point.groups_.end());
+  }
+  std::sort(uids_.begin(), uids_.end());
+  uids_.erase(std::unique(uids_.begin(), uids_.end()), uids_.end());
+  std::sort(gids_.begin(), gids_.end());
+  gids_.erase(std::unique(gids_.begin(), gids_.end()), gids_.end());
+
+  uid_words_ = words_for(uids_.size());
+  gid_words_ = words_for(gids_.size());
+  std::size_t const stride = uid_words_ + gid_words_;
+  masks_.assign(allowed_mount_points.size() * stride, 0);
+  restricted_.assign(allowed_mount_points.size(), false);
+  listener_words_ = words_for(listener_names.size());
+  listener_masks_.assign(allowed_mount_points.size() * listener_words_, 0);
+
+  for (std::size_t allow_index = 0; allow_index < allowed_mount_points.size(); ++allow_index)
+  {
+    Application::AllowedMountPoint const& allowed_mount_point = allowed_mount_points[allow_index];
+    uint64_t* const uid_mask = masks_.data() + allow_index * stride;
+    uint64_t* const gid_mask = uid_mask + uid_words_;
+    for (uid_t const uid : allowed_mount_point.users_)
+      set_bit(uid_mask, bit_index(uids_, uid));
+    for (gid_t const gid : allowed_mount_point.groups_)
+      set_bit(gid_mask, bit_index(gids_, gid));
+    restricted_[allow_index] = !allowed_mount_point.users_.empty() || !allowed_mount_point.groups_.empty();
+
+    uint64_t* const listener_mask = listener_masks_.data() + allow_index * listener_words_;
+    for (std::size_t listener_index = 0; listener_index < listener_names.size(); ++listener_index)
+      if (allowed_mount_point.sockets_.empty() ||
+          std::find(allowed_mount_point.sockets_.begin(), allowed_mount_point.sockets_.end(), listener_names[listener_index]) != allowed_mount_point.sockets_.end())
+        set_bit(listener_mask, listener_index);
+    for (std::string const& socket_name : allowed_mount_point.sockets_)
+      if (std::find(listener_names.begin(), listener_names.end(), socket_name) == listener_names.end())
+        syslog(LOG_WARNING, "allow-entry '%s' refers to socket '%s', which was not passed by systemd",
+            allowed_mount_point.name_.c_str(), socket_name.c_str());
+  }
+
+  Dout(dc::notice, "AuthorizationPolicy: " << uids_.size() << " distinct uids, " << gids_.size() << " distinct gids.");
+}
+
+void AuthorizationPolicy::compile_subject(Subject& subject, std::size_t listener_index, uid_t uid, gid_t gid, std::span<gid_t const> groups) const
+{
+  subject.listener_bit_ = listener_index;
+  subject.uid_bit_ = bit_index(uids_, uid);
+  subject.group_words_.assign(gid_words_, 0);
+  if (gids_.empty())
+    return;
+
+  if (std::size_t const bit = bit_index(gids_, gid); bit != npos)
+    set_bit(subject.group_words_.data(), bit);
+  for (gid_t const group : groups)
+    if (std::size_t const bit = bit_index(gids_, group); bit != npos)
+      set_bit(subject.group_words_.data(), bit);
+}
+
+bool AuthorizationPolicy::authorized(Subject const& subject, std::size_t allow_index) const
+{
+  if (!restricted_[allow_index])
+    return true;
+
+  uint64_t const* const uid_mask = masks_.data() + allow_index * (uid_words_ + gid_words_);
+  if (subject.uid_bit_ != npos && (uid_mask[subject.uid_bit_ / 64] & (uint64_t{1} << (subject.uid_bit_ % 64))) != 0)
+    return true;
+
+  uint64_t const* const gid_mask = uid_mask + uid_words_;
+  for (std::size_t word = 0; word < gid_words_; ++word)
+    if ((gid_mask[word] & subject.group_words_[word]) != 0)
+      return true;
+
+  return false;
+}
+
+} // namespace remountd
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace remountd {
+
+// AuthorizationPolicy
+//
+// The `users` and `groups` restrictions of all allow-entries, compiled
+// into bitsets when the config is loaded.
+//
+// Every uid and gid that occurs in any allow-entry gets a bit index (the
+// position in a sorted array of all of them). Each allow-entry stores one
+// bitset of the users and one of the groups that may use it. The peer of a
+// connection is translated once into a Subject: the bit of its uid and the
+// bitset of all of its groups (primary and supplementary, SO_PEERGROUPS).
+// Authorizing a request is then one bit test plus an AND over the group
+// words (one word for up to 64 distinct configured groups), independent
+// of the number of allow-entries and of the size of the group list of
+// the peer.
+//
+// An allow-entry without users and groups may be used by every peer that
+// can connect to the socket.
+//
+// Likewise, each allow-entry has a bitset of the listeners (by index in
+// SocketServer::listeners()) that serve it: those whose name is in its
+// `sockets` list, or all of them if that list is empty.
+class AuthorizationPolicy
+{
+ public:
+  // Subject
+  //
+  // The peer of one connection, as seen by this policy.
+  class Subject
+  {
+   private:
+    std::size_t listener_bit_ = 0;              // Index of the listener that the peer connected to.
+    std::size_t uid_bit_ = npos;                // Bit index of the uid of the peer, or npos if no allow-entry mentions it.
+    std::vector<uint64_t> group_words_;         // Bitset of the configured groups that the peer is a member of.
+
+    friend class AuthorizationPolicy;
+  };
+
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+ private:
+  std::vector<uid_t> uids_;                     // Sorted distinct uids of all allow-entries; the index is the bit index.
+  std::vector<gid_t> gids_;                     // Sorted distinct gids of all allow-entries; the index is the bit index.
+  std::size_t uid_words_ = 0;                   // Number of 64-bit words in a uid bitset.
+  std::size_t gid_words_ = 0;                   // Number of 64-bit words in a gid bitset.
+  std::size_t listener_words_ = 0;              // Number of 64-bit words in a listener bitset.
+  std::vector<uint64_t> listener_masks_;        // Per allow-entry: bitset of the listeners that serve it.
+  std::vector<uint64_t> masks_;                 // Per allow-entry: uid bitset followed by gid bitset.
+  std::vector<char> restricted_;                // Per allow-entry: true if it has users or groups.
+
+ public:
+  // Compile the policy from Application::allowed_mount_points(), for listeners with the given names.
+  explicit AuthorizationPolicy(std::vector<std::string> const& listener_names);
+
+  AuthorizationPolicy(AuthorizationPolicy const&) = delete;
+  AuthorizationPolicy& operator=(AuthorizationPolicy const&) = delete;
+
+  // Return true if any allow-entry has a groups restriction, in which case the supplementary groups of a peer are needed.
+  bool uses_groups() const { return !gids_.empty(); }
+
+  // Fill `subject` for a peer, connected to the listener with index `listener_index`, with the given uid, primary gid and supplementary groups.
+  void compile_subject(Subject& subject, std::size_t listener_index, uid_t uid, gid_t gid, std::span<gid_t const> groups) const;
+
+  // Return true if the allow-entry with index `allow_index` is served on the listener with index `listener_index`.
+  bool served(std::size_t listener_index, std::size_t allow_index) const
+  {
+    return (listener_masks_[allow_index * listener_words_ + listener_index / 64] & (uint64_t{1} << (listener_index % 64))) != 0;
+  }
+
+  // Return true if the allow-entry with index `allow_index` is served on the listener that `subject` connected to.
+  bool served(Subject const& subject, std::size_t allow_index) const { return served(subject.listener_bit_, allow_index); }
+
+  // Return true if `subject` may use the allow-entry with index `allow_index`.
+  bool authorized(Subject const& subject, std::size_t allow_index) const;
+};
+
+} // namespace remountd
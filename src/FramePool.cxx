@@ -0,0 +1,67 @@
+#include "sys.h"
+#include "FramePool.h"
+
+#include <new>
+
+#include "debug.h"
+
+namespace remountd {
+
+//static
+FramePool& FramePool::instance()
+{
+  thread_local FramePool s_frame_pool;
+  return s_frame_pool;
+}
+
+FramePool::~FramePool()
+{
+  for (FreeFrame* head : free_lists_)
+  {
+    while (head)
+    {
+      FreeFrame* const next = head->next_;
+      ::operator delete(static_cast<void*>(head));
+      head = next;
+    }
+  }
+}
+
+//static
+void* FramePool::allocate(std::size_t size)
+{
+  FramePool& pool = instance();
+  if (size == 0 || size > max_pooled_size_c)
+  {
+    // Request coroutines are meant to fit; keep large objects out of their frames.
+    Dout(dc::warning, "FramePool::allocate: a coroutine frame of " << size << " bytes is too large to be pooled.");
+    ++pool.fresh_allocations_;
+    return ::operator new(size);
+  }
+
+  FreeFrame*& head = pool.free_lists_[size_class(size)];
+  if (head)
+  {
+    FreeFrame* const frame = head;
+    head = frame->next_;
+    return frame;
+  }
+
+  ++pool.fresh_allocations_;
+  return ::operator new((size_class(size) + 1) * granularity_c);
+}
+
+//static
+void FramePool::deallocate(void* frame, std::size_t size) noexcept
+{
+  if (size == 0 || size > max_pooled_size_c)
+  {
+    ::operator delete(frame);
+    return;
+  }
+
+  FreeFrame*& head = instance().free_lists_[size_class(size)];
+  head = new (frame) FreeFrame{head};
+}
+
+} // namespace remountd
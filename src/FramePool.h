@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace remountd {
+
+// FramePool
+//
+// Per-thread recycling allocator for coroutine frames.
+//
+// Coroutines are always created and destroyed by the Reactor thread that
+// runs them, so a thread_local free list per size class suffices and no
+// locking is needed. Frames are rounded up to a multiple of granularity_c;
+// frames larger than max_pooled_size_c bypass the pool (and are counted as
+// fresh allocations). In steady state every frame is served from a free
+// list and the allocator is not called.
+class FramePool
+{
+ public:
+  static constexpr std::size_t granularity_c = 64;              // Size classes are multiples of this.
+  static constexpr std::size_t max_pooled_size_c = 4096;        // Larger frames are not pooled.
+  static constexpr std::size_t number_of_classes_c = max_pooled_size_c / granularity_c;
+
+ private:
+  // A released frame; the first bytes of the frame are reused as list link.
+  struct FreeFrame
+  {
+    FreeFrame* next_;
+  };
+
+  std::array<FreeFrame*, number_of_classes_c> free_lists_{};    // Released frames per size class.
+  uint64_t fresh_allocations_ = 0;                              // Number of frames that had to be obtained from the allocator.
+
+  // Return the FramePool of the calling thread.
+  static FramePool& instance();
+
+  // Return size class index of `size`.
+  static std::size_t size_class(std::size_t size) { return (size - 1) / granularity_c; }
+
+ public:
+  FramePool() = default;
+  ~FramePool();
+
+  FramePool(FramePool const&) = delete;
+  FramePool& operator=(FramePool const&) = delete;
+
+  // Allocate a coroutine frame of `size` bytes.
+  static void* allocate(std::size_t size);
+
+  // Release a coroutine frame of `size` bytes that was returned by allocate().
+  static void deallocate(void* frame, std::size_t size) noexcept;
+
+  // Return the number of frames of the calling thread that were not served from a free list.
+  static uint64_t fresh_allocations() { return instance().fresh_allocations_; }
+};
+
+} // namespace remountd
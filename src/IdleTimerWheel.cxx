@@ -0,0 +1,59 @@
+#include "sys.h"
+#include "IdleTimerWheel.h"
+#include "SocketClient.h"
+#include <algorithm>
+
+namespace remountd {
+
+void IdleTimerWheel::insert(SocketClient& client, uint64_t expiry_tick)
+{
+  SocketClient*& head = slots_[expiry_tick % number_of_slots_c];
+  client.idle_expiry_tick_ = expiry_tick;
+  client.idle_prev_ = nullptr;
+  client.idle_next_ = head;
+  if (head)
+    head->idle_prev_ = &client;
+  head = &client;
+  client.in_idle_wheel_ = true;
+  ++size_;
+}
+
+void IdleTimerWheel::remove(SocketClient& client)
+{
+  if (!client.in_idle_wheel_)
+    return;
+
+  if (client.idle_prev_)
+    client.idle_prev_->idle_next_ = client.idle_next_;
+  else
+    slots_[client.idle_expiry_tick_ % number_of_slots_c] = client.idle_next_;
+  if (client.idle_next_)
+    client.idle_next_->idle_prev_ = client.idle_prev_;
+  client.idle_prev_ = client.idle_next_ = nullptr;
+  client.in_idle_wheel_ = false;
+  --size_;
+}
+
+void IdleTimerWheel::advance(uint64_t ticks, std::vector<SocketClient*>& expired)
+{
+  uint64_t const target_tick = current_tick_ + ticks;
+  // Every slot has to be visited at most once, even when more than a full revolution passed.
+  uint64_t const steps = std::min<uint64_t>(ticks, number_of_slots_c);
+  for (uint64_t tick = target_tick - steps + 1; tick <= target_tick; ++tick)
+  {
+    SocketClient* client = slots_[tick % number_of_slots_c];
+    while (client)
+    {
+      SocketClient* const next = client->idle_next_;
+      if (client->idle_expiry_tick_ <= target_tick)
+      {
+        remove(*client);
+        expired.push_back(client);
+      }
+      client = next;
+    }
+  }
+  current_tick_ = target_tick;
+}
+
+} // namespace remountd
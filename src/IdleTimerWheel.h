@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace remountd {
+
+class SocketClient;
+
+// IdleTimerWheel
+//
+// Hashed timer wheel that tracks when clients become idle, with a
+// resolution of one tick. Every slot is an intrusive doubly-linked list
+// threaded through the clients themselves, so inserting and removing a
+// client is O(1) and does not allocate.
+//
+// A client whose expiry tick lies more than number_of_slots_c ticks in the
+// future simply stays in its slot for more than one revolution; advance()
+// only reports clients whose expiry tick passed.
+//
+// Activity of a client does not move it in the wheel: the Reactor only
+// records the tick of the last activity and, when the entry expires,
+// re-inserts the client if it was active in the meantime.
+class IdleTimerWheel
+{
+ public:
+  static constexpr std::size_t number_of_slots_c = 256;       // Number of slots; a power of two.
+
+ private:
+  std::array<SocketClient*, number_of_slots_c> slots_{};      // Head of the list of clients of each slot.
+  uint64_t current_tick_ = 0;                                 // Number of ticks that passed.
+  std::size_t size_ = 0;                                      // Number of clients in the wheel.
+
+ public:
+  // Add `client` (which must not be in the wheel) to expire at `expiry_tick` (which must be larger than current_tick()).
+  void insert(SocketClient& client, uint64_t expiry_tick);
+
+  // Remove `client` from the wheel, if it is in there.
+  void remove(SocketClient& client);
+
+  // Advance the wheel by `ticks` and append the clients that expired to `expired`, removing them from the wheel.
+  void advance(uint64_t ticks, std::vector<SocketClient*>& expired);
+
+  // Return true if no client is in the wheel.
+  bool empty() const { return size_ == 0; }
+
+  // Return the current tick.
+  uint64_t current_tick() const { return current_tick_; }
+};
+
+} // namespace remountd
@@ -0,0 +1,268 @@
+#include "sys.h"
+#include "MountTable.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <linux/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <deque>
+#include <unordered_set>
+
+#include "debug.h"
+
+#ifndef SYS_statmount
+#define SYS_statmount 457
+#endif
+#ifndef SYS_listmount
+#define SYS_listmount 458
+#endif
+#ifndef STATX_MNT_ID_UNIQUE
+#define STATX_MNT_ID_UNIQUE 0x00004000U
+#endif
+
+namespace remountd {
+namespace {
+
+// The kernel ABI of listmount(2) and statmount(2), which the system headers might not have yet.
+
+// struct mnt_id_req (version 0).
+struct MountIdRequest
+{
+  uint32_t size_;
+  uint32_t spare_;
+  uint64_t mount_id_;
+  uint64_t param_;
+};
+
+// The fixed part of struct statmount; the strings follow it.
+struct MountStatus
+{
+  uint32_t size_;
+  uint32_t spare1_;
+  uint64_t mask_;
+  uint32_t sb_dev_major_;
+  uint32_t sb_dev_minor_;
+  uint64_t sb_magic_;
+  uint32_t sb_flags_;
+  uint32_t fs_type_;
+  uint64_t mount_id_;
+  uint64_t parent_id_;
+  uint32_t mount_id_old_;
+  uint32_t parent_id_old_;
+  uint64_t mount_attributes_;
+  uint64_t propagation_;
+  uint64_t peer_group_;
+  uint64_t master_;
+  uint64_t propagate_from_;
+  uint32_t mount_root_;
+  uint32_t mount_point_;                // Offset of the mount point in the strings.
+  uint64_t spare2_[50];
+};
+
+static_assert(sizeof(MountIdRequest) == 24 && sizeof(MountStatus) == 512);
+
+constexpr uint64_t statmount_mount_basic_c = 0x2;       // STATMOUNT_MNT_BASIC.
+constexpr uint64_t statmount_mount_point_c = 0x10;      // STATMOUNT_MNT_POINT.
+constexpr std::size_t listmount_batch_size_c = 256;     // Number of mount ids per listmount(2) call.
+
+// Decode the octal escapes (\ooo) of a path in a mountinfo file into `out`.
+void decode_escapes(std::string_view path, std::string& out)
+{
+  out.clear();
+  for (std::size_t index = 0; index < path.size(); ++index)
+  {
+    if (path[index] == '\\' && index + 3 < path.size() &&
+        path[index + 1] >= '0' && path[index + 1] <= '3' &&
+        path[index + 2] >= '0' && path[index + 2] <= '7' &&
+        path[index + 3] >= '0' && path[index + 3] <= '7')
+    {
+      out.push_back(static_cast<char>(((path[index + 1] - '0') << 6) | ((path[index + 2] - '0') << 3) | (path[index + 3] - '0')));
+      index += 3;
+    }
+    else
+      out.push_back(path[index]);
+  }
+}
+
+} // namespace
+
+bool MountTable::stat_mount(uint64_t mount_id, Mount& mount)
+{
+  MountIdRequest const request{sizeof(MountIdRequest), 0, mount_id, statmount_mount_basic_c | statmount_mount_point_c};
+  if (buffer_.empty())
+    buffer_.resize((sizeof(MountStatus) + 4096) / sizeof(uint64_t));
+  // The buffer is too small (EOVERFLOW) only for very long paths.
+  while (syscall(SYS_statmount, &request, buffer_.data(), buffer_.size() * sizeof(uint64_t), 0) != 0)
+  {
+    if (errno != EOVERFLOW)
+      return false;
+    buffer_.resize(buffer_.size() * 2);
+  }
+
+  MountStatus const& status = *reinterpret_cast<MountStatus const*>(buffer_.data());
+  char const* const strings = reinterpret_cast<char const*>(buffer_.data()) + sizeof(MountStatus);
+  mount.mount_id_ = mount_id;
+  mount.parent_id_ = status.parent_id_;
+  mount.mount_point_ = (status.mask_ & statmount_mount_point_c) ? strings + status.mount_point_ : "";
+  mount.read_only_ = (status.mount_attributes_ & MOUNT_ATTR_RDONLY) != 0;
+  return true;
+}
+
+std::error_code MountTable::list(int directory_fd, std::string_view directory, int mountinfo_fd, std::vector<Mount>& mounts)
+{
+  DoutEntering(dc::notice, "MountTable::list(" << directory_fd << ", \"" << directory << "\", " << mountinfo_fd << ")");
+
+  std::size_t const first = mounts.size();
+  std::error_code error = list_mounts(directory_fd, directory, mounts);
+  if (error == std::errc::function_not_supported)
+  {
+    mounts.resize(first);
+    error = parse_mountinfo(mountinfo_fd, directory, mounts);
+  }
+  if (!error)
+    std::sort(mounts.begin() + first, mounts.end(), [](Mount const& lhs, Mount const& rhs){ return lhs.mount_point_ < rhs.mount_point_; });
+  return error;
+}
+
+std::error_code MountTable::list_mounts(int directory_fd, std::string_view directory, std::vector<Mount>& mounts)
+{
+  // The mount that contains the directory; listmount(2) needs its unique id.
+  struct statx stx;
+  if (statx(directory_fd, "", AT_EMPTY_PATH | AT_STATX_DONT_SYNC, STATX_MNT_ID_UNIQUE, &stx) != 0)
+    return {errno, std::generic_category()};
+  if (!(stx.stx_mask & STATX_MNT_ID_UNIQUE))
+    return std::make_error_code(std::errc::function_not_supported);
+
+  Mount mount;
+  if (!stat_mount(stx.stx_mnt_id, mount))
+    return {errno, std::generic_category()};
+  if (mount.mount_point_ == directory)
+    mounts.push_back(mount);
+
+  // Some kernels list only the children of a mount, others all of its descendants. Start with the containing
+  // mount, keep the mounts at or below the directory and descend into those, unless the listing was recursive.
+  std::unordered_set<uint64_t> seen{stx.stx_mnt_id};
+  std::deque<uint64_t> parents{stx.stx_mnt_id};
+  bool recursive = false;
+  bool at_containing_mount = true;
+  children_.resize(listmount_batch_size_c);
+  while (!parents.empty())
+  {
+    MountIdRequest request{sizeof(MountIdRequest), 0, parents.front(), 0};
+    parents.pop_front();
+    for (;;)
+    {
+      long const count = syscall(SYS_listmount, &request, children_.data(), children_.size(), 0);
+      if (count < 0)
+      {
+        // A mount that was unmounted meanwhile has no children anymore.
+        if (errno == ENOENT && !at_containing_mount)
+          break;
+        return {errno, std::generic_category()};
+      }
+      for (long index = 0; index < count; ++index)
+      {
+        if (!seen.insert(children_[index]).second)
+          continue;
+        if (!stat_mount(children_[index], mount))
+        {
+          if (errno == ENOENT)
+            continue;
+          return {errno, std::generic_category()};
+        }
+        recursive = recursive || mount.parent_id_ != request.mount_id_;
+        if (!path_has_prefix(mount.mount_point_, directory))
+          continue;
+        parents.push_back(mount.mount_id_);
+        mounts.push_back(mount);
+      }
+      if (static_cast<std::size_t>(count) < children_.size())
+        break;
+      request.param_ = children_[count - 1];
+    }
+    if (recursive)
+      break;
+    at_containing_mount = false;
+  }
+
+  return {};
+}
+
+std::error_code MountTable::parse_mountinfo(int mountinfo_fd, std::string_view directory, std::vector<Mount>& mounts)
+{
+  // The kernel generates the file while it is read; read all of it at once.
+  if (text_.empty())
+    text_.resize(64 * 1024);
+  std::size_t size = 0;
+  for (;;)
+  {
+    ssize_t const length = pread(mountinfo_fd, text_.data() + size, text_.size() - size, size);
+    if (length < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return {errno, std::generic_category()};
+    }
+    if (length == 0)
+      break;
+    size += length;
+    if (size == text_.size())
+      text_.resize(text_.size() * 2);
+  }
+
+  // Each line is: mount id, parent id, major:minor, root, mount point, mount options, optional fields, "-", ...
+  char const* position = text_.data();
+  char const* const end = position + size;
+  while (position < end)
+  {
+    char const* line_end = static_cast<char const*>(std::memchr(position, '\n', end - position));
+    if (!line_end)
+      line_end = end;
+    std::string_view fields[6];
+    std::size_t number_of_fields = 0;
+    while (number_of_fields < std::size(fields) && position < line_end)
+    {
+      char const* field_end = static_cast<char const*>(std::memchr(position, ' ', line_end - position));
+      if (!field_end)
+        field_end = line_end;
+      fields[number_of_fields++] = std::string_view(position, field_end - position);
+      position = field_end + 1;
+    }
+    position = line_end + 1;
+    if (number_of_fields < std::size(fields))
+      continue;
+
+    std::string_view mount_point = fields[4];
+    if (mount_point.find('\\') != std::string_view::npos)
+    {
+      decode_escapes(mount_point, decoded_);
+      mount_point = decoded_;
+    }
+    if (!path_has_prefix(mount_point, directory))
+      continue;
+
+    Mount& mount = mounts.emplace_back();
+    if (std::from_chars(fields[0].data(), fields[0].data() + fields[0].size(), mount.mount_id_).ec != std::errc() ||
+        std::from_chars(fields[1].data(), fields[1].data() + fields[1].size(), mount.parent_id_).ec != std::errc())
+    {
+      mounts.pop_back();
+      continue;
+    }
+    mount.mount_point_ = mount_point;
+    // The per-mount options start with "ro" or "rw".
+    std::string_view const options = fields[5];
+    mount.read_only_ = options.starts_with("ro") && (options.size() == 2 || options[2] == ',');
+  }
+  return {};
+}
+
+} // namespace remountd
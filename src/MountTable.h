@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace remountd {
+
+// MountTable
+//
+// Enumerates the mounts at or below a directory in the mount namespace of
+// the calling thread, with their read-only state, using listmount(2) and
+// statmount(2) (Linux 6.8): starting at the mount that contains the
+// directory, the mounts below it are listed by mount id, and only those
+// whose mount point is at or below the directory are kept and followed. No
+// text is parsed. Depending on the kernel version listmount(2) returns the
+// children of a mount or all of its descendants; both are handled.
+//
+// Kernels without listmount(2) get the same result from the mountinfo file
+// of the namespace instead. That file is read into a reused buffer and
+// scanned in place: lines and fields are found with memchr(3), which is
+// vectorized, only the mount id, parent id, mount point and mount options
+// of each line are looked at, and the octal escapes of a mount point are
+// only decoded if it has any. Only the mounts at or below the directory are
+// copied out.
+//
+// The executor enters the target namespace, and the root directory of the
+// requesting process, before calling list(): mount points are reported
+// relative to the root of the caller, and must be those that the requesting
+// process sees.
+class MountTable
+{
+ public:
+  // Mount
+  //
+  // One mount at or below the listed directory.
+  struct Mount
+  {
+    uint64_t mount_id_;                 // The mount id: the unique one from listmount(2), or the one of mountinfo.
+    uint64_t parent_id_;                // The mount id of the parent mount.
+    std::string mount_point_;           // Absolute path of the mount point in the namespace.
+    bool read_only_;                    // True if the mount is read-only (MOUNT_ATTR_RDONLY).
+  };
+
+ private:
+  std::vector<uint64_t> buffer_;        // Reused statmount(2) buffer (uint64_t for alignment).
+  std::vector<uint64_t> children_;      // Reused listmount(2) buffer.
+  std::vector<char> text_;              // Reused buffer for the contents of a mountinfo file.
+  std::string decoded_;                 // Scratch buffer for a mount point with escapes.
+
+  // Fill `mount` from statmount(2) of mount `mount_id`; returns false with errno set on failure.
+  bool stat_mount(uint64_t mount_id, Mount& mount);
+
+  // Append the mounts at or below `directory` to `mounts` using listmount(2) (see list()).
+  std::error_code list_mounts(int directory_fd, std::string_view directory, std::vector<Mount>& mounts);
+
+ public:
+  // Append the mounts at or below `directory` to `mounts` from the mountinfo file `mountinfo_fd`.
+  // The mount points in that file must be relative to the same root as `directory`.
+  std::error_code parse_mountinfo(int mountinfo_fd, std::string_view directory, std::vector<Mount>& mounts);
+
+  // Append the mounts at or below `directory`, of which `directory_fd` is an (O_PATH) fd, to `mounts`, sorted by mount point.
+  // Uses parse_mountinfo() on `mountinfo_fd` (/proc/<pid>/mountinfo of the requesting process) if the kernel
+  // does not have listmount(2).
+  std::error_code list(int directory_fd, std::string_view directory, int mountinfo_fd, std::vector<Mount>& mounts);
+};
+
+} // namespace remountd
@@ -0,0 +1,253 @@
+#include "sys.h"
+#include "NamespaceRegistry.h"
+
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <string_view>
+
+#include "debug.h"
+
+namespace remountd {
+namespace {
+
+// Return true if the process of `pidfd` exited.
+bool has_exited(int pidfd)
+{
+  pollfd poll_fd{pidfd, POLLIN, 0};
+  return poll(&poll_fd, 1, 0) > 0;
+}
+
+} // namespace
+
+NamespaceRegistry::Namespace* NamespaceRegistry::lookup(pid_t pid)
+{
+  std::string const proc_path = "/proc/" + std::to_string(pid);
+  std::string const namespace_path = proc_path + "/ns/mnt";
+
+  // Looking at the namespace of a process of another user requires CAP_SYS_PTRACE.
+  struct stat namespace_stat;
+  if (stat(namespace_path.c_str(), &namespace_stat) != 0)
+    return nullptr;
+
+  auto const known = namespaces_.find(namespace_stat.st_ino);
+  if (known != namespaces_.end())
+  {
+    Namespace& mount_namespace = known->second;
+    auto const member = std::find_if(mount_namespace.members_.begin(), mount_namespace.members_.end(),
+        [pid](Namespace::Member const& member){ return member.pid_ == pid; });
+    if (member == mount_namespace.members_.end())
+    {
+      ScopedFd pidfd(static_cast<int>(syscall(SYS_pidfd_open, pid, 0)));
+      if (pidfd.valid())
+        mount_namespace.members_.push_back({pid, std::move(pidfd)});
+    }
+    return &mount_namespace;
+  }
+
+  // Open the pidfd first: if the process is still alive after the namespace was opened, then that is its namespace.
+  ScopedFd pidfd(static_cast<int>(syscall(SYS_pidfd_open, pid, 0)));
+  if (!pidfd.valid())
+    return nullptr;
+  ScopedFd namespace_fd(open(namespace_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (!namespace_fd.valid())
+    return nullptr;
+  ScopedFd mountinfo_fd(open((proc_path + "/mountinfo").c_str(), O_RDONLY | O_CLOEXEC));
+  if (!mountinfo_fd.valid())
+    return nullptr;
+  if (fstat(namespace_fd.get(), &namespace_stat) != 0)
+    return nullptr;
+  if (has_exited(pidfd.get()))
+  {
+    errno = ESRCH;
+    return nullptr;
+  }
+
+  Dout(dc::notice, "Registering mount namespace " << namespace_stat.st_ino << " of pid " << pid << ".");
+  Namespace& mount_namespace = namespaces_[namespace_stat.st_ino];
+  mount_namespace.inode_ = namespace_stat.st_ino;
+  mount_namespace.namespace_fd_ = std::move(namespace_fd);
+  mount_namespace.mountinfo_fd_ = std::move(mountinfo_fd);
+  mount_namespace.members_.push_back({pid, std::move(pidfd)});
+  return &mount_namespace;
+}
+
+NamespaceRegistry::Namespace* NamespaceRegistry::pin(uint64_t attachment, pid_t pid)
+{
+  if (pins_.contains(attachment))
+  {
+    errno = EEXIST;
+    return nullptr;
+  }
+
+  // As in lookup(): what is opened while the process is still alive afterwards belongs to it.
+  ScopedFd pidfd(static_cast<int>(syscall(SYS_pidfd_open, pid, 0)));
+  if (!pidfd.valid())
+    return nullptr;
+  Namespace* const mount_namespace = lookup(pid);
+  if (!mount_namespace)
+    return nullptr;
+  ScopedFd root_fd(open(root_of(pid).c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+  if (!root_fd.valid())
+    return nullptr;
+  ScopedFd mountinfo_fd(open(mountinfo_of(pid).c_str(), O_RDONLY | O_CLOEXEC));
+  if (!mountinfo_fd.valid())
+    return nullptr;
+  if (has_exited(pidfd.get()))
+  {
+    errno = ESRCH;
+    return nullptr;
+  }
+
+  Dout(dc::notice, "Pinning mount namespace " << mount_namespace->inode_ << " of pid " << pid << " for attachment " << attachment << ".");
+  pins_.emplace(attachment, Pin{mount_namespace->inode_, std::move(pidfd), std::move(root_fd), std::move(mountinfo_fd)});
+  ++mount_namespace->pins_;
+  return mount_namespace;
+}
+
+NamespaceRegistry::Namespace* NamespaceRegistry::pinned(uint64_t attachment, std::string& root)
+{
+  auto const pin = pins_.find(attachment);
+  if (pin == pins_.end())
+    return nullptr;
+  // The magic link of the fd leads to the directory itself, also when it is not reachable from our own root.
+  root = "/proc/self/fd/" + std::to_string(pin->second.root_fd_.get());
+  return &namespaces_.at(pin->second.inode_);
+}
+
+int NamespaceRegistry::pinned_mountinfo_fd(uint64_t attachment) const
+{
+  auto const pin = pins_.find(attachment);
+  return pin == pins_.end() ? -1 : pin->second.mountinfo_fd_.get();
+}
+
+//static
+ScopedFd NamespaceRegistry::resolve(std::string const& root, std::string const& prefix, std::string const& path)
+{
+  // Opening `root` follows its magic link to the root directory of the process, in its mount namespace.
+  ScopedFd const root_fd(open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+  if (!root_fd.valid())
+    return {};
+
+  // The prefix comes from the configuration; look it up the way the process sees it, with absolute symbolic links and
+  // ".." staying inside its root.
+  open_how how{};
+  how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+  how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+  ScopedFd const prefix_fd(static_cast<int>(syscall(SYS_openat2, root_fd.get(), prefix.c_str(), &how, sizeof(how))));
+  if (!prefix_fd.valid())
+    return {};
+
+  // Resolve the rest, relative symbolic links included, without leaving the prefix.
+  std::string_view suffix = std::string_view(path).substr(prefix == "/" ? 0 : prefix.size());
+  while (suffix.starts_with('/'))
+    suffix.remove_prefix(1);
+  how.flags = O_PATH | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+  return ScopedFd(static_cast<int>(syscall(SYS_openat2, prefix_fd.get(), suffix.empty() ? "." : std::string(suffix).c_str(), &how, sizeof(how))));
+}
+
+//static
+bool NamespaceRegistry::mount_handle_key(std::string const& root, std::string const& path, MountHandleKey& key)
+{
+  struct stat root_stat;
+  if (stat(root.c_str(), &root_stat) != 0)
+    return false;
+  key = {root_stat.st_dev, root_stat.st_ino, path};
+  return true;
+}
+
+//static
+int NamespaceRegistry::mount_handle(Namespace& mount_namespace, std::string const& root, std::string const& prefix, MountHandleKey const& key)
+{
+  auto const cached = mount_namespace.mount_handles_.find(key);
+  if (cached != mount_namespace.mount_handles_.end())
+    return cached->second.get();
+
+  ScopedFd handle = resolve(root, prefix, key.path_);
+  if (!handle.valid())
+    return -1;
+
+  // Make room by dropping one (arbitrary) handle; it is resolved again when it is needed.
+  if (mount_namespace.mount_handles_.size() >= max_mount_handles_c)
+    mount_namespace.mount_handles_.erase(mount_namespace.mount_handles_.begin());
+  return mount_namespace.mount_handles_.emplace(key, std::move(handle)).first->second.get();
+}
+
+//static
+int NamespaceRegistry::cached_mount_handle(Namespace const& mount_namespace, MountHandleKey const& key)
+{
+  auto const cached = mount_namespace.mount_handles_.find(key);
+  return cached == mount_namespace.mount_handles_.end() ? -1 : cached->second.get();
+}
+
+//static
+void NamespaceRegistry::absorb_own_change(Namespace const& mount_namespace)
+{
+  // Polling a mountinfo file resets its change notification.
+  pollfd poll_fd{mount_namespace.mountinfo_fd_.get(), POLLPRI, 0};
+  poll(&poll_fd, 1, 0);
+}
+
+void NamespaceRegistry::add_poll_fds(std::vector<pollfd>& poll_fds) const
+{
+  for (auto const& [attachment, pin] : pins_)
+    poll_fds.push_back({pin.pidfd_.get(), POLLIN, 0});
+  for (auto const& [inode, mount_namespace] : namespaces_)
+  {
+    // poll(2) on a mountinfo file reports POLLPRI (and POLLERR) once per change of the mount table.
+    poll_fds.push_back({mount_namespace.mountinfo_fd_.get(), POLLPRI, 0});
+    for (Namespace::Member const& member : mount_namespace.members_)
+      poll_fds.push_back({member.pidfd_.get(), POLLIN, 0});
+  }
+}
+
+void NamespaceRegistry::handle_poll_events(pollfd const* poll_fds)
+{
+  // First the pins, so that the namespaces of those that are dropped can be evicted below.
+  for (auto iter = pins_.begin(); iter != pins_.end(); ++poll_fds)
+  {
+    if (poll_fds->revents == 0)
+    {
+      ++iter;
+      continue;
+    }
+    Dout(dc::notice, "Unpinning mount namespace " << iter->second.inode_ << " of attachment " << iter->first << ".");
+    --namespaces_.at(iter->second.inode_).pins_;
+    iter = pins_.erase(iter);
+  }
+
+  for (auto iter = namespaces_.begin(); iter != namespaces_.end();)
+  {
+    Namespace& mount_namespace = iter->second;
+    if (poll_fds++->revents & (POLLPRI | POLLERR))
+    {
+      ++mount_namespace.mountinfo_generation_;
+      mount_namespace.mount_handles_.clear();
+    }
+
+    // Forget the members that exited.
+    std::vector<Namespace::Member>& members = mount_namespace.members_;
+    std::size_t kept = 0;
+    for (std::size_t index = 0; index < members.size(); ++index)
+      if (poll_fds++->revents == 0)
+        members[kept++] = std::move(members[index]);
+    members.erase(members.begin() + kept, members.end());
+
+    if (mount_namespace.members_.empty() && mount_namespace.pins_ == 0)
+    {
+      Dout(dc::notice, "Evicting mount namespace " << mount_namespace.inode_ << ".");
+      iter = namespaces_.erase(iter);
+    }
+    else
+      ++iter;
+  }
+}
+
+} // namespace remountd
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "ScopedFd.h"
+
+#include <poll.h>
+#include <sys/types.h>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace remountd {
+
+// NamespaceRegistry
+//
+// The mount namespaces that the executor remounted in, keyed by the inode
+// number of the namespace. Every entry keeps the namespace open, so that
+// entering it is a single setns(2) on that fd instead of resolving a pid
+// again, together with a pidfd of every process that requested a remount
+// in it. When all of those processes exited the entry is evicted.
+//
+// An entry also counts how often the mount table of the namespace changed
+// since it was registered (the mountinfo generation): the mountinfo file of
+// a namespace reports POLLPRI after every change of a mount in it. It also
+// caches an O_PATH handle of every mount point that was remounted in the
+// namespace, so that the path is only resolved the first time; all handles
+// of a namespace are dropped when its mount table changes. Processes in the
+// same namespace can have different root directories, so a handle is cached
+// under the root directory (by device and inode) that the path was resolved
+// from as well as under the path.
+//
+// A handle is the result of resolving the path inside the namespace with
+// openat2(2). The allowed prefix is looked up with RESOLVE_IN_ROOT, so that
+// it is found the way the requesting process sees it, and the rest of the
+// path relative to the prefix with RESOLVE_BENEATH: relative symbolic links
+// are followed as long as they stay below the prefix, while absolute ones
+// and those that lead out of it are refused. The changes that the executor
+// makes itself are absorbed with absorb_own_change(), which could only miss
+// a change by someone else that happens at the very same moment. A handle
+// of a mount that was unmounted meanwhile fails with EINVAL and is then
+// looked up again.
+//
+// A path is resolved from the root directory of the requesting process,
+// given as a path: /proc/<pid>/root, or /proc/self/fd/<fd> of a pin. An
+// attached sandbox (see Attachment) is pinned: pin() keeps the namespace
+// and the root directory of the attached process open under the id of the
+// attachment, so that its requests keep going to that sandbox even if the
+// pid is reused. The pin is dropped when that process exits; the namespace
+// is not evicted while it is pinned.
+//
+// The registry is driven by the poll(2) loop of the executor: it appends its
+// pidfds and mountinfo fds with add_poll_fds() and handles their events in
+// handle_poll_events().
+class NamespaceRegistry
+{
+ public:
+  // MountHandleKey
+  //
+  // What a cached mount handle was resolved from.
+  struct MountHandleKey
+  {
+    dev_t root_device_;                 // Device of the root directory of the requesting process.
+    ino_t root_inode_;                  // Inode of the root directory of the requesting process.
+    std::string path_;                  // The requested path.
+
+    bool operator==(MountHandleKey const&) const = default;
+  };
+
+  struct MountHandleKeyHash
+  {
+    std::size_t operator()(MountHandleKey const& key) const
+    {
+      return std::hash<std::string>{}(key.path_) ^ (std::hash<uint64_t>{}(key.root_inode_) * 31 + key.root_device_);
+    }
+  };
+
+  // Namespace
+  //
+  // A registered mount namespace.
+  struct Namespace
+  {
+    // A process in the namespace.
+    struct Member
+    {
+      pid_t pid_;                       // The process id.
+      ScopedFd pidfd_;                  // pidfd of pid_; readable once the process exited.
+    };
+
+    uint64_t inode_;                    // Inode number of the namespace.
+    ScopedFd namespace_fd_;             // /proc/<pid>/ns/mnt of the first member.
+    ScopedFd mountinfo_fd_;             // /proc/<pid>/mountinfo of the first member; keeps reporting changes of the namespace.
+    uint64_t mountinfo_generation_ = 0; // Number of changes of the mount table seen.
+    std::vector<Member> members_;       // The processes that requested a remount in this namespace and did not exit.
+    std::unordered_map<MountHandleKey, ScopedFd, MountHandleKeyHash> mount_handles_;   // O_PATH handles of mount points, since the last change of the mount table.
+    std::size_t pins_ = 0;              // Number of pins of this namespace.
+  };
+
+  // Pin
+  //
+  // The mount namespace and root directory of an attached process.
+  struct Pin
+  {
+    uint64_t inode_;                    // Inode number of the pinned namespace.
+    ScopedFd pidfd_;                    // pidfd of the attached process; the pin is dropped once it exited.
+    ScopedFd root_fd_;                  // O_PATH fd of the root directory of the process.
+    ScopedFd mountinfo_fd_;             // /proc/<pid>/mountinfo of the process, which is relative to root_fd_.
+  };
+
+  static constexpr std::size_t max_mount_handles_c = 64;       // Maximum number of cached handles per namespace.
+
+ private:
+  std::map<uint64_t, Namespace> namespaces_;    // The registered namespaces by inode number.
+  std::map<uint64_t, Pin> pins_;                // The pins by attachment id.
+
+ public:
+  // Return the namespace of `pid`, registering it if necessary and adding pid to its members.
+  // Returns nullptr with errno set if the namespace of `pid` can not be opened.
+  Namespace* lookup(pid_t pid);
+
+  // Pin the namespace and root directory of `pid` as attachment `attachment`, until pid exits, and return the namespace.
+  // Returns nullptr with errno set on failure (EEXIST if `attachment` is pinned already).
+  Namespace* pin(uint64_t attachment, pid_t pid);
+
+  // Return the namespace that attachment `attachment` pinned and set `root` to its root directory,
+  // or return nullptr if there is no such pin (any more).
+  Namespace* pinned(uint64_t attachment, std::string& root);
+
+  // Return the mountinfo file of the process that attachment `attachment` pinned, or -1 if there is no such pin.
+  int pinned_mountinfo_fd(uint64_t attachment) const;
+
+  // Return the root directory of `pid`, for resolve().
+  static std::string root_of(pid_t pid) { return "/proc/" + std::to_string(pid) + "/root"; }
+
+  // Return the mountinfo file of `pid`; its mount points are relative to root_of(pid).
+  static std::string mountinfo_of(pid_t pid) { return "/proc/" + std::to_string(pid) + "/mountinfo"; }
+
+  // Return an O_PATH fd of `path` in a mount namespace, of which `root` is the root directory of the requesting process.
+  // `prefix` is resolved inside `root`; the part of `path` after it may not leave `prefix`.
+  // Returns an invalid fd with errno set on failure (EXDEV if the path leaves `prefix`, ENOSYS without openat2(2)).
+  static ScopedFd resolve(std::string const& root, std::string const& prefix, std::string const& path);
+
+  // Set `key` to the key of the handle of `path` when resolved from root directory `root`.
+  // Returns false with errno set if `root` can not be looked up.
+  static bool mount_handle_key(std::string const& root, std::string const& path, MountHandleKey& key);
+
+  // Return the handle of `key` in `mount_namespace`, resolving its path from `root` (see resolve()) if it is not cached.
+  // Returns -1 with errno set on failure.
+  static int mount_handle(Namespace& mount_namespace, std::string const& root, std::string const& prefix, MountHandleKey const& key);
+
+  // Return the cached handle of `key` in `mount_namespace`, or -1 if there is none.
+  static int cached_mount_handle(Namespace const& mount_namespace, MountHandleKey const& key);
+
+  // Forget the handle of `key` (because it failed).
+  static void forget_mount_handle(Namespace& mount_namespace, MountHandleKey const& key) { mount_namespace.mount_handles_.erase(key); }
+
+  // Consume the change notification of a change of the mount table of `mount_namespace` that the executor made itself.
+  static void absorb_own_change(Namespace const& mount_namespace);
+
+  // Append a pollfd for every pidfd (of the pins too) and mountinfo fd to `poll_fds`.
+  void add_poll_fds(std::vector<pollfd>& poll_fds) const;
+
+  // Handle the events of the pollfds that the last add_poll_fds() appended, starting at `poll_fds`.
+  void handle_poll_events(pollfd const* poll_fds);
+
+  // Return the number of registered namespaces.
+  std::size_t size() const { return namespaces_.size(); }
+};
+
+} // namespace remountd
@@ -0,0 +1,1160 @@
+#include "sys.h"
+#include "PrivilegedExecutor.h"
+#include "Application.h"
+#include "MountTable.h"
+#include "NamespaceRegistry.h"
+#include "Reactor.h"
+#include "remountd_error.h"
+#include "utils.h"
+#include "WriterScan.h"
+
+#include <fcntl.h>
+#include <linux/capability.h>
+#include <linux/mount.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include "debug.h"
+
+namespace remountd {
+namespace {
+
+constexpr uint64_t capability_bit(int capability) { return uint64_t{1} << capability; }
+
+// What the executor keeps: opening the mount namespace of another process and setns(2) into it, and mount(8) needs CAP_SYS_ADMIN.
+constexpr uint64_t executor_capabilities_c = capability_bit(CAP_SYS_ADMIN) | capability_bit(CAP_SYS_PTRACE) | capability_bit(CAP_SYS_CHROOT);
+
+// Remove all capabilities that are not in `keep` from the calling thread. Returns false with errno set on failure.
+bool limit_capabilities(uint64_t keep)
+{
+  // Also from the bounding set, so that they are not regained by executing a program as root.
+  // That requires CAP_SETPCAP; without it, only the sets below are limited.
+  for (int capability = 0; prctl(PR_CAPBSET_READ, capability, 0, 0, 0) >= 0; ++capability)
+    if (!(keep & capability_bit(capability)))
+      prctl(PR_CAPBSET_DROP, capability, 0, 0, 0);
+  prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_CLEAR_ALL, 0, 0, 0);
+
+  __user_cap_header_struct header{_LINUX_CAPABILITY_VERSION_3, 0};
+  __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+  if (syscall(SYS_capget, &header, data) != 0)
+    return false;
+  for (int index = 0; index < _LINUX_CAPABILITY_U32S_3; ++index)
+  {
+    uint32_t const mask = static_cast<uint32_t>(keep >> (32 * index));
+    data[index].effective &= mask;
+    data[index].permitted &= mask;
+    data[index].inheritable &= mask;
+  }
+  return syscall(SYS_capset, &header, data) == 0;
+}
+
+// Return true if `path` is absolute and lexically normal: no empty, "." or ".." components and no trailing slash.
+bool is_lexically_normal(std::string_view path)
+{
+  if (path == "/")
+    return true;
+  if (path.empty() || path.front() != '/' || path.back() == '/')
+    return false;
+
+  std::size_t position = 1;
+  while (position <= path.size())
+  {
+    std::size_t end = path.find('/', position);
+    if (end == std::string_view::npos)
+      end = path.size();
+    std::string_view const component = path.substr(position, end - position);
+    if (component.empty() || component == "." || component == "..")
+      return false;
+    position = end + 1;
+  }
+  return true;
+}
+
+// Copy `text` into `result`, truncated if necessary, and mark it failed.
+void set_error(PrivilegedExecutor::Result& result, std::string_view text)
+{
+  std::size_t const length = std::min(text.size(), sizeof(result.text_) - 1);
+  std::copy_n(text.data(), length, result.text_);
+  result.text_[length] = '\0';
+  result.failed_ = 1;
+}
+
+// Describe `error`, the reason that `what` (e.g. "remount") failed or was refused, in `result`.
+void set_error(PrivilegedExecutor::Result& result, std::string_view what, std::error_code error)
+{
+  if (error == std::errc::no_such_file_or_directory || error == std::errc::not_a_directory)
+    error = errc::no_such_path;
+  if (error == std::errc::cross_device_link)
+    set_error(result, "path resolves to outside of its allowed mount point");
+  else if (error.category() == make_error_code(errc::no_error).category())
+    set_error(result, error.message());
+  else
+    set_error(result, std::string(what) + " failed: " + error.message());
+}
+
+// Check that `path`, relative to `dirfd` and looked up with statx(2) `flags`, is the root of a mount.
+std::error_code check_mount_point(int dirfd, char const* path, int flags)
+{
+  struct statx stx;
+  if (statx(dirfd, path, flags | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_MNT_ID, &stx) != 0)
+    return {errno, std::generic_category()};
+  // Kernels before 5.8 report neither the mount id nor whether this is its root; let the remount itself decide there.
+  if ((stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT) && !(stx.stx_attributes & STATX_ATTR_MOUNT_ROOT))
+    return errc::not_a_mount_point;
+  return {};
+}
+
+// ExecutorProcess
+//
+// The main loop of the executor process: a poll(2) over the channels, the stderr pipes of the running commands
+// and the fds of the NamespaceRegistry.
+class ExecutorProcess
+{
+ private:
+  // A running child: mount(8), or the scan for the writers of a busy mount (see reply_busy()).
+  struct Running
+  {
+    PrivilegedExecutor::Result result_; // The Result so far.
+    std::size_t channel_;               // Index of the channel to reply on.
+    pid_t pid_;                         // The child process.
+    ScopedFd stderr_fd_;                // Read-end of the stderr pipe of the child.
+    std::string error_;                 // The output of the child so far.
+  };
+
+  using clock_type = std::chrono::steady_clock;
+
+  // A read-only remount that failed because files are open for writing on the mount, and is retried.
+  struct Retry
+  {
+    PrivilegedExecutor::Result result_; // The Result so far.
+    std::size_t channel_;               // Index of the channel to reply on.
+    pid_t pid_;                         // The process whose mount namespace to remount in.
+    uint64_t attachment_;               // The attachment whose pinned namespace to remount in instead, or 0.
+    std::string const* prefix_;         // The allowed prefix that the path is below.
+    NamespaceRegistry::MountHandleKey key_;     // The mount point, and the root directory that it was resolved from.
+    clock_type::time_point next_attempt_;       // When to try again.
+    clock_type::time_point deadline_;           // When to give up and report the writers.
+    std::chrono::milliseconds delay_;           // The time between the last two attempts.
+  };
+
+  static constexpr std::chrono::milliseconds min_retry_delay_c{10};     // Delay before the first retry; it doubles with every attempt,
+  static constexpr std::chrono::milliseconds max_retry_delay_c{500};    // up to this.
+  static constexpr std::chrono::milliseconds writer_scan_time_c{100};   // Time that the scan for the writers of a busy mount may take.
+
+  std::vector<ScopedFd> channels_;                              // Our ends of the socketpairs; invalid once the front-end closed them.
+  std::vector<std::deque<PrivilegedExecutor::Result>> replies_; // Results that could not be sent yet, per channel.
+  std::vector<std::string> const& allowed_prefixes_;            // Lexically normal prefixes of the allowed mount points.
+  std::vector<Running> running_;                                // Commands that are being executed.
+  std::vector<Retry> retries_;                                  // Read-only remounts that are retried while the mount is busy.
+  std::chrono::milliseconds const busy_timeout_;                // How long to retry a busy read-only remount (0: not at all).
+  NamespaceRegistry namespaces_;                                // The mount namespaces that commands were executed in.
+  MountTable mount_table_;                                       // Enumerates the mounts for list_mounts commands.
+  ScopedFd own_namespace_fd_;                                    // The mount namespace of the executor, to return to after a remount.
+  bool mount_setattr_supported_ = true;                         // False if the kernel does not have open_tree(2) and mount_setattr(2).
+
+  // Queue `result` for channel `channel` and try to send what is queued.
+  void reply(std::size_t channel, PrivilegedExecutor::Result const& result);
+
+  // Send the queued results of channel `channel` until the socket is full.
+  void send_replies(std::size_t channel);
+
+  // Receive the commands that are queued on channel `channel`.
+  void receive(std::size_t channel);
+
+  // Validate `command` and start a child for it, or reply with an error.
+  void start(std::size_t channel, PrivilegedExecutor::Command const& command);
+
+  // Return the namespace to execute a command of `pid`, or of attachment `attachment` if that is not 0, in,
+  // and set `root` to the root directory to resolve its path from. Returns nullptr with errno set on failure.
+  NamespaceRegistry::Namespace* target(pid_t pid, uint64_t attachment, std::string& root);
+
+  // Remount the path of `key` below `prefix` of `mount_namespace`, with root directory `root`, with mount_setattr(2) on a cached handle.
+  // Returns ENOSYS if the kernel does not support that.
+  std::error_code remount_with_handle(NamespaceRegistry::Namespace& mount_namespace, std::string const& root, std::string const& prefix,
+      NamespaceRegistry::MountHandleKey const& key, bool read_only);
+
+  // Flush the file system of the mount of `key` in `mount_namespace` and schedule retrying to remount it read-only.
+  void schedule_retry(std::size_t channel, PrivilegedExecutor::Result const& result, NamespaceRegistry::Namespace& mount_namespace,
+      PrivilegedExecutor::Command const& command, std::string const* prefix, NamespaceRegistry::MountHandleKey const& key);
+
+  // Fail the retries of remounts of `key` in `mount_namespace`, which a later command for the same mount point supersedes.
+  void cancel_retries(NamespaceRegistry::Namespace const& mount_namespace, NamespaceRegistry::MountHandleKey const& key);
+
+  // Retry the remounts that are due. Returns the number of milliseconds until the next one is due, or -1 if there is none.
+  int retry_remounts();
+
+  // Reply with the error of a remount of `pid` that stayed busy, listing the processes with files open for writing on the mount of `key`.
+  // The processes are looked for by a child, whose output is the error (see read_output()).
+  void reply_busy(std::size_t channel, PrivilegedExecutor::Result const& result, NamespaceRegistry::Namespace& mount_namespace,
+      NamespaceRegistry::MountHandleKey const& key, pid_t pid);
+
+  // Reply to a list_mounts command, of which `result` is the final Result so far, for `path` below `prefix` of `mount_namespace`,
+  // as seen from root directory `root`. `mountinfo_fd` is the mountinfo file of the requesting process, for kernels without listmount(2).
+  void list_mounts(std::size_t channel, PrivilegedExecutor::Result& result, NamespaceRegistry::Namespace const& mount_namespace,
+      std::string const& root, int mountinfo_fd, std::string const& prefix, std::string const& path);
+
+  // Read the output of running_[index]; when it closed its stderr, reap it and reply. Returns true if it was removed.
+  bool read_output(std::size_t index);
+
+ public:
+  ExecutorProcess(std::vector<ScopedFd> channels, std::vector<std::string> const& allowed_prefixes, std::chrono::milliseconds busy_timeout) :
+    channels_(std::move(channels)), replies_(channels_.size()), allowed_prefixes_(allowed_prefixes), busy_timeout_(busy_timeout),
+    own_namespace_fd_(open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC)) { }
+
+  // Serve the channels until all of them are closed. Returns the exit code of the process.
+  int run();
+};
+
+void ExecutorProcess::reply(std::size_t channel, PrivilegedExecutor::Result const& result)
+{
+  if (!channels_[channel].valid())
+    return;
+  replies_[channel].push_back(result);
+  send_replies(channel);
+}
+
+void ExecutorProcess::send_replies(std::size_t channel)
+{
+  std::deque<PrivilegedExecutor::Result>& queue = replies_[channel];
+  while (!queue.empty())
+  {
+    // Never block: the front-end might be blocked sending a command to us.
+    if (send(channels_[channel].get(), &queue.front(), sizeof(PrivilegedExecutor::Result), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        channels_[channel].reset();
+        queue.clear();
+      }
+      return;
+    }
+    queue.pop_front();
+  }
+}
+
+void ExecutorProcess::receive(std::size_t channel)
+{
+  // One byte more than a Command, so that longer messages are detected.
+  union
+  {
+    PrivilegedExecutor::Command command;
+    char bytes[sizeof(PrivilegedExecutor::Command) + 1];
+  } buffer;
+
+  for (;;)
+  {
+    ssize_t const length = recv(channels_[channel].get(), &buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (length < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        channels_[channel].reset();
+      return;
+    }
+    if (length == 0)
+    {
+      channels_[channel].reset();
+      return;
+    }
+    if (static_cast<std::size_t>(length) != sizeof(PrivilegedExecutor::Command))
+    {
+      syslog(LOG_ERR, "Executor: ignoring message of %zd bytes.", length);
+      continue;
+    }
+    start(channel, buffer.command);
+  }
+}
+
+void ExecutorProcess::start(std::size_t channel, PrivilegedExecutor::Command const& command)
+{
+  PrivilegedExecutor::Result result{};
+  result.tag_ = command.tag_;
+
+  // The front-end already checked all of this; check it again because the front-end is not trusted.
+  std::size_t const path_length = strnlen(command.path_, sizeof(command.path_));
+  std::string_view const path(command.path_, path_length);
+  bool const is_attach = command.operation_ == PrivilegedExecutor::Operation::attach;
+  if (path_length == sizeof(command.path_) || command.pid_ <= 0 || command.read_only_ > 1 ||
+      (is_attach ? command.attachment_ == 0 : !is_lexically_normal(path)) ||
+      (!is_attach && command.operation_ != PrivilegedExecutor::Operation::remount && command.operation_ != PrivilegedExecutor::Operation::list_mounts))
+  {
+    set_error(result, "invalid executor command");
+    reply(channel, result);
+    return;
+  }
+
+  if (is_attach)
+  {
+    NamespaceRegistry::Namespace* const mount_namespace = namespaces_.pin(command.attachment_, command.pid_);
+    if (!mount_namespace)
+      set_error(result, std::string("can not pin the mount namespace of pid ") + std::to_string(command.pid_) + ": " + std::strerror(errno));
+    else
+      result.mount_namespace_ = mount_namespace->inode_;
+    reply(channel, result);
+    return;
+  }
+
+  // Paths are resolved from the longest matching prefix, which is the strictest.
+  std::string const* prefix = nullptr;
+  for (std::string const& allowed_prefix : allowed_prefixes_)
+    if (path_has_prefix(path, allowed_prefix) && (!prefix || allowed_prefix.size() > prefix->size()))
+      prefix = &allowed_prefix;
+  if (!prefix)
+  {
+    syslog(LOG_ERR, "Executor: refusing '%s', which is not below an allowed mount point.", command.path_);
+    set_error(result, "path is not below an allowed mount point");
+    reply(channel, result);
+    return;
+  }
+
+  std::string root;
+  NamespaceRegistry::Namespace* const mount_namespace = target(command.pid_, command.attachment_, root);
+  if (!mount_namespace)
+  {
+    if (command.attachment_ != 0)
+      set_error(result, make_error_code(errc::attachment_exited).message());
+    else
+      set_error(result, std::string("can not open the mount namespace of pid ") + std::to_string(command.pid_) + ": " + std::strerror(errno));
+    reply(channel, result);
+    return;
+  }
+  result.mount_namespace_ = mount_namespace->inode_;
+
+  if (command.operation_ == PrivilegedExecutor::Operation::list_mounts)
+  {
+    // The mount points in a mountinfo file are relative to the root directory of the process that it belongs to.
+    ScopedFd requester_mountinfo_fd;
+    int mountinfo_fd = namespaces_.pinned_mountinfo_fd(command.attachment_);
+    if (command.attachment_ == 0)
+    {
+      requester_mountinfo_fd.reset(open(NamespaceRegistry::mountinfo_of(command.pid_).c_str(), O_RDONLY | O_CLOEXEC));
+      mountinfo_fd = requester_mountinfo_fd.get();
+    }
+    list_mounts(channel, result, *mount_namespace, root, mountinfo_fd, *prefix, std::string(path));
+    return;
+  }
+
+  if (mount_setattr_supported_)
+  {
+    NamespaceRegistry::MountHandleKey key;
+    std::error_code error;
+    if (!NamespaceRegistry::mount_handle_key(root, std::string(path), key))
+      error.assign(errno, std::generic_category());
+    else
+    {
+      // A retry that succeeds after this command would undo it.
+      cancel_retries(*mount_namespace, key);
+      error = remount_with_handle(*mount_namespace, root, *prefix, key, command.read_only_);
+    }
+    if (error != std::errc::function_not_supported)
+    {
+      if (error == std::errc::cross_device_link)
+        syslog(LOG_ERR, "Executor: '%s' leads out of '%s' in the mount namespace of pid %d.", command.path_, prefix->c_str(), command.pid_);
+      // A mount can not be made read-only while files are open for writing on it; give the writers some time.
+      if (error == std::errc::device_or_resource_busy && command.read_only_ && busy_timeout_.count() > 0)
+      {
+        schedule_retry(channel, result, *mount_namespace, command, prefix, key);
+        return;
+      }
+      if (error == std::errc::device_or_resource_busy && command.read_only_)
+      {
+        reply_busy(channel, result, *mount_namespace, key, command.pid_);
+        return;
+      }
+      if (error)
+        set_error(result, "remount", error);
+      reply(channel, result);
+      return;
+    }
+    syslog(LOG_NOTICE, "Executor: openat2/mount_setattr are not supported; using mount(8).");
+    mount_setattr_supported_ = false;
+  }
+
+  // Resolve the path as for mount_setattr(2), and do not fork a mount(8) that is bound to fail.
+  ScopedFd const handle = NamespaceRegistry::resolve(root, *prefix, std::string(path));
+  std::error_code error;
+  if (!handle.valid())
+    error.assign(errno, std::generic_category());
+  else
+    error = check_mount_point(handle.get(), "", AT_EMPTY_PATH);
+  if (error)
+  {
+    if (error == std::errc::cross_device_link)
+      syslog(LOG_ERR, "Executor: '%s' leads out of '%s' in the mount namespace of pid %d.", command.path_, prefix->c_str(), command.pid_);
+    set_error(result, "remount", error);
+    reply(channel, result);
+    return;
+  }
+  struct stat handle_stat;
+  bool const is_directory = fstat(handle.get(), &handle_stat) == 0 && S_ISDIR(handle_stat.st_mode);
+
+  int stderr_pipe_fds[2];
+  if (pipe2(stderr_pipe_fds, O_CLOEXEC | O_NONBLOCK) != 0)
+  {
+    set_error(result, std::string("pipe failed: ") + std::strerror(errno));
+    reply(channel, result);
+    return;
+  }
+
+  ScopedFd read_end(stderr_pipe_fds[0]);
+  ScopedFd write_end(stderr_pipe_fds[1]);
+
+  char const* const options = command.read_only_ ? "remount,ro,bind" : "remount,rw,bind";
+  char const* args[] = {
+      "mount",
+      "-o",
+      options,
+      is_directory ? "." : command.path_,
+      nullptr
+  };
+
+  pid_t const child_pid = fork();
+  if (child_pid < 0)
+  {
+    set_error(result, std::string("fork failed: ") + std::strerror(errno));
+    reply(channel, result);
+    return;
+  }
+
+  if (child_pid == 0)
+  {
+    // Undo the SIG_IGN of the executor; ignored signals stay ignored across execve.
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    if (dup2(write_end.get(), STDERR_FILENO) < 0)
+      _exit(127);
+
+    // This also changes the root and working directory to those of the namespace, so mount is looked up there.
+    if (setns(mount_namespace->namespace_fd_.get(), CLONE_NEWNS) != 0)
+    {
+      dprintf(STDERR_FILENO, "setns failed: %s", std::strerror(errno));
+      _exit(127);
+    }
+    // Let mount(8) work on the directory that was resolved, rather than looking up the path again.
+    if (is_directory && fchdir(handle.get()) != 0)
+    {
+      dprintf(STDERR_FILENO, "fchdir failed: %s", std::strerror(errno));
+      _exit(127);
+    }
+
+    execvp(args[0], const_cast<char* const*>(args));
+    int const exec_errno = errno;
+    dprintf(STDERR_FILENO, "execvp(mount) failed: %s", std::strerror(exec_errno));
+    _exit(127);
+  }
+
+  running_.push_back({result, channel, child_pid, std::move(read_end), {}});
+}
+
+NamespaceRegistry::Namespace* ExecutorProcess::target(pid_t pid, uint64_t attachment, std::string& root)
+{
+  // Requests through an attachment go to the sandbox that it pinned, whatever process has its pid now.
+  if (attachment != 0)
+  {
+    NamespaceRegistry::Namespace* const mount_namespace = namespaces_.pinned(attachment, root);
+    if (!mount_namespace)
+      errno = ESRCH;
+    return mount_namespace;
+  }
+  root = NamespaceRegistry::root_of(pid);
+  return namespaces_.lookup(pid);
+}
+
+std::error_code ExecutorProcess::remount_with_handle(NamespaceRegistry::Namespace& mount_namespace, std::string const& root,
+    std::string const& prefix, NamespaceRegistry::MountHandleKey const& key, bool read_only)
+{
+  if (!own_namespace_fd_.valid())
+    return std::make_error_code(std::errc::function_not_supported);
+
+  mount_attr attributes{};
+  if (read_only)
+    attributes.attr_set = MOUNT_ATTR_RDONLY;
+  else
+    attributes.attr_clr = MOUNT_ATTR_RDONLY;
+
+  // Try a cached handle first, and a fresh one if that no longer refers to a mount.
+  for (int attempt = 0;; ++attempt)
+  {
+    bool const cached = NamespaceRegistry::cached_mount_handle(mount_namespace, key) >= 0;
+    int const handle = NamespaceRegistry::mount_handle(mount_namespace, root, prefix, key);
+    if (handle < 0)
+      return {errno, std::generic_category()};
+
+    // Cached handles were checked when they were opened.
+    if (!cached)
+    {
+      if (std::error_code const error = check_mount_point(handle, "", AT_EMPTY_PATH))
+      {
+        NamespaceRegistry::forget_mount_handle(mount_namespace, key);
+        return error;
+      }
+    }
+
+    // A mount can only be changed from inside its namespace. The executor is single-threaded, so it can enter and leave.
+    if (setns(mount_namespace.namespace_fd_.get(), CLONE_NEWNS) != 0)
+      return {errno, std::generic_category()};
+    int error = 0;
+    if (syscall(SYS_mount_setattr, handle, "", AT_EMPTY_PATH, &attributes, sizeof(attributes)) != 0)
+      error = errno;
+    if (setns(own_namespace_fd_.get(), CLONE_NEWNS) != 0)
+    {
+      syslog(LOG_CRIT, "Executor: can not return to its own mount namespace: %m");
+      _exit(1);
+    }
+
+    if (error == 0)
+    {
+      NamespaceRegistry::absorb_own_change(mount_namespace);
+      return {};
+    }
+    // Only keep handles that work; a busy mount is still a mount.
+    if (error == EBUSY)
+      return {error, std::generic_category()};
+    NamespaceRegistry::forget_mount_handle(mount_namespace, key);
+    if (error != EINVAL || !cached || attempt > 0)
+      return {error, std::generic_category()};
+  }
+}
+
+void ExecutorProcess::schedule_retry(std::size_t channel, PrivilegedExecutor::Result const& result,
+    NamespaceRegistry::Namespace& mount_namespace, PrivilegedExecutor::Command const& command, std::string const* prefix,
+    NamespaceRegistry::MountHandleKey const& key)
+{
+  // Write back the dirty data now, so that it does not have to be done by the remount that succeeds. syncfs(2) needs
+  // an fd that is not O_PATH; that is only opened for directories, as opening anything else can have side effects.
+  int const handle = NamespaceRegistry::cached_mount_handle(mount_namespace, key);
+  if (handle >= 0)
+  {
+    ScopedFd const directory(openat(handle, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (directory.valid() && syncfs(directory.get()) != 0)
+      syslog(LOG_WARNING, "Executor: syncfs of '%s' failed: %m", key.path_.c_str());
+  }
+
+  clock_type::time_point const now = clock_type::now();
+  retries_.push_back({result, channel, command.pid_, command.attachment_, prefix, key, now + min_retry_delay_c, now + busy_timeout_, min_retry_delay_c});
+}
+
+void ExecutorProcess::cancel_retries(NamespaceRegistry::Namespace const& mount_namespace, NamespaceRegistry::MountHandleKey const& key)
+{
+  for (std::size_t index = 0; index < retries_.size();)
+  {
+    Retry& retry = retries_[index];
+    if (retry.result_.mount_namespace_ != mount_namespace.inode_ || retry.key_ != key)
+    {
+      ++index;
+      continue;
+    }
+    syslog(LOG_NOTICE, "Executor: cancelling the read-only remount of '%s' for a later command.", key.path_.c_str());
+    PrivilegedExecutor::Result result = retry.result_;
+    set_error(result, make_error_code(errc::remount_superseded).message());
+    std::size_t const channel = retry.channel_;
+    retries_.erase(retries_.begin() + index);
+    reply(channel, result);
+  }
+}
+
+int ExecutorProcess::retry_remounts()
+{
+  clock_type::time_point now = clock_type::now();
+  for (std::size_t index = retries_.size(); index-- > 0;)
+  {
+    Retry& retry = retries_[index];
+    if (!channels_[retry.channel_].valid())
+    {
+      retries_.erase(retries_.begin() + index);
+      continue;
+    }
+    if (retry.next_attempt_ > now)
+      continue;
+
+    PrivilegedExecutor::Result result = retry.result_;
+    std::error_code error;
+    // The namespace is unregistered when its last member exits (and it is not pinned).
+    std::string root;
+    NamespaceRegistry::MountHandleKey key;
+    NamespaceRegistry::Namespace* const mount_namespace = target(retry.pid_, retry.attachment_, root);
+    if (!mount_namespace || !NamespaceRegistry::mount_handle_key(root, retry.key_.path_, key))
+      error.assign(errno, std::generic_category());
+    else
+      error = remount_with_handle(*mount_namespace, root, *retry.prefix_, key, true);
+    now = clock_type::now();
+    if (error == std::errc::device_or_resource_busy && now < retry.deadline_)
+    {
+      retry.delay_ = std::min(2 * retry.delay_, max_retry_delay_c);
+      retry.next_attempt_ = std::min(now + retry.delay_, retry.deadline_);
+      continue;
+    }
+
+    std::size_t const channel = retry.channel_;
+    pid_t const pid = retry.pid_;
+    retries_.erase(retries_.begin() + index);
+    if (error == std::errc::device_or_resource_busy)
+      reply_busy(channel, result, *mount_namespace, key, pid);
+    else
+    {
+      if (error)
+        set_error(result, "remount", error);
+      reply(channel, result);
+    }
+  }
+
+  if (retries_.empty())
+    return -1;
+  clock_type::time_point next_attempt = retries_.front().next_attempt_;
+  for (Retry const& retry : retries_)
+    next_attempt = std::min(next_attempt, retry.next_attempt_);
+  return std::max(0L, static_cast<long>(std::chrono::ceil<std::chrono::milliseconds>(next_attempt - now).count()));
+}
+
+void ExecutorProcess::reply_busy(std::size_t channel, PrivilegedExecutor::Result const& result, NamespaceRegistry::Namespace& mount_namespace,
+    NamespaceRegistry::MountHandleKey const& key, pid_t pid)
+{
+  std::string const error = make_error_code(errc::mount_busy).message();
+
+  // The writers are found by the mount id that /proc/<pid>/fdinfo reports, which is the one of STATX_MNT_ID.
+  struct statx stx;
+  int const handle = NamespaceRegistry::cached_mount_handle(mount_namespace, key);
+  int stderr_pipe_fds[2];
+  if (handle < 0 || statx(handle, "", AT_EMPTY_PATH | AT_STATX_DONT_SYNC, STATX_MNT_ID, &stx) != 0 || !(stx.stx_mask & STATX_MNT_ID) ||
+      pipe2(stderr_pipe_fds, O_CLOEXEC | O_NONBLOCK) != 0)
+  {
+    syslog(LOG_NOTICE, "Executor: can not remount '%s' read-only: %s", key.path_.c_str(), error.c_str());
+    PrivilegedExecutor::Result busy_result = result;
+    set_error(busy_result, error);
+    reply(channel, busy_result);
+    return;
+  }
+
+  ScopedFd read_end(stderr_pipe_fds[0]);
+  ScopedFd write_end(stderr_pipe_fds[1]);
+
+  // Scanning all processes takes a while; do it in a child, so that the other commands are not held up meanwhile.
+  uint64_t const inode = mount_namespace.inode_;
+  pid_t const child_pid = fork();
+  if (child_pid == 0)
+  {
+    std::string writers;
+    std::string host_writers;
+    for (pid_t const writer : WriterScan::find_writers(inode, stx.stx_mnt_id, clock_type::now() + writer_scan_time_c))
+    {
+      // The requesting process might be in a pid namespace of its own.
+      if (pid_t const visible_pid = WriterScan::translate_pid(writer, pid))
+        writers += ' ' + std::to_string(visible_pid);
+      else
+        host_writers += ' ' + std::to_string(writer);
+    }
+    std::string message = error;
+    if (!writers.empty())
+      message += "; open for writing by pid" + writers;
+    if (!host_writers.empty())
+      message += (writers.empty() ? "; open for writing by host pid" : ", host pid") + host_writers;
+    syslog(LOG_NOTICE, "Executor: can not remount '%s' read-only: %s", key.path_.c_str(), message.c_str());
+    [[maybe_unused]] ssize_t const written = write(write_end.get(), message.data(), message.size());
+    _exit(1);
+  }
+
+  if (child_pid < 0)
+  {
+    PrivilegedExecutor::Result busy_result = result;
+    set_error(busy_result, error);
+    reply(channel, busy_result);
+    return;
+  }
+  running_.push_back({result, channel, child_pid, std::move(read_end), {}});
+}
+
+void ExecutorProcess::list_mounts(std::size_t channel, PrivilegedExecutor::Result& result, NamespaceRegistry::Namespace const& mount_namespace,
+    std::string const& root, int mountinfo_fd, std::string const& prefix, std::string const& path)
+{
+  ScopedFd const directory = NamespaceRegistry::resolve(root, prefix, path);
+  if (!directory.valid())
+  {
+    set_error(result, "listing mounts", {errno, std::generic_category()});
+    reply(channel, result);
+    return;
+  }
+
+  // Mount points are reported relative to the root directory of the caller, so enter the namespace and
+  // take the root directory of the requesting process. Returning to our own namespace restores our root.
+  ScopedFd const root_fd(open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+  std::vector<MountTable::Mount> mounts;
+  std::error_code error;
+  if (!own_namespace_fd_.valid())
+    error = std::make_error_code(std::errc::function_not_supported);
+  else if (!root_fd.valid() || setns(mount_namespace.namespace_fd_.get(), CLONE_NEWNS) != 0)
+    error.assign(errno, std::generic_category());
+  else
+  {
+    if (fchdir(root_fd.get()) != 0 || chroot(".") != 0)
+      error.assign(errno, std::generic_category());
+    else
+      error = mount_table_.list(directory.get(), path, mountinfo_fd, mounts);
+    if (setns(own_namespace_fd_.get(), CLONE_NEWNS) != 0)
+    {
+      syslog(LOG_CRIT, "Executor: can not return to its own mount namespace: %m");
+      _exit(1);
+    }
+  }
+  if (error)
+  {
+    set_error(result, "listing mounts", error);
+    reply(channel, result);
+    return;
+  }
+
+  PrivilegedExecutor::Result entry = result;
+  entry.more_ = 1;
+  for (MountTable::Mount const& mount : mounts)
+  {
+    entry.read_only_ = mount.read_only_ ? 1 : 0;
+    if (mount.mount_point_.size() >= sizeof(entry.text_))
+      continue;
+    std::fill(std::copy(mount.mount_point_.begin(), mount.mount_point_.end(), entry.text_), std::end(entry.text_), '\0');
+    reply(channel, entry);
+  }
+  reply(channel, result);
+}
+
+bool ExecutorProcess::read_output(std::size_t index)
+{
+  Running& running = running_[index];
+
+  // Collect the stderr output of the child.
+  char buffer[512];
+  for (;;)
+  {
+    ssize_t const read_ret = read(running.stderr_fd_.get(), buffer, sizeof(buffer));
+    if (read_ret > 0)
+    {
+      running.error_.append(buffer, static_cast<std::size_t>(read_ret));
+      continue;
+    }
+
+    if (read_ret < 0 && errno == EINTR)
+      continue;
+
+    if (read_ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return false;
+
+    break;
+  }
+
+  // The child closed its stderr: it exited, or is about to.
+  PrivilegedExecutor::Result result = running.result_;
+  int status = 0;
+  pid_t ret;
+  while ((ret = waitpid(running.pid_, &status, 0)) < 0 && errno == EINTR)
+    ;
+
+  if (ret < 0)
+    set_error(result, std::string("waitpid failed: ") + std::strerror(errno));
+  else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    std::string& error = running.error_;
+    error.resize(trim_right(std::string_view{error}).size());
+    if (error.empty())
+    {
+      if (WIFEXITED(status))
+        error = "mount failed with exit status " + std::to_string(WEXITSTATUS(status));
+      else if (WIFSIGNALED(status))
+        error = "mount terminated by signal " + std::to_string(WTERMSIG(status));
+      else
+        error = "mount failed";
+    }
+    set_error(result, error);
+  }
+
+  std::size_t const channel = running.channel_;
+  running_.erase(running_.begin() + index);
+  reply(channel, result);
+  return true;
+}
+
+int ExecutorProcess::run()
+{
+  std::vector<pollfd> poll_fds;
+  for (;;)
+  {
+    // Keep going until the front-end closed all channels and the last child was reaped.
+    bool const any_channel = std::any_of(channels_.begin(), channels_.end(), [](ScopedFd const& fd){ return fd.valid(); });
+    if (!any_channel && running_.empty())
+      return 0;
+
+    // Before the registry adds its fds: a retry can register a namespace again.
+    int const timeout = retry_remounts();
+
+    poll_fds.clear();
+    for (std::size_t channel = 0; channel < channels_.size(); ++channel)
+      poll_fds.push_back({channels_[channel].get(), static_cast<short>(POLLIN | (replies_[channel].empty() ? 0 : POLLOUT)), 0});
+    for (Running const& running : running_)
+      poll_fds.push_back({running.stderr_fd_.get(), POLLIN, 0});
+    std::size_t const first_namespace_fd = poll_fds.size();
+    namespaces_.add_poll_fds(poll_fds);
+
+    if (poll(poll_fds.data(), poll_fds.size(), timeout) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      syslog(LOG_ERR, "Executor: poll failed: %m");
+      return 1;
+    }
+
+    // Before anything can change the registry or running_.
+    namespaces_.handle_poll_events(poll_fds.data() + first_namespace_fd);
+
+    // Process the children before the channels: read_output() changes running_, which was appended to poll_fds after them.
+    for (std::size_t index = running_.size(); index-- > 0;)
+      if (poll_fds[channels_.size() + index].revents != 0)
+        read_output(index);
+
+    for (std::size_t channel = 0; channel < channels_.size(); ++channel)
+    {
+      short const revents = poll_fds[channel].revents;
+      if ((revents & POLLOUT) && channels_[channel].valid())
+        send_replies(channel);
+      if ((revents & (POLLIN | POLLHUP | POLLERR)) && channels_[channel].valid())
+        receive(channel);
+    }
+  }
+}
+
+} // namespace
+
+PrivilegedExecutor::PrivilegedExecutor(int number_of_channels)
+{
+  DoutEntering(dc::notice, "PrivilegedExecutor::PrivilegedExecutor(" << number_of_channels << ")");
+
+  // The prefixes that the executor accepts, normalized like Remountd normalizes them.
+  std::vector<std::string> allowed_prefixes;
+  for (Application::AllowedMountPoint const& allowed_mount_point : Application::instance().allowed_mount_points())
+  {
+    std::string prefix = allowed_mount_point.path_.lexically_normal().native();
+    if (prefix.size() > 1 && prefix.back() == '/')
+      prefix.pop_back();
+    allowed_prefixes.push_back(std::move(prefix));
+  }
+
+  std::chrono::milliseconds const busy_timeout(Application::instance().busy_timeout_ms());
+
+  std::vector<ScopedFd> executor_ends;
+  for (int index = 0; index < number_of_channels; ++index)
+  {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+      throw std::system_error(errno, std::generic_category(), "socketpair failed");
+    channels_.push_back(std::make_unique<Channel>(ScopedFd(fds[0])));
+    executor_ends.emplace_back(fds[1]);
+  }
+
+  pid_t const parent_pid = getpid();
+  pid_ = fork();
+  if (pid_ < 0)
+    throw std::system_error(errno, std::generic_category(), "fork failed");
+
+  if (pid_ == 0)
+  {
+    // The executor. Never return from here: the objects of the front-end are not ours.
+    int exit_code = 1;
+    try
+    {
+      // Terminate along with the front-end, but not before it: it hands over its connections on SIGTERM,
+      // which might need the requests in flight to finish.
+      signal(SIGINT, SIG_IGN);
+      signal(SIGTERM, SIG_IGN);
+      prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+      if (getppid() != parent_pid)
+        _exit(1);
+
+      // Close everything that was inherited, except stderr and our ends of the channels (moved above stderr).
+      std::vector<ScopedFd> channels;
+      for (ScopedFd& fd : executor_ends)
+        channels.emplace_back(fcntl(fd.get(), F_DUPFD_CLOEXEC, STDERR_FILENO + 1));
+      executor_ends.clear();
+      int const null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+      if (null_fd >= 0)
+      {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+      }
+      int first_fd = STDERR_FILENO + 1;
+      std::vector<int> keep;
+      for (ScopedFd const& fd : channels)
+        keep.push_back(fd.get());
+      std::sort(keep.begin(), keep.end());
+      for (int const fd : keep)
+      {
+        if (fd > first_fd)
+          syscall(SYS_close_range, first_fd, fd - 1, 0);
+        first_fd = fd + 1;
+      }
+      syscall(SYS_close_range, first_fd, ~0U, 0);
+
+      if (!limit_capabilities(executor_capabilities_c))
+        syslog(LOG_WARNING, "Executor: failed to limit capabilities: %m");
+
+      ExecutorProcess executor(std::move(channels), allowed_prefixes, busy_timeout);
+      exit_code = executor.run();
+    }
+    catch (...)
+    {
+    }
+    _exit(exit_code);
+  }
+
+  executor_ends.clear();
+
+  // The front-end does not need any capability: everything privileged is done by the executor.
+  if (!limit_capabilities(0))
+    throw std::system_error(errno, std::generic_category(), "failed to drop capabilities");
+  prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+}
+
+PrivilegedExecutor::~PrivilegedExecutor()
+{
+  DoutEntering(dc::notice, "PrivilegedExecutor::~PrivilegedExecutor()");
+
+  // Closing the channels makes the executor exit.
+  channels_.clear();
+  while (waitpid(pid_, nullptr, 0) < 0 && errno == EINTR)
+    ;
+}
+
+PrivilegedExecutor::Channel::ResultAwaiter::ResultAwaiter(Channel& channel, Operation operation, pid_t pid, uint64_t attachment,
+    bool read_only, std::string_view path, std::vector<MountState>* mounts) : channel_(channel), slot_(channel.acquire_slot())
+{
+  Slot& slot = *channel.slots_[slot_];
+  slot.command_.attachment_ = attachment;
+  slot.command_.operation_ = operation;
+  slot.command_.pid_ = pid;
+  slot.command_.read_only_ = read_only ? 1 : 0;
+  slot.result_.tag_ = slot.command_.tag_;
+  slot.result_.mount_namespace_ = 0;
+  slot.result_.failed_ = 0;
+  slot.result_.more_ = 0;
+  slot.result_.read_only_ = 0;
+  slot.result_.text_[0] = '\0';
+  slot.mounts_ = mounts;
+  if (path.size() >= sizeof(slot.command_.path_))
+  {
+    set_error(slot.result_, "path is too long");
+    return;
+  }
+  // Zero the whole buffer: it is sent as is.
+  std::fill(std::copy(path.begin(), path.end(), slot.command_.path_), std::end(slot.command_.path_), '\0');
+}
+
+PrivilegedExecutor::Channel::ResultAwaiter::~ResultAwaiter()
+{
+  // The coroutine was destroyed while waiting; a Result that still arrives is ignored.
+  if (registered_)
+  {
+    channel_.slots_[slot_]->handle_ = nullptr;
+    --channel_.waiting_;
+  }
+  if (owner_)
+    channel_.release_slot(slot_);
+}
+
+bool PrivilegedExecutor::Channel::ResultAwaiter::await_ready()
+{
+  Result& result = channel_.slots_[slot_]->result_;
+  if (result.failed_)
+    return true;
+
+  if (!channel_.broken_ && channel_.send_command(slot_))
+    return false;
+
+  set_error(result, make_error_code(errc::executor_unavailable).message());
+  return true;
+}
+
+void PrivilegedExecutor::Channel::ResultAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+  channel_.slots_[slot_]->handle_ = handle;
+  ++channel_.waiting_;
+  registered_ = true;
+  if (!channel_.reading_)
+    channel_.read_results();
+}
+
+uint32_t PrivilegedExecutor::Channel::acquire_slot()
+{
+  uint32_t slot;
+  if (free_slots_.empty())
+  {
+    slot = static_cast<uint32_t>(slots_.size());
+    slots_.push_back(std::make_unique<Slot>());
+  }
+  else
+  {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  }
+  // The sequence number tells a Result for this command apart from one for an earlier (cancelled) user of the slot.
+  slots_[slot]->command_.tag_ = (static_cast<uint64_t>(next_sequence_++) << 32) | slot;
+  slots_[slot]->handle_ = nullptr;
+  return slot;
+}
+
+void PrivilegedExecutor::Channel::release_slot(uint32_t slot)
+{
+  slots_[slot]->command_.tag_ = ~uint64_t{0};
+  std::erase(unsent_, slot);
+  free_slots_.push_back(slot);
+}
+
+bool PrivilegedExecutor::Channel::send_command(uint32_t slot)
+{
+  // Keep the order of the commands.
+  if (unsent_.empty())
+  {
+    ssize_t ret;
+    while ((ret = send(fd_.get(), &slots_[slot]->command_, sizeof(Command), MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+      ;
+    if (ret == static_cast<ssize_t>(sizeof(Command)))
+      return true;
+    if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      fail_all();
+      return false;
+    }
+  }
+  // The executor is busy; never block the reactor.
+  unsent_.push_back(slot);
+  if (!sending_)
+    send_commands();
+  return true;
+}
+
+DetachedTask PrivilegedExecutor::Channel::send_commands()
+{
+  // Reset sending_ also when the reactor destroys this coroutine.
+  struct SendingGuard
+  {
+    bool& sending_;
+    ~SendingGuard() { sending_ = false; }
+  } const sending_guard{sending_};
+  sending_ = true;
+
+  while (!unsent_.empty() && !broken_)
+  {
+    co_await reactor_->wait_writable(fd_.get());
+
+    while (!unsent_.empty())
+    {
+      ssize_t const ret = send(fd_.get(), &slots_[unsent_.front()]->command_, sizeof(Command), MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (ret == static_cast<ssize_t>(sizeof(Command)))
+      {
+        unsent_.pop_front();
+        continue;
+      }
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      fail_all();
+      co_return;
+    }
+  }
+}
+
+void PrivilegedExecutor::Channel::fail_all()
+{
+  if (!broken_)
+  {
+    syslog(LOG_ERR, "The privileged executor exited; terminating.");
+    broken_ = true;
+    Application::instance().quit();
+  }
+
+  unsent_.clear();
+  std::vector<std::coroutine_handle<>> handles;
+  for (std::unique_ptr<Slot> const& slot : slots_)
+  {
+    if (!slot->handle_)
+      continue;
+    set_error(slot->result_, make_error_code(errc::executor_unavailable).message());
+    handles.push_back(std::exchange(slot->handle_, nullptr));
+  }
+  waiting_ = 0;
+  for (std::coroutine_handle<> const handle : handles)
+    handle.resume();
+}
+
+DetachedTask PrivilegedExecutor::Channel::read_results()
+{
+  // Reset reading_ also when the reactor destroys this coroutine.
+  struct ReadingGuard
+  {
+    bool& reading_;
+    ~ReadingGuard() { reading_ = false; }
+  } const reading_guard{reading_};
+  reading_ = true;
+
+  // Results are received directly into the slot of their command; those with more_ set are copied out of it right away.
+  while (waiting_ > 0)
+  {
+    co_await reactor_->wait_readable(fd_.get());
+
+    // Peek at the tag first, to find the slot.
+    uint64_t tag;
+    ssize_t length;
+    while ((length = recv(fd_.get(), &tag, sizeof(tag), MSG_DONTWAIT | MSG_PEEK)) > 0 || (length < 0 && errno == EINTR))
+    {
+      if (length < 0)
+        continue;
+      uint32_t const index = static_cast<uint32_t>(tag);
+      Slot* const slot = length == sizeof(tag) && index < slots_.size() && slots_[index]->command_.tag_ == tag && slots_[index]->handle_ ?
+          slots_[index].get() : nullptr;
+      // The rest of a record that is received partially is discarded; that is how Results of cancelled commands are dropped.
+      if (!slot)
+      {
+        length = recv(fd_.get(), &tag, sizeof(tag), MSG_DONTWAIT);
+        continue;
+      }
+      Result& result = slot->result_;
+      length = recv(fd_.get(), &result, sizeof(Result), MSG_DONTWAIT);
+      if (length != static_cast<ssize_t>(sizeof(Result)))
+        continue;
+      result.text_[sizeof(result.text_) - 1] = '\0';
+      if (result.more_)
+      {
+        if (slot->mounts_)
+          slot->mounts_->push_back({result.text_, result.read_only_ != 0});
+        continue;
+      }
+      // Unregister before resuming: the coroutine destroys the awaiter.
+      --waiting_;
+      std::exchange(slot->handle_, nullptr).resume();
+    }
+
+    if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+      fail_all();
+      break;
+    }
+  }
+}
+
+} // namespace remountd
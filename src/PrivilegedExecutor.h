@@ -0,0 +1,266 @@
+#pragma once
+
+#include "ScopedFd.h"
+#include "Task.h"
+
+#include <sys/types.h>
+#include <linux/limits.h>
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace remountd {
+
+class Reactor;
+
+// PrivilegedExecutor
+//
+// The only part of remountd that keeps the capabilities needed to remount.
+//
+// The constructor forks a small executor process before any reactor thread
+// exists. The executor closes everything it inherited, except one
+// SOCK_SEQPACKET socketpair per reactor, limits its capability bounding set
+// to what entering a mount namespace and mount need, and then does nothing
+// but read fixed-size Command records, check them once more against the
+// allowed mount points of the configuration, remount in the target
+// namespace (see NamespaceRegistry) and send back a fixed-size Result. The
+// remount is a mount_setattr(2) on a cached handle of the mount point; only
+// on kernels that lack it a mount(8) child is forked instead, in the
+// directory of the handle. Before that, the target is resolved with
+// openat2(2) and checked with statx(2): a path that does not exist, leads
+// out of its allowed mount point or is not a mount point is refused without
+// entering the namespace or forking. A read-only remount that fails because
+// files are open for writing on the mount is retried, after a syncfs(2),
+// with an exponential backoff until the busy timeout of the configuration;
+// meanwhile other commands are served. If the mount stays busy, the Result
+// names the writers, which a child process looks for (see WriterScan). The
+// Result also identifies the mount namespace, which the front-end can not
+// look up itself. The executor also lists the mounts below a path, with
+// their ro/rw state (see MountTable), because that requires entering the
+// namespace too. For an attached sandbox (see Attachment) the executor pins
+// the namespace and root directory of the attached process, and the
+// commands that arrive through the attachment are executed there instead of
+// in the namespace of their pid. The parent process (the front-end:
+// sockets, parsing, authorization, rate limiting) drops all of its
+// capabilities right after the fork.
+//
+// A compromised front-end can therefore ask for nothing but a remount,
+// read-only or read-write, of a path below one of the configured prefixes;
+// it can no longer mount, enter namespaces or gain capabilities again.
+//
+// The front-end is not unprivileged, though: it keeps uid 0. Without
+// capabilities it can not override permissions, but it is still the owner
+// of every file of root and may signal every process of root. The unit
+// (services/remountd.service.in) confines that: the file system is
+// read-only except for /run/remountd, devices, IPC, the kernel tunables and
+// logs are private or read-only, the processes of root are hidden in /proc
+// and only AF_UNIX sockets can be created. Signalling processes of root is
+// the part that remains.
+//
+// Every reactor talks to the executor through its own Channel, so that no
+// locking is needed: requests are sent by the coroutine that handles them
+// and the Result is delivered to it by a coroutine of the same reactor
+// that reads the channel for as long as there are requests in flight.
+// Sending never blocks the reactor: while the executor is busy, commands
+// that do not fit in the socket are queued in the Channel.
+//
+// The executor exits when all channels are closed. When it disappears
+// while the front-end is still running, the requests in flight fail and
+// the front-end quits.
+class PrivilegedExecutor
+{
+ public:
+  static constexpr std::size_t max_text_length_c = PATH_MAX;    // Size of Result::text_, including the terminating zero.
+
+  // What a Command asks for.
+  enum class Operation : uint32_t
+  {
+    remount,                            // Remount path_.
+    list_mounts,                        // List the mounts at or below path_.
+    attach                              // Pin the mount namespace and root directory of pid_ as attachment_, until pid_ exits.
+  };
+
+  // Command
+  //
+  // Request to remount one path, or to list the mounts below one; the unit of the executor protocol.
+  struct Command
+  {
+    uint64_t tag_;                      // Chosen by the front-end, returned in the Result.
+    uint64_t attachment_;               // Non-zero: the id of the attachment whose pinned namespace to enter instead of that of pid_.
+    Operation operation_;               // What to do.
+    int32_t pid_;                       // The process whose mount namespace to enter.
+    uint32_t read_only_;                // remount: 1 to remount read-only, 0 to remount read-write.
+    char path_[PATH_MAX];               // Zero-terminated, lexically normal, absolute path.
+  };
+
+  // Result
+  //
+  // Reply of the executor to one Command. The reply to list_mounts is one Result
+  // with more_ set for every mount, followed by a final Result without more_.
+  struct Result
+  {
+    uint64_t tag_;                      // The tag_ of the Command.
+    uint64_t mount_namespace_;          // Inode number of the mount namespace of the pid_ of the Command, or 0 if unknown.
+    int32_t failed_;                    // Zero if the command succeeded.
+    uint32_t more_;                     // list_mounts: non-zero if this Result describes a mount and more follow.
+    uint32_t read_only_;                // list_mounts: 1 if the mount (if more_) is read-only.
+    char text_[max_text_length_c];      // Zero-terminated description of the failure if failed_, or the mount point if more_.
+  };
+
+  // One mount, as returned by list_mounts().
+  struct MountState
+  {
+    std::string mount_point_;           // Absolute path of the mount point in the mount namespace.
+    bool read_only_;                    // True if the mount is read-only.
+  };
+
+  // Channel
+  //
+  // The front-end side of the socketpair of one reactor. Only used by the thread of that reactor.
+  //
+  // The Command and Result of a request are kept in a Slot of the channel, which is reused by later
+  // requests, so that the coroutine frame of a request only holds a slot index and stays small enough
+  // for the FramePool. The index of the slot is the lower half of the tag of the Command.
+  //
+  // Commands are sent without blocking; those that do not fit in the socket buffer while the executor
+  // is busy are queued and sent by a coroutine that waits until the socket is writable.
+  class Channel
+  {
+   private:
+    // The Command and Result of one request.
+    struct Slot
+    {
+      Command command_;                 // The command; sent as is.
+      Result result_;                   // The (final) reply to command_.
+      std::vector<MountState>* mounts_; // list_mounts: where to store the mounts.
+      std::coroutine_handle<> handle_;  // The coroutine that waits for result_, or nullptr.
+    };
+
+   public:
+    // Reply
+    //
+    // The Result of a command, as returned by co_await; keeps the slot of the command until it is destroyed.
+    class Reply
+    {
+     private:
+      Channel* channel_;                // The channel of the slot, or nullptr if moved from.
+      uint32_t slot_;                   // Index of the slot in channel_->slots_.
+
+     public:
+      Reply(Channel& channel, uint32_t slot) : channel_(&channel), slot_(slot) { }
+      Reply(Reply&& other) noexcept : channel_(std::exchange(other.channel_, nullptr)), slot_(other.slot_) { }
+      Reply& operator=(Reply&&) = delete;
+      ~Reply() { if (channel_) channel_->release_slot(slot_); }
+
+      Result const& operator*() const { return channel_->slots_[slot_]->result_; }
+      Result const* operator->() const { return &channel_->slots_[slot_]->result_; }
+    };
+
+    // ResultAwaiter
+    //
+    // Sends a Command and suspends the awaiting coroutine until its Result arrived.
+    class ResultAwaiter
+    {
+     private:
+      Channel& channel_;                // The channel to use.
+      uint32_t slot_;                   // Index of the slot with the Command and Result.
+      bool owner_ = true;               // True until the slot was passed to the Reply.
+      bool registered_ = false;         // True while this awaiter waits for the Result.
+
+     public:
+      ResultAwaiter(Channel& channel, Operation operation, pid_t pid, uint64_t attachment, bool read_only, std::string_view path,
+          std::vector<MountState>* mounts);
+      ResultAwaiter(ResultAwaiter const&) = delete;
+      ~ResultAwaiter();
+
+      bool await_ready();
+      void await_suspend(std::coroutine_handle<> handle);
+      Reply await_resume() noexcept { registered_ = false; owner_ = false; return {channel_, slot_}; }
+    };
+
+   private:
+    ScopedFd fd_;                       // Our end of the socketpair.
+    Reactor* reactor_ = nullptr;        // The reactor of the coroutines that use this channel, set by the first await.
+    uint32_t next_sequence_ = 0;        // Upper half of the tag of the next command.
+    std::vector<std::unique_ptr<Slot>> slots_;  // The slots, indexed by the lower half of the tag of their command.
+    std::vector<uint32_t> free_slots_;  // Indices of the slots that are not in use.
+    std::size_t waiting_ = 0;           // Number of coroutines waiting for a Result.
+    std::deque<uint32_t> unsent_;       // Slots of the commands that did not fit in the socket yet, in order.
+    bool reading_ = false;              // True while read_results() runs.
+    bool sending_ = false;              // True while send_commands() runs.
+    bool broken_ = false;               // True once the executor went away.
+
+    // Return the index of an unused slot, with the tag of its command set.
+    uint32_t acquire_slot();
+
+    // Return the slot with index `slot` to the free list, forgetting its command if that was not sent yet.
+    void release_slot(uint32_t slot);
+
+    // Send the command in slot `slot` unless commands are queued already, and queue it if the socket is full.
+    // Returns false if the executor went away.
+    bool send_command(uint32_t slot);
+
+    // Send the queued commands whenever the socket becomes writable, until none are left.
+    DetachedTask send_commands();
+
+    // Read Results and resume the coroutines waiting for them until none is waiting.
+    DetachedTask read_results();
+
+    // Let every waiting command fail, and quit the application.
+    void fail_all();
+
+   public:
+    explicit Channel(ScopedFd fd) : fd_(std::move(fd)) { }
+
+    // Remount `path` in the mount namespace of `pid`, or the one pinned by `attachment` if that is not 0, using `reactor`.
+    ResultAwaiter execute(Reactor& reactor, pid_t pid, uint64_t attachment, bool read_only, std::string_view path)
+    {
+      reactor_ = &reactor;
+      return {*this, Operation::remount, pid, attachment, read_only, path, nullptr};
+    }
+
+    // Append the mounts at or below `path` in the mount namespace of `pid`, or the one pinned by `attachment`
+    // if that is not 0, to `mounts`, using `reactor`.
+    ResultAwaiter list_mounts(Reactor& reactor, pid_t pid, uint64_t attachment, std::string_view path, std::vector<MountState>& mounts)
+    {
+      reactor_ = &reactor;
+      return {*this, Operation::list_mounts, pid, attachment, false, path, &mounts};
+    }
+
+    // Pin the mount namespace and root directory of `pid` as attachment `attachment`, using `reactor`.
+    ResultAwaiter attach(Reactor& reactor, pid_t pid, uint64_t attachment)
+    {
+      reactor_ = &reactor;
+      return {*this, Operation::attach, pid, attachment, false, {}, nullptr};
+    }
+  };
+
+  // The awaiter is part of the coroutine frame of every request.
+  static_assert(sizeof(Channel::ResultAwaiter) <= 32 && sizeof(Channel::Reply) <= 16);
+
+ private:
+  pid_t pid_ = -1;                                      // The executor process.
+  std::vector<std::unique_ptr<Channel>> channels_;      // The front-end side of the channels, per reactor.
+
+ public:
+  // Fork the executor process with `number_of_channels` channels, and drop the capabilities of the calling process.
+  explicit PrivilegedExecutor(int number_of_channels);
+
+  // Close the channels and wait for the executor to exit.
+  ~PrivilegedExecutor();
+
+  PrivilegedExecutor(PrivilegedExecutor const&) = delete;
+  PrivilegedExecutor& operator=(PrivilegedExecutor const&) = delete;
+
+  // Return the channel of the reactor with index `reactor_index`.
+  Channel& channel(int reactor_index) { return *channels_[reactor_index]; }
+};
+
+} // namespace remountd
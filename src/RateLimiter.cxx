@@ -0,0 +1,250 @@
+#include "sys.h"
+#include "RateLimiter.h"
+#include "Application.h"
+#include "utils.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include "debug.h"
+
+namespace remountd {
+namespace {
+
+// Finalizer of splitmix64: spreads consecutive uids over the table.
+uint64_t mix(uint64_t key)
+{
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
+}
+
+} // namespace
+
+//static
+RateLimiter::Limit RateLimiter::make_limit(unsigned int per_minute, unsigned int burst)
+{
+  if (per_minute == 0)
+    return {clock_type::duration::zero(), clock_type::duration::zero()};
+
+  clock_type::duration const interval = std::chrono::duration_cast<clock_type::duration>(std::chrono::minutes{1}) / per_minute;
+  return {interval, interval * (std::max(burst, 1U) - 1)};
+}
+
+RateLimiter::RateLimiter() : entries_(initial_capacity_c, Entry{empty_key_c, 0})
+{
+  Application const& application = Application::instance();
+  uid_limit_ = make_limit(application.rate_limit_per_minute(), application.rate_limit_burst());
+  enabled_ = uid_limit_.interval_ != clock_type::duration::zero();
+  for (Application::AllowedMountPoint const& allowed_mount_point : application.allowed_mount_points())
+  {
+    allow_limits_.push_back(make_limit(allowed_mount_point.rate_limit_per_minute_, allowed_mount_point.rate_limit_burst_));
+    enabled_ |= allow_limits_.back().interval_ != clock_type::duration::zero();
+  }
+}
+
+RateLimiter::Entry& RateLimiter::find_or_insert(uint64_t key, clock_type::rep now, Entry const* keep)
+{
+  std::size_t const mask = entries_.size() - 1;
+  Entry* reusable = nullptr;
+  for (std::size_t index = mix(key) & mask;; index = (index + 1) & mask)
+  {
+    Entry& entry = entries_[index];
+    if (entry.key_ == key)
+      return entry;
+
+    if (entry.key_ == empty_key_c)
+    {
+      // Not found: prefer to replace a full bucket that we passed over, so that the probe sequences stay short.
+      if (!reusable)
+      {
+        reusable = &entry;
+        ++used_;
+      }
+      break;
+    }
+
+    // The bucket of the uid can be full too (it was just inserted, or it expired); it must not become the allow-entry bucket.
+    if (!reusable && &entry != keep && entry.theoretical_arrival_time_ <= now)
+      reusable = &entry;
+  }
+
+  reusable->key_ = key;
+  reusable->theoretical_arrival_time_ = now;
+  return *reusable;
+}
+
+void RateLimiter::rehash(clock_type::rep now)
+{
+  std::size_t live = 0;
+  for (Entry const& entry : entries_)
+    if (entry.key_ != empty_key_c && entry.theoretical_arrival_time_ > now)
+      ++live;
+
+  std::size_t capacity = entries_.size();
+  while (live * 4 > capacity)
+    capacity *= 2;
+
+  Dout(dc::notice, "RateLimiter::rehash: " << live << " active buckets, capacity " << entries_.size() << " --> " << capacity);
+
+  std::vector<Entry> old_entries(capacity, Entry{empty_key_c, 0});
+  old_entries.swap(entries_);
+  used_ = 0;
+  for (Entry const& entry : old_entries)
+    if (entry.key_ != empty_key_c && entry.theoretical_arrival_time_ > now)
+      find_or_insert(entry.key_, now).theoretical_arrival_time_ = entry.theoretical_arrival_time_;
+}
+
+//static
+void RateLimiter::consume(Entry& entry, Limit const& limit, clock_type::rep now)
+{
+  entry.theoretical_arrival_time_ = std::max(entry.theoretical_arrival_time_, now) + limit.interval_.count();
+}
+
+bool RateLimiter::try_acquire(uid_t uid, std::size_t allow_index)
+{
+  if (!enabled_)
+    return true;
+
+  Limit const& allow_limit = allow_limits_[allow_index];
+  bool const limit_uid = uid_limit_.interval_ != clock_type::duration::zero();
+  bool const limit_allow = allow_limit.interval_ != clock_type::duration::zero();
+  clock_type::rep const now = clock_type::now().time_since_epoch().count();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Keep the table at most half full, which also guarantees that find_or_insert finds an empty entry.
+  if ((used_ + 2) * 2 > entries_.size())
+    rehash(now);
+
+  Entry* uid_entry = limit_uid ? &find_or_insert(make_key(uid, static_cast<std::size_t>(-1)), now) : nullptr;
+  if (uid_entry && !conforms(*uid_entry, uid_limit_, now))
+    return false;
+
+  Entry* allow_entry = limit_allow ? &find_or_insert(make_key(uid, allow_index), now, uid_entry) : nullptr;
+  if (allow_entry && !conforms(*allow_entry, allow_limit, now))
+    return false;
+
+  if (uid_entry)
+    consume(*uid_entry, uid_limit_, now);
+  if (allow_entry)
+    consume(*allow_entry, allow_limit, now);
+  return true;
+}
+
+ScopedFd RateLimiter::save_state()
+{
+  clock_type::rep const now = clock_type::now().time_since_epoch().count();
+  std::vector<Entry> live_entries;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (Entry const& entry : entries_)
+      if (entry.key_ != empty_key_c && entry.theoretical_arrival_time_ > now)
+        live_entries.push_back(entry);
+  }
+  if (live_entries.empty())
+    return {};
+
+  ScopedFd fd(memfd_create("remountd-rate-limiter", MFD_CLOEXEC));
+  if (!fd.valid())
+    throw std::system_error(errno, std::generic_category(), "memfd_create failed");
+
+  // The keys contain the index of the allow-entry; the next instance maps them by name.
+  std::string names;
+  std::vector<Application::AllowedMountPoint> const& allowed_mount_points = Application::instance().allowed_mount_points();
+  for (Application::AllowedMountPoint const& allowed_mount_point : allowed_mount_points)
+  {
+    uint32_t const length = static_cast<uint32_t>(allowed_mount_point.name_.size());
+    names.append(reinterpret_cast<char const*>(&length), sizeof(length)).append(allowed_mount_point.name_);
+  }
+
+  // steady_clock is CLOCK_MONOTONIC, which is the same for every process, so the times can be stored as-is.
+  StateHeader const header{state_magic_c, static_cast<uint32_t>(allowed_mount_points.size()), static_cast<uint32_t>(live_entries.size()),
+      static_cast<uint32_t>(names.size())};
+  std::size_t const size = live_entries.size() * sizeof(Entry);
+  if (write(fd.get(), &header, sizeof(header)) != sizeof(header) ||
+      write(fd.get(), names.data(), names.size()) != static_cast<ssize_t>(names.size()) ||
+      write(fd.get(), live_entries.data(), size) != static_cast<ssize_t>(size))
+    throw std::system_error(errno, std::generic_category(), "write(memfd) failed");
+
+  Dout(dc::notice, "RateLimiter::save_state: saved " << live_entries.size() << " buckets.");
+  return fd;
+}
+
+void RateLimiter::restore_state(int fd)
+{
+  StateHeader header;
+  struct stat state_stat;
+  if (fstat(fd, &state_stat) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic_ != state_magic_c)
+  {
+    syslog(LOG_WARNING, "Ignoring the saved rate limiter state: unknown format.");
+    return;
+  }
+
+  // Do not trust the counts any further than the size of the state.
+  std::size_t const size = static_cast<std::size_t>(header.number_of_entries_) * sizeof(Entry);
+  if (static_cast<std::size_t>(state_stat.st_size) != sizeof(header) + header.names_size_ + size)
+  {
+    syslog(LOG_WARNING, "Ignoring the saved rate limiter state: truncated.");
+    return;
+  }
+  std::string names(header.names_size_, '\0');
+  std::vector<Entry> saved_entries(header.number_of_entries_);
+  if (pread(fd, names.data(), names.size(), sizeof(header)) != static_cast<ssize_t>(names.size()) ||
+      pread(fd, saved_entries.data(), size, sizeof(header) + names.size()) != static_cast<ssize_t>(size))
+  {
+    syslog(LOG_WARNING, "Ignoring the saved rate limiter state: truncated.");
+    return;
+  }
+
+  // The current index of every saved allow-entry, or -1 if it no longer exists.
+  std::vector<std::size_t> allow_indices;
+  std::string_view names_left(names);
+  for (uint32_t i = 0; i < header.number_of_names_; ++i)
+  {
+    uint32_t length;
+    if (names_left.size() < sizeof(length))
+      break;
+    std::memcpy(&length, names_left.data(), sizeof(length));
+    names_left.remove_prefix(sizeof(length));
+    if (names_left.size() < length)
+      break;
+    Application::AllowedMountPoint const* const allowed_mount_point = find_allowed_mount_point(names_left.substr(0, length));
+    names_left.remove_prefix(length);
+    allow_indices.push_back(allowed_mount_point ?
+        static_cast<std::size_t>(allowed_mount_point - Application::instance().allowed_mount_points().data()) : static_cast<std::size_t>(-1));
+  }
+
+  clock_type::rep const now = clock_type::now().time_since_epoch().count();
+  std::size_t restored = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (Entry const& entry : saved_entries)
+  {
+    // Drop buckets that are full by now, or of allow-entries that no longer exist.
+    if (entry.theoretical_arrival_time_ <= now)
+      continue;
+    uint64_t key = entry.key_;
+    if (uint64_t const saved_allow_index = (key >> 32); saved_allow_index > 0)
+    {
+      if (saved_allow_index > allow_indices.size() || allow_indices[saved_allow_index - 1] == static_cast<std::size_t>(-1))
+        continue;
+      key = make_key(static_cast<uid_t>(key), allow_indices[saved_allow_index - 1]);
+    }
+    if ((used_ + 1) * 2 > entries_.size())
+      rehash(now);
+    find_or_insert(key, now).theoretical_arrival_time_ = entry.theoretical_arrival_time_;
+    ++restored;
+  }
+  Dout(dc::notice, "RateLimiter::restore_state: restored " << restored << " buckets.");
+}
+
+} // namespace remountd
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "ScopedFd.h"
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace remountd {
+
+// RateLimiter
+//
+// Token bucket rate limits on remount requests, keyed on the uid of the
+// peer and, for allow-entries that configure their own limit, on the pair
+// (uid, allow-entry). A request must fit in every bucket that applies to it.
+//
+// Each bucket is stored as a single "theoretical arrival time" (the GCRA
+// formulation of a token bucket): a request is allowed when that time is
+// not more than burst - 1 emission intervals in the future, and it then
+// advances by one emission interval. A bucket whose time lies in the past
+// is full, which is the same as not having an entry at all; such entries
+// are reused in place and dropped when the table is rehashed.
+//
+// The buckets live in an open-addressed table with linear probing of
+// 16-byte entries, shared by all reactors and protected by a mutex that is
+// held for one probe sequence per request.
+//
+// The buckets that are not full can be saved to a memfd and restored from
+// it by the next instance of the daemon (see save_state()), so that exiting
+// on idle and being started again does not reset the limits. The saved
+// state names the allow-entries, so that the buckets of an entry end up
+// with the same entry when the configuration changed in between; buckets
+// of entries that no longer exist are dropped.
+class RateLimiter
+{
+ public:
+  using clock_type = std::chrono::steady_clock;
+
+ private:
+  // Parameters of one token bucket.
+  struct Limit
+  {
+    clock_type::duration interval_;             // Time in which one token is added to the bucket; zero if unlimited.
+    clock_type::duration tolerance_;            // (burst - 1) * interval_.
+  };
+
+  // One bucket.
+  struct Entry
+  {
+    uint64_t key_;                              // uid and allow-entry index (see make_key), or empty_key_c.
+    clock_type::rep theoretical_arrival_time_;  // Time at which the bucket is full again, in clock_type ticks since its epoch.
+  };
+
+  static constexpr uint64_t empty_key_c = ~uint64_t{0};        // Key of an unused entry.
+  static constexpr std::size_t initial_capacity_c = 256;        // Initial number of entries; a power of two.
+  static constexpr uint32_t state_magic_c = 0x524c5332;         // "RLS2": format of the saved state.
+
+  // Header of the saved state, followed by number_of_names_ names (each a uint32_t length and the characters) of the
+  // allow-entries, by index, and then number_of_entries_ Entry's.
+  struct StateHeader
+  {
+    uint32_t magic_;                            // state_magic_c.
+    uint32_t number_of_names_;                  // Number of allow-entries of the instance that saved the state.
+    uint32_t number_of_entries_;                // Number of saved buckets.
+    uint32_t names_size_;                       // Size in bytes of the names.
+  };
+
+  Limit uid_limit_;                             // The limit per uid over all allow-entries.
+  std::vector<Limit> allow_limits_;             // The limit per uid of each allow-entry, indexed like Application::allowed_mount_points().
+  bool enabled_ = false;                        // False if no limit was configured at all.
+  std::mutex mutex_;                            // Protects the members below.
+  std::vector<Entry> entries_;                  // Open-addressed hash table of buckets.
+  std::size_t used_ = 0;                        // Number of entries in entries_ whose key is not empty_key_c.
+
+ private:
+  // Convert a configured rate and burst to a Limit.
+  static Limit make_limit(unsigned int per_minute, unsigned int burst);
+
+  // Return the key of the bucket of `uid` for the allow-entry with index `allow_index`, or for all allow-entries if allow_index is -1.
+  static uint64_t make_key(uid_t uid, std::size_t allow_index) { return (static_cast<uint64_t>(allow_index + 1) << 32) | uid; }
+
+  // Return the bucket with `key`, inserting a full one if it doesn't exist. Must be called with mutex_ locked.
+  // A full bucket may be replaced by the new one, except `keep` (the other bucket of the same request).
+  Entry& find_or_insert(uint64_t key, clock_type::rep now, Entry const* keep = nullptr);
+
+  // Rebuild entries_ without the full buckets, growing it if it is still more than a quarter full.
+  void rehash(clock_type::rep now);
+
+  // Return true if the bucket allows one more request at `now`.
+  static bool conforms(Entry const& entry, Limit const& limit, clock_type::rep now) { return entry.theoretical_arrival_time_ - limit.tolerance_.count() <= now; }
+
+  // Take one token from the bucket.
+  static void consume(Entry& entry, Limit const& limit, clock_type::rep now);
+
+ public:
+  // Read the configured limits from Application.
+  RateLimiter();
+
+  RateLimiter(RateLimiter const&) = delete;
+  RateLimiter& operator=(RateLimiter const&) = delete;
+
+  // Return true, and take a token from each applicable bucket, if `uid` may perform a request on the allow-entry with index `allow_index`.
+  bool try_acquire(uid_t uid, std::size_t allow_index);
+
+  // Return a memfd with the buckets that are not full, or an invalid fd if there are none.
+  ScopedFd save_state();
+
+  // Restore the buckets that were saved by save_state(), possibly by a previous process.
+  void restore_state(int fd);
+};
+
+} // namespace remountd
@@ -0,0 +1,736 @@
+#include "sys.h"
+#include "Reactor.h"
+#include "SocketServer.h"
+#include "Application.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#include "debug.h"
+
+namespace remountd {
+
+bool Reactor::ChildAwaiter::await_ready()
+{
+  pidfd_.reset(static_cast<int>(syscall(SYS_pidfd_open, pid_, 0)));
+  // Without pidfd support await_resume() simply blocks in waitpid.
+  return !pidfd_.valid();
+}
+
+void Reactor::ReadableAnyAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+  reactor_.watch_fd(fds_[0], false, handle);
+  registered_ = true;
+  reactor_.watch_fd(fds_[1], false, handle);
+}
+
+int Reactor::ReadableAnyAwaiter::unwatch()
+{
+  // Reactor::run() already unregistered the file descriptor that fired.
+  int fired = -1;
+  for (int const fd : fds_)
+  {
+    if (reactor_.watching_fd(fd))
+      reactor_.unwatch_fd(fd, false);
+    else
+      fired = fd;
+  }
+  return fired;
+}
+
+Reactor::ChildStatus Reactor::ChildAwaiter::await_resume()
+{
+  registered_ = false;
+  ChildStatus result{0, 0};
+  while (waitpid(pid_, &result.status_, 0) < 0)
+  {
+    if (errno == EINTR)
+      continue;
+
+    result.error_ = errno;
+    break;
+  }
+  return result;
+}
+
+Reactor::Reactor(SocketServer& socket_server, int index, int terminate_fd, std::vector<int> listener_fds) :
+    socket_server_(socket_server), index_(index),
+    max_in_flight_(static_cast<int>(Application::instance().max_in_flight_requests())),
+    max_pending_output_(Application::instance().max_pending_output_bytes()),
+    idle_timeout_ticks_(Application::instance().idle_timeout_seconds() / idle_tick_c.count()),
+    listener_fds_(std::move(listener_fds)), terminate_fd_(terminate_fd), report_busy_(socket_server.exit_timer_fd() != -1)
+{
+  DoutEntering(dc::notice, "Reactor::Reactor(" << index << ", " << terminate_fd << ", {" << listener_fds_.size() << " listeners}) [" << this << "]");
+
+  epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
+  if (!epoll_fd_.valid())
+    throw std::system_error(errno, std::generic_category(), "epoll_create1 failed");
+
+  add_fd_to_epoll(terminate_fd_, EPOLLIN);
+  for (int const listener_fd : listener_fds_)
+    add_fd_to_epoll(listener_fd, EPOLLIN | EPOLLEXCLUSIVE);
+
+  if (idle_timeout_ticks_ > 0)
+  {
+    idle_timer_fd_.reset(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (!idle_timer_fd_.valid())
+      throw std::system_error(errno, std::generic_category(), "timerfd_create failed");
+    add_fd_to_epoll(idle_timer_fd_.get(), EPOLLIN);
+  }
+
+  if (index_ == 0 && socket_server_.exit_timer_fd() != -1)
+  {
+    exit_timer_fd_ = socket_server_.exit_timer_fd();
+    add_fd_to_epoll(exit_timer_fd_, EPOLLIN);
+  }
+
+  ServiceNotifier const& service_notifier = socket_server_.service_notifier();
+  if (service_notifier.enabled())
+  {
+    service_timer_fd_.reset(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (!service_timer_fd_.valid())
+      throw std::system_error(errno, std::generic_category(), "timerfd_create failed");
+    auto const interval = std::chrono::duration_cast<std::chrono::nanoseconds>(service_notifier.tick_interval());
+    timespec const period{ .tv_sec = static_cast<time_t>(interval.count() / 1000000000), .tv_nsec = static_cast<long>(interval.count() % 1000000000) };
+    itimerspec const spec{ .it_interval = period, .it_value = period };
+    if (timerfd_settime(service_timer_fd_.get(), 0, &spec, nullptr) != 0)
+      throw std::system_error(errno, std::generic_category(), "timerfd_settime failed");
+    add_fd_to_epoll(service_timer_fd_.get(), EPOLLIN);
+  }
+}
+
+Reactor::~Reactor()
+{
+  DoutEntering(dc::notice, "Reactor::~Reactor() [" << this << "]");
+
+  // Destroy suspended request coroutines first: their awaiters unregister from this reactor and they may still refer to their client.
+  tasks_.destroy_all();
+
+  Dout(dc::notice, "Calling clients_.clear()");
+  clients_.clear();
+  detached_clients_.clear();
+  free_clients_.clear();
+}
+
+void Reactor::add_fd_to_epoll(int fd, uint32_t events)
+{
+  DoutEntering(dc::notice, "Reactor::add_fd_to_epoll(" << fd << ", " << events << ")");
+
+  epoll_event event{};
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, fd, &event) != 0)
+    throw std::system_error(errno, std::generic_category(), "epoll_ctl(ADD) failed");
+}
+
+void Reactor::modify_fd_in_epoll(int fd, uint32_t events)
+{
+  DoutEntering(dc::notice, "Reactor::modify_fd_in_epoll(" << fd << ", " << events << ")");
+
+  epoll_event event{};
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_MOD, fd, &event) != 0)
+    throw std::system_error(errno, std::generic_category(), "epoll_ctl(MOD) failed");
+}
+
+void Reactor::remove_fd_from_epoll(int fd)
+{
+  DoutEntering(dc::notice, "Reactor::remove_fd_from_epoll(" << fd << ")");
+
+  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fd, nullptr) == 0)
+    return;
+  if (errno == ENOENT || errno == EBADF)
+    return;
+  throw std::system_error(errno, std::generic_category(), "epoll_ctl(DEL) failed");
+}
+
+SocketClient* Reactor::add_client(int client_fd, int listener_index)
+{
+  DoutEntering(dc::notice, "Reactor::add_client(" << client_fd << ", " << listener_index << ")");
+
+  if (!socket_server_.try_reserve_client())
+  {
+    reject_client(client_fd);
+    return nullptr;
+  }
+
+  std::unique_ptr<SocketClient> client;
+  if (!free_clients_.empty())
+  {
+    client = std::move(free_clients_.back());
+    free_clients_.pop_back();
+    client->reuse(client_fd);
+  }
+  else
+    client = socket_server_.create_client(*this, client_fd);
+
+  if (static_cast<std::size_t>(client_fd) >= clients_.size())
+    clients_.resize(client_fd + 1);
+
+  client->listener_index_ = listener_index;
+  client->epoll_events_ = EPOLLIN | EPOLLRDHUP;
+  add_fd_to_epoll(client_fd, client->epoll_events_);
+  Dout(dc::notice, "Adding client with fd " << client_fd << " to clients_ of reactor " << index_ << ".");
+  clients_[client_fd] = std::move(client);
+  ++number_of_clients_;
+
+  if (idle_timeout_ticks_ > 0)
+  {
+    clients_[client_fd]->last_activity_tick_ = idle_wheel_.current_tick();
+    schedule_idle_timeout(*clients_[client_fd]);
+  }
+
+  return clients_[client_fd].get();
+}
+
+void Reactor::reject_client(int client_fd)
+{
+  static constexpr std::string_view reply = "ERROR: too many clients.\n";
+
+  syslog(LOG_WARNING, "Rejecting client fd %d: %u clients are connected", client_fd, Application::instance().max_clients());
+  // Best effort: the socket is new, so the reply fits in the send buffer.
+  [[maybe_unused]] ssize_t const sent = send(client_fd, reply.data(), reply.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+  close(client_fd);
+}
+
+void Reactor::schedule_idle_timeout(SocketClient& client)
+{
+  // The tick that is in progress counts as a whole, hence the + 1.
+  idle_wheel_.insert(client, std::max(client.last_activity_tick_, idle_wheel_.current_tick()) + idle_timeout_ticks_ + 1);
+
+  if (idle_timer_armed_)
+    return;
+
+  itimerspec const spec{ .it_interval = { .tv_sec = idle_tick_c.count(), .tv_nsec = 0 }, .it_value = { .tv_sec = idle_tick_c.count(), .tv_nsec = 0 } };
+  if (timerfd_settime(idle_timer_fd_.get(), 0, &spec, nullptr) != 0)
+    throw std::system_error(errno, std::generic_category(), "timerfd_settime failed");
+  idle_timer_armed_ = true;
+}
+
+void Reactor::handle_idle_timer()
+{
+  uint64_t expirations;
+  if (read(idle_timer_fd_.get(), &expirations, sizeof(expirations)) != sizeof(expirations))
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
+    throw std::system_error(errno, std::generic_category(), "read(timerfd) failed");
+  }
+
+  idle_wheel_.advance(expirations, idle_expired_);
+  for (SocketClient* const client : idle_expired_)
+  {
+    // A client that is waiting for a reply, or that was active since it was scheduled, is not idle.
+    // One that shut down its side of the connection is, once its output got stuck.
+    if (client->busy() || (client->pending_output() > 0 && !client->closing_) ||
+        client->last_activity_tick_ + idle_timeout_ticks_ >= idle_wheel_.current_tick())
+    {
+      schedule_idle_timeout(*client);
+      continue;
+    }
+
+    syslog(LOG_INFO, "Closing client fd %d: idle for %lu seconds", client->fd(), static_cast<unsigned long>(idle_timeout_ticks_ * idle_tick_c.count()));
+    remove_client(client->fd());
+  }
+  idle_expired_.clear();
+
+  if (idle_wheel_.empty())
+  {
+    // Do not wake up every second while there are no clients.
+    itimerspec const disarm{};
+    if (timerfd_settime(idle_timer_fd_.get(), 0, &disarm, nullptr) != 0)
+      throw std::system_error(errno, std::generic_category(), "timerfd_settime failed");
+    idle_timer_armed_ = false;
+  }
+}
+
+void Reactor::handle_service_timer()
+{
+  uint64_t expirations;
+  if (read(service_timer_fd_.get(), &expirations, sizeof(expirations)) != sizeof(expirations))
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
+    throw std::system_error(errno, std::generic_category(), "read(timerfd) failed");
+  }
+
+  ServiceNotifier& service_notifier = socket_server_.service_notifier();
+  service_notifier.heartbeat(index_);
+  if (index_ == 0)
+    service_notifier.tick();
+}
+
+void Reactor::adopt_client(SocketClient::HandoverState state)
+{
+  DoutEntering(dc::notice, "Reactor::adopt_client(" << state.fd_.get() << ", " << state.listener_index_ << ")");
+
+  int const client_fd = state.fd_.release();
+  SocketClient* const client = add_client(client_fd, state.listener_index_);
+  if (!client)
+    return;
+
+  if (!client->restore_handover_state(state))
+  {
+    syslog(LOG_ERR, "Dropping handed over client fd %d: invalid state", client_fd);
+    remove_client(client_fd);
+    return;
+  }
+  if (client->pending_output() > 0)
+    flush_at_end_of_iteration(*client);
+  // Process the messages that the previous instance did not get to.
+  if (client->has_buffered_input())
+  {
+    client->queued_for_input_ = true;
+    ready_clients_.push_back(client_fd);
+  }
+}
+
+void Reactor::begin_handover()
+{
+  DoutEntering(dc::notice, "Reactor::begin_handover() [reactor " << index_ << "]");
+
+  handing_over_ = true;
+  handover_deadline_ = clock_type::now() + handover_drain_timeout_c;
+  // The termination fd stays readable; new connections wait in the listen backlog for the next instance.
+  remove_fd_from_epoll(terminate_fd_);
+  for (int const listener_fd : listener_fds_)
+    remove_fd_from_epoll(listener_fd);
+  for (std::unique_ptr<SocketClient> const& client : clients_)
+  {
+    if (!client)
+      continue;
+    client->handing_over_ = true;
+    update_client_interest(*client);
+  }
+}
+
+bool Reactor::ready_for_handover() const
+{
+  if (!detached_clients_.empty())
+    return false;
+  for (std::unique_ptr<SocketClient> const& client : clients_)
+    if (client && (client->busy() || client->pending_output() > 0))
+      return false;
+  return true;
+}
+
+void Reactor::release_clients_for_handover(std::vector<SocketClient::HandoverState>& states)
+{
+  for (std::unique_ptr<SocketClient> const& client : clients_)
+  {
+    // Connections to the socket of an attachment, and those with a request that did not finish in time, are closed.
+    if (!client || client->listener_index() < 0 || client->busy() || client->closing_)
+      continue;
+    int const client_fd = client->fd();
+    states.push_back(client->release_for_handover());
+    remove_client(client_fd);
+  }
+}
+
+void Reactor::update_busy()
+{
+  bool const busy = number_of_clients_ > 0 || !tasks_.empty();
+  if (busy == busy_)
+    return;
+  busy_ = busy;
+  socket_server_.reactor_busy(busy);
+}
+
+void Reactor::recycle_client(std::unique_ptr<SocketClient> client)
+{
+  client->disconnect();
+  if (free_clients_.size() < max_free_clients_c)
+    free_clients_.push_back(std::move(client));
+}
+
+void Reactor::remove_client(int client_fd)
+{
+  DoutEntering(dc::notice, "Reactor::remove_client(" << client_fd << ")");
+  if (!find_client(client_fd))
+    return;
+
+  remove_fd_from_epoll(client_fd);
+  std::unique_ptr<SocketClient> client = std::move(clients_[client_fd]);
+  --number_of_clients_;
+  socket_server_.release_client();
+  idle_wheel_.remove(*client);
+  Dout(dc::notice, "Erased client with fd " << client_fd << " from clients_.");
+  if (client->busy())
+  {
+    // The request coroutine still refers to the client; keep the object until the request finished.
+    Dout(dc::notice, "Detaching busy client with fd " << client_fd << ".");
+    client->disconnect();
+    detached_clients_.push_back(std::move(client));
+    return;
+  }
+  recycle_client(std::move(client));
+}
+
+int Reactor::listener_index(int fd) const
+{
+  for (std::size_t i = 0; i < listener_fds_.size(); ++i)
+    if (listener_fds_[i] == fd)
+      return static_cast<int>(i);
+  return -1;
+}
+
+void Reactor::accept_new_clients(int listener_index)
+{
+  for (int accepted = 0; accepted < max_accepts_per_wakeup_c; ++accepted)
+  {
+    int const client_fd = accept4(listener_fds_[listener_index], nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd >= 0)
+    {
+      add_client(client_fd, listener_index);
+      continue;
+    }
+
+    if (errno == EINTR)
+      continue;
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return;
+
+    throw std::system_error(errno, std::generic_category(), "accept4 failed");
+  }
+}
+
+void Reactor::update_client_interest(SocketClient& client)
+{
+  // EPOLLRDHUP is level-triggered too: only ask for it while the end of the input would be read.
+  uint32_t events = 0;
+  if (client.accepts_input())
+    events |= EPOLLIN | EPOLLRDHUP;
+  if (client.pending_output() > 0)
+    events |= EPOLLOUT;
+  if (events == client.epoll_events_)
+    return;
+
+  modify_fd_in_epoll(client.fd(), events);
+  client.epoll_events_ = events;
+}
+
+void Reactor::handle_client_readable(int client_fd)
+{
+  //DoutEntering(dc::notice, "Reactor::handle_client_readable(" << client_fd << ")");
+
+  SocketClient* const client_ptr = find_client(client_fd);
+  if (!client_ptr)
+    return;
+
+  SocketClient& client = *client_ptr;
+  // Input that is already buffered is processed from the round-robin queue.
+  if (client.queued_for_input_)
+    return;
+
+  if (client.closing_ || !client.handle_readable(message_budget_c))
+  {
+    // Deliver the replies to the requests that preceded the end of the connection before closing it.
+    client.closing_ = true;
+    if (client.fd() != -1 && client.pending_output() > 0)
+      client.flush_output();
+    if (client.fd() != -1 && (client.busy() || client.pending_output() > 0))
+    {
+      update_client_interest(client);
+      return;
+    }
+    remove_client(client_fd);
+    return;
+  }
+  update_client_interest(client);
+  client.last_activity_tick_ = idle_wheel_.current_tick();
+
+  if (client.accepts_input() && client.has_buffered_input())
+  {
+    client.queued_for_input_ = true;
+    ready_clients_.push_back(client_fd);
+  }
+}
+
+void Reactor::handle_client_writable(int client_fd)
+{
+  SocketClient* const client_ptr = find_client(client_fd);
+  if (!client_ptr)
+    return;
+
+  SocketClient& client = *client_ptr;
+  client.flush_output();
+  // Dispatch input that was left buffered while the output was over its limit; or close the connection once the output drained.
+  if (client.closing_ || (client.accepts_input() && client.has_buffered_input()))
+    handle_client_readable(client_fd);
+  else
+    update_client_interest(client);
+}
+
+void Reactor::service_ready_clients()
+{
+  ready_clients_scratch_.swap(ready_clients_);
+  for (int const client_fd : ready_clients_scratch_)
+  {
+    SocketClient* const client = find_client(client_fd);
+    if (!client)
+      continue;
+    client->queued_for_input_ = false;
+    handle_client_readable(client_fd);
+  }
+  ready_clients_scratch_.clear();
+}
+
+void Reactor::request_finished(SocketClient& client)
+{
+  // Called from inside the request coroutine, which might still be running a member function of `client`.
+  // Defer the actual work to process_finished_requests().
+  if (client.fd() != -1)
+    finished_request_fds_.push_back(client.fd());
+}
+
+void Reactor::flush_at_end_of_iteration(SocketClient& client)
+{
+  if (client.queued_for_flush_)
+    return;
+  client.queued_for_flush_ = true;
+  flush_clients_.push_back(client.fd());
+}
+
+void Reactor::flush_clients()
+{
+  for (int const client_fd : flush_clients_)
+  {
+    SocketClient* const client_ptr = find_client(client_fd);
+    if (!client_ptr)
+      continue;
+
+    SocketClient& client = *client_ptr;
+    client.queued_for_flush_ = false;
+    client.flush_output();
+    update_client_interest(client);
+    // Input might have been paused because of the output that was just written.
+    if (client.accepts_input() && client.has_buffered_input() && !client.queued_for_input_)
+    {
+      client.queued_for_input_ = true;
+      ready_clients_.push_back(client_fd);
+    }
+  }
+  flush_clients_.clear();
+}
+
+void Reactor::process_finished_requests()
+{
+  for (std::size_t i = 0; i < detached_clients_.size();)
+  {
+    if (detached_clients_[i]->busy())
+    {
+      ++i;
+      continue;
+    }
+    recycle_client(std::move(detached_clients_[i]));
+    detached_clients_[i] = std::move(detached_clients_.back());
+    detached_clients_.pop_back();
+  }
+
+  // Note that handle_client_readable can start new requests that finish immediately and append to finished_request_fds_.
+  for (std::size_t i = 0; i < finished_request_fds_.size(); ++i)
+    handle_client_readable(finished_request_fds_[i]);
+  finished_request_fds_.clear();
+}
+
+//static
+uint32_t Reactor::watched_events(FdWaiters const& waiters)
+{
+  return (waiters.readable_ ? uint32_t{EPOLLIN} : 0) | (waiters.writable_ ? uint32_t{EPOLLOUT} : 0);
+}
+
+void Reactor::update_fd_watch(int fd, uint32_t old_events)
+{
+  uint32_t const events = watched_events(fd_waiters_[fd]);
+  if (events == old_events)
+    return;
+  if (events == 0)
+    remove_fd_from_epoll(fd);
+  else if (old_events == 0)
+    add_fd_to_epoll(fd, events);
+  else
+    modify_fd_in_epoll(fd, events);
+}
+
+void Reactor::watch_fd(int fd, bool writable, std::coroutine_handle<> handle)
+{
+  if (static_cast<std::size_t>(fd) >= fd_waiters_.size())
+    fd_waiters_.resize(fd + 1);
+  FdWaiters& waiters = fd_waiters_[fd];
+  uint32_t const old_events = watched_events(waiters);
+  (writable ? waiters.writable_ : waiters.readable_) = handle;
+  update_fd_watch(fd, old_events);
+}
+
+void Reactor::unwatch_fd(int fd, bool writable)
+{
+  FdWaiters& waiters = fd_waiters_[fd];
+  uint32_t const old_events = watched_events(waiters);
+  (writable ? waiters.writable_ : waiters.readable_) = nullptr;
+  update_fd_watch(fd, old_events);
+}
+
+void Reactor::add_timer(clock_type::time_point deadline, std::coroutine_handle<> handle, SleepAwaiter* awaiter)
+{
+  timers_.push_back({deadline, handle, awaiter});
+  std::push_heap(timers_.begin(), timers_.end());
+}
+
+void Reactor::cancel_timer(SleepAwaiter* awaiter)
+{
+  auto const iter = std::find_if(timers_.begin(), timers_.end(), [awaiter](Timer const& timer){ return timer.awaiter_ == awaiter; });
+  if (iter == timers_.end())
+    return;
+  timers_.erase(iter);
+  std::make_heap(timers_.begin(), timers_.end());
+}
+
+void Reactor::run_expired_timers()
+{
+  clock_type::time_point const now = clock_type::now();
+  while (!timers_.empty() && timers_.front().deadline_ <= now)
+  {
+    std::pop_heap(timers_.begin(), timers_.end());
+    std::coroutine_handle<> const handle = timers_.back().handle_;
+    timers_.pop_back();
+    handle.resume();
+  }
+}
+
+int Reactor::next_timeout() const
+{
+  if (timers_.empty())
+    return -1;
+
+  clock_type::duration const remaining = timers_.front().deadline_ - clock_type::now();
+  if (remaining <= clock_type::duration::zero())
+    return 0;
+
+  // Round up, so that we don't wake up just before the deadline.
+  return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(remaining).count());
+}
+
+void Reactor::run()
+{
+  DoutEntering(dc::notice, "Reactor::run() [reactor " << index_ << "]");
+
+  tasks_.make_current();
+  socket_server_.start_reactor(*this);
+
+  epoll_event events[max_events_c];
+  for (;;)
+  {
+    // Do not block while there are clients with left over input.
+    int timeout = ready_clients_.empty() ? next_timeout() : 0;
+    // While handing over, check the deadline at least every handover_poll_interval_ms_c.
+    if (handing_over_ && (timeout == -1 || timeout > handover_poll_interval_ms_c))
+      timeout = handover_poll_interval_ms_c;
+    int const event_count = epoll_wait(epoll_fd_.get(), events, max_events_c, timeout);
+    if (event_count < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw std::system_error(errno, std::generic_category(), "epoll_wait failed");
+    }
+
+    for (int i = 0; i < event_count; ++i)
+    {
+      int const fd = events[i].data.fd;
+      uint32_t const epoll_events = events[i].events;
+
+      // The termination fd is drained by SocketServer after all reactors returned.
+      if (fd == terminate_fd_)
+      {
+        if (!socket_server_.hand_over_on_exit())
+          return;
+        begin_handover();
+        continue;
+      }
+
+      if (fd == idle_timer_fd_.get())
+      {
+        handle_idle_timer();
+        continue;
+      }
+
+      if (fd == exit_timer_fd_)
+      {
+        socket_server_.handle_exit_timer();
+        continue;
+      }
+
+      if (fd == service_timer_fd_.get())
+      {
+        handle_service_timer();
+        continue;
+      }
+
+      if (int const listener = listener_index(fd); listener != -1)
+      {
+        if ((epoll_events & EPOLLIN) != 0)
+          accept_new_clients(listener);
+        continue;
+      }
+
+      if (static_cast<std::size_t>(fd) < fd_waiters_.size() && watched_events(fd_waiters_[fd]) != 0)
+      {
+        // A hangup or error wakes up both waiters; they find out when they use the fd.
+        FdWaiters& waiters = fd_waiters_[fd];
+        uint32_t const old_events = watched_events(waiters);
+        bool const hung_up = (epoll_events & (EPOLLERR | EPOLLHUP)) != 0;
+        std::coroutine_handle<> readable;
+        std::coroutine_handle<> writable;
+        if (hung_up || (epoll_events & EPOLLIN) != 0)
+          readable = std::exchange(waiters.readable_, nullptr);
+        if (hung_up || (epoll_events & EPOLLOUT) != 0)
+          writable = std::exchange(waiters.writable_, nullptr);
+        update_fd_watch(fd, old_events);
+        if (readable)
+          readable.resume();
+        if (writable)
+          writable.resume();
+        continue;
+      }
+
+      // The peer is gone completely: nobody reads the replies anymore.
+      if ((epoll_events & (EPOLLERR | EPOLLHUP)) != 0)
+      {
+        remove_client(fd);
+        continue;
+      }
+      if ((epoll_events & EPOLLOUT) != 0)
+        handle_client_writable(fd);
+      // After a half-close (EPOLLRDHUP) the remaining input is processed and read() returns the end of the input.
+      if ((epoll_events & (EPOLLIN | EPOLLRDHUP)) != 0)
+        handle_client_readable(fd);
+    }
+
+    run_expired_timers();
+    process_finished_requests();
+    service_ready_clients();
+    flush_clients();
+    if (report_busy_)
+      update_busy();
+
+    if (listener_fds_.empty() && number_of_clients_ == 0 && detached_clients_.empty())
+      return;
+
+    if (handing_over_ && (ready_for_handover() || clock_type::now() >= handover_deadline_))
+      return;
+  }
+}
+
+} // namespace remountd
@@ -0,0 +1,407 @@
+#pragma once
+
+#include "IdleTimerWheel.h"
+#include "SocketClient.h"
+#include "Task.h"
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace remountd {
+
+class SocketServer;
+
+// Reactor
+//
+// One epoll event loop. A Reactor owns its own epoll instance and the
+// clients that it accepted; those clients are never touched by another
+// thread, so no locking is needed on the hot path. Every reactor registers
+// all listeners of the SocketServer; when SocketServer runs several
+// reactors it does so with EPOLLEXCLUSIVE so that the kernel wakes only
+// one of them per incoming connection. All reactors watch the same termination fd
+// (level-triggered, never drained here) so that a single wakeup byte
+// stops every one of them.
+//
+// Per wakeup a client gets to dispatch at most message_budget_c messages.
+// A client that has buffered input left after that is appended to a
+// round-robin queue and serviced again after the next epoll_wait, which
+// does not block while that queue is non-empty.
+//
+// Replies are not written when they are produced: clients that received
+// output are queued and each of them is flushed with one send() at the
+// end of the loop iteration.
+//
+// A client that shuts down its sending side (EPOLLRDHUP, or the end of its
+// input) still gets the replies to everything it sent: its remaining input
+// is processed, and the connection is closed once no request is in flight
+// and the output was written. Only EPOLLHUP and EPOLLERR close a
+// connection right away.
+//
+// Clients are stored in a table indexed by their file descriptor, which is
+// also what is stored in epoll_event.data, so dispatching an event is an
+// array lookup. Client objects of closed connections are kept on a free
+// list and reused for the next accepted connection, so that in steady
+// state accepting a connection does not call the allocator.
+//
+// Listeners that exist for only part of the lifetime of the Reactor (see
+// Attachment) are served by a coroutine that co_awaits wait_readable on
+// the listener and passes accepted connections to add_client().
+//
+// Connections that stay idle for Application::idle_timeout_seconds() are
+// closed. The idle timeouts of all clients are kept in an IdleTimerWheel
+// that is advanced by a single timerfd per reactor, ticking once per second
+// and only armed while the wheel is non-empty. New connections beyond
+// Application::max_clients() (counted over all reactors) are answered
+// with an error and closed right away.
+//
+// When the service is supervised by systemd, every reactor also runs a
+// periodic timerfd that feeds the heartbeat of the ServiceNotifier, so
+// that the watchdog only keeps being pinged while all reactors are
+// responsive.
+//
+// A socket-activated daemon can exit when it has been idle for a while
+// (see Application::exit_on_idle_seconds()): every reactor reports to the
+// SocketServer when it has no clients and no running coroutines left, or
+// gets one again, and reactor 0 watches the timer that the SocketServer
+// arms when the last reactor became idle.
+//
+// On termination of a daemon that runs under systemd, the connections are
+// handed over to the next instance instead of closed: the reactor stops
+// accepting and dispatching, waits (at most handover_drain_timeout_c) until
+// no request is in flight and all replies were written, and then returns
+// from run(), after which SocketServer collects the connections together
+// with their unprocessed input.
+//
+// The Reactor is also the scheduler of the coroutines (DetachedTask and
+// Task<T>) that handle client requests: a coroutine can co_await
+// wait_readable(fd), wait_for_child(pid) and sleep_for(duration), and is
+// resumed from run() on the same thread when the event occurs. One
+// coroutine can wait for an fd to become readable while another waits for
+// it to become writable (wait_writable(fd)).
+class Reactor
+{
+ public:
+  using clock_type = std::chrono::steady_clock;
+
+  // ReadableAwaiter
+  //
+  // Suspends the awaiting coroutine until a file descriptor becomes readable (or hung up).
+  class ReadableAwaiter
+  {
+   private:
+    Reactor& reactor_;                  // The reactor that watches fd_.
+    int fd_;                            // The file descriptor to wait for.
+    bool registered_ = false;           // True while fd_ is registered with reactor_.
+
+   public:
+    ReadableAwaiter(Reactor& reactor, int fd) : reactor_(reactor), fd_(fd) { }
+    ReadableAwaiter(ReadableAwaiter const&) = delete;
+    ~ReadableAwaiter() { if (registered_) reactor_.unwatch_fd(fd_, false); }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { reactor_.watch_fd(fd_, false, handle); registered_ = true; }
+    void await_resume() noexcept { registered_ = false; }
+  };
+
+  // WritableAwaiter
+  //
+  // Suspends the awaiting coroutine until a file descriptor becomes writable (or hung up).
+  class WritableAwaiter
+  {
+   private:
+    Reactor& reactor_;                  // The reactor that watches fd_.
+    int fd_;                            // The file descriptor to wait for.
+    bool registered_ = false;           // True while fd_ is registered with reactor_.
+
+   public:
+    WritableAwaiter(Reactor& reactor, int fd) : reactor_(reactor), fd_(fd) { }
+    WritableAwaiter(WritableAwaiter const&) = delete;
+    ~WritableAwaiter() { if (registered_) reactor_.unwatch_fd(fd_, true); }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { reactor_.watch_fd(fd_, true, handle); registered_ = true; }
+    void await_resume() noexcept { registered_ = false; }
+  };
+
+  // ReadableAnyAwaiter
+  //
+  // Suspends the awaiting coroutine until one of two file descriptors becomes readable; returns that file descriptor.
+  class ReadableAnyAwaiter
+  {
+   private:
+    Reactor& reactor_;                  // The reactor that watches fds_.
+    int fds_[2];                        // The file descriptors to wait for.
+    bool registered_ = false;           // True while fds_ are registered with reactor_.
+
+    // Unregister the file descriptors that did not fire; return the one that did.
+    int unwatch();
+
+   public:
+    ReadableAnyAwaiter(Reactor& reactor, int fd1, int fd2) : reactor_(reactor), fds_{fd1, fd2} { }
+    ReadableAnyAwaiter(ReadableAnyAwaiter const&) = delete;
+    ~ReadableAnyAwaiter() { if (registered_) unwatch(); }
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    int await_resume() { registered_ = false; return unwatch(); }
+  };
+
+  // ChildStatus
+  //
+  // Result of waiting for a child process.
+  struct ChildStatus
+  {
+    int status_;                        // The waitpid status, valid if error_ is zero.
+    int error_;                         // errno of a failing waitpid, or zero.
+  };
+
+  // ChildAwaiter
+  //
+  // Suspends the awaiting coroutine until a child process terminated, then reaps it.
+  // Uses a pidfd in the epoll set; falls back to a blocking waitpid when pidfd_open is not supported.
+  class ChildAwaiter
+  {
+   private:
+    Reactor& reactor_;                  // The reactor that watches pidfd_.
+    pid_t pid_;                         // The child process.
+    ScopedFd pidfd_;                    // pidfd of pid_, if supported.
+    bool registered_ = false;           // True while pidfd_ is registered with reactor_.
+
+   public:
+    ChildAwaiter(Reactor& reactor, pid_t pid) : reactor_(reactor), pid_(pid) { }
+    ChildAwaiter(ChildAwaiter const&) = delete;
+    ~ChildAwaiter() { if (registered_) reactor_.unwatch_fd(pidfd_.get(), false); }
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> handle) { reactor_.watch_fd(pidfd_.get(), false, handle); registered_ = true; }
+    ChildStatus await_resume();
+  };
+
+  // SleepAwaiter
+  //
+  // Suspends the awaiting coroutine until a deadline.
+  class SleepAwaiter
+  {
+   private:
+    Reactor& reactor_;                  // The reactor that runs the timer.
+    clock_type::time_point deadline_;   // When to resume.
+    bool registered_ = false;           // True while the timer is pending.
+
+   public:
+    SleepAwaiter(Reactor& reactor, clock_type::time_point deadline) : reactor_(reactor), deadline_(deadline) { }
+    SleepAwaiter(SleepAwaiter const&) = delete;
+    ~SleepAwaiter() { if (registered_) reactor_.cancel_timer(this); }
+
+    bool await_ready() const noexcept { return deadline_ <= clock_type::now(); }
+    void await_suspend(std::coroutine_handle<> handle) { reactor_.add_timer(deadline_, handle, this); registered_ = true; }
+    void await_resume() noexcept { registered_ = false; }
+  };
+
+ private:
+  // A pending SleepAwaiter.
+  struct Timer
+  {
+    clock_type::time_point deadline_;   // When to resume handle_.
+    std::coroutine_handle<> handle_;    // The sleeping coroutine.
+    SleepAwaiter* awaiter_;             // The awaiter, used to cancel the timer.
+
+    // Order for a min-heap on deadline.
+    friend bool operator<(Timer const& lhs, Timer const& rhs) { return lhs.deadline_ > rhs.deadline_; }
+  };
+
+  // The coroutines that wait for one file descriptor.
+  struct FdWaiters
+  {
+    std::coroutine_handle<> readable_;  // Waits until the fd is readable (or hung up), or nullptr.
+    std::coroutine_handle<> writable_;  // Waits until the fd is writable (or hung up), or nullptr.
+  };
+
+  static constexpr int max_events_c = 32;                               // Maximum number of epoll events handled per epoll_wait.
+  static constexpr int max_accepts_per_wakeup_c = 16;                   // Leave remaining connections to other reactors.
+  static constexpr int message_budget_c = 8;                            // Maximum number of messages of one client dispatched per wakeup.
+  static constexpr std::size_t max_free_clients_c = 256;                // Maximum number of client objects kept for reuse.
+  static constexpr std::chrono::seconds idle_tick_c{1};                 // Resolution of the idle timeout.
+  static constexpr std::chrono::seconds handover_drain_timeout_c{5};    // Maximum time to wait for requests in flight before handing over the connections.
+  static constexpr int handover_poll_interval_ms_c = 100;               // epoll_wait timeout while waiting for handover_deadline_.
+
+  SocketServer& socket_server_;                                         // Owning socket server (listener and client factory).
+  int const index_;                                                     // Index of this reactor (0 runs on the mainloop thread).
+  int const max_in_flight_;                                             // Maximum number of requests in flight per client.
+  std::size_t const max_pending_output_;                                // Pending output bytes per client above which its input is paused.
+  uint64_t const idle_timeout_ticks_;                                   // Number of idle_tick_c after which an idle client is closed, or 0.
+  ScopedFd epoll_fd_;                                                   // epoll instance of this reactor.
+  std::vector<int> listener_fds_;                                       // Shared listeners, indexed like SocketServer::listeners(); empty in inetd mode.
+  int terminate_fd_ = -1;                                               // Read-end of the termination self-pipe.
+  std::vector<std::unique_ptr<SocketClient>> clients_;                  // Active clients of this reactor, indexed by file descriptor.
+  std::size_t number_of_clients_ = 0;                                   // Number of non-null entries in clients_.
+  std::vector<std::unique_ptr<SocketClient>> free_clients_;             // Client objects of closed connections, for reuse.
+  std::vector<std::unique_ptr<SocketClient>> detached_clients_;         // Disconnected clients that still have requests in flight.
+  std::vector<int> finished_request_fds_;                               // Clients whose request finished since the last loop iteration.
+  std::vector<int> ready_clients_;                                      // Round-robin queue of clients with buffered input left over.
+  std::vector<int> ready_clients_scratch_;                              // Reused storage for the round that is being serviced.
+  std::vector<int> flush_clients_;                                      // Clients that received output during this loop iteration.
+  std::vector<FdWaiters> fd_waiters_;                                   // Coroutines waiting on an fd, indexed by fd.
+  std::vector<Timer> timers_;                                           // Pending timers (min-heap on deadline).
+  DetachedTask::Registry tasks_;                                        // Root coroutines created by this reactor.
+  ScopedFd idle_timer_fd_;                                              // timerfd that advances idle_wheel_, if idle_timeout_ticks_ is non-zero.
+  bool idle_timer_armed_ = false;                                       // True while idle_timer_fd_ is ticking.
+  IdleTimerWheel idle_wheel_;                                           // Idle deadlines of the clients in clients_.
+  std::vector<SocketClient*> idle_expired_;                             // Reused storage for the clients whose idle deadline passed.
+  ScopedFd service_timer_fd_;                                           // Periodic timerfd that drives the ServiceNotifier, if that is enabled.
+  int exit_timer_fd_ = -1;                                              // SocketServer::exit_timer_fd() on reactor 0, otherwise -1.
+  bool const report_busy_;                                              // True if the daemon exits on idle and reactor_busy() must be called.
+  bool busy_ = false;                                                   // Last state passed to SocketServer::reactor_busy().
+  bool handing_over_ = false;                                           // True after termination was requested while connections are handed over.
+  clock_type::time_point handover_deadline_;                            // When to stop waiting for requests in flight, if handing_over_.
+
+ private:
+  // Add `fd` to epoll with given event mask.
+  void add_fd_to_epoll(int fd, uint32_t events);
+
+  // Change the event mask of `fd`.
+  void modify_fd_in_epoll(int fd, uint32_t events);
+
+  // Remove `fd` from epoll.
+  void remove_fd_from_epoll(int fd);
+
+  // Return the index of `fd` in listener_fds_, or -1 if it is not a listener.
+  int listener_index(int fd) const;
+
+  // Accept up to max_accepts_per_wakeup_c pending connections from listener_fds_[listener_index].
+  void accept_new_clients(int listener_index);
+
+  // Return the active client with file descriptor `fd`, or nullptr.
+  SocketClient* find_client(int fd) const { return static_cast<std::size_t>(fd) < clients_.size() ? clients_[fd].get() : nullptr; }
+
+  // Close a new connection because the client limit was reached.
+  void reject_client(int client_fd);
+
+  // Add `client` to idle_wheel_ to expire idle_timeout_ticks_ after its last activity, and arm the timer.
+  void schedule_idle_timeout(SocketClient& client);
+
+  // Handle expiration(s) of idle_timer_fd_: close clients that were idle for too long.
+  void handle_idle_timer();
+
+  // Handle expiration(s) of service_timer_fd_: report that this reactor is alive.
+  void handle_service_timer();
+
+  // Tell the SocketServer when this reactor gets its first, or lost its last, client or request.
+  void update_busy();
+
+  // Stop accepting connections and dispatching messages, and wait for the requests in flight (see SocketServer::hand_over).
+  void begin_handover();
+
+  // Return true if no request is in flight and all output was written, so that the connections can be handed over.
+  bool ready_for_handover() const;
+
+  // Disconnect client and erase it from the client table.
+  void remove_client(int client_fd);
+
+  // Put a client object that has no requests in flight on the free list (or destroy it).
+  void recycle_client(std::unique_ptr<SocketClient> client);
+
+  // Invoke readable handler for a client and remove it if connection is closed.
+  void handle_client_readable(int client_fd);
+
+  // Give every client in ready_clients_ one more message budget, in order.
+  void service_ready_clients();
+
+  // Only listen for input of `client` while it accepts input, and for writability while it has pending output.
+  void update_client_interest(SocketClient& client);
+
+  // Write pending output of a client and resume its input if that drained.
+  void handle_client_writable(int client_fd);
+
+  // Write the output that was produced during this loop iteration.
+  void flush_clients();
+
+  // Continue processing the buffered input of clients whose request finished, and free idle detached clients.
+  void process_finished_requests();
+
+  // Return the epoll events that `waiters` need.
+  static uint32_t watched_events(FdWaiters const& waiters);
+
+  // Add, change or remove the epoll registration of `fd` that had `old_events`, for the current fd_waiters_[fd].
+  void update_fd_watch(int fd, uint32_t old_events);
+
+  // Register `handle` to be resumed when `fd` becomes readable, or writable if `writable` is true.
+  void watch_fd(int fd, bool writable, std::coroutine_handle<> handle);
+
+  // Cancel a watch_fd.
+  void unwatch_fd(int fd, bool writable);
+
+  // Return true if a coroutine is waiting for `fd` to become readable.
+  bool watching_fd(int fd) const { return static_cast<std::size_t>(fd) < fd_waiters_.size() && fd_waiters_[fd].readable_; }
+
+  // Schedule `handle` to be resumed at `deadline`.
+  void add_timer(clock_type::time_point deadline, std::coroutine_handle<> handle, SleepAwaiter* awaiter);
+
+  // Cancel a pending timer.
+  void cancel_timer(SleepAwaiter* awaiter);
+
+  // Resume all coroutines whose timer expired.
+  void run_expired_timers();
+
+  // Return the epoll_wait timeout in milliseconds until the first timer expires, or -1.
+  int next_timeout() const;
+
+ public:
+  // Create the epoll instance and register `terminate_fd` and `listener_fds`.
+  Reactor(SocketServer& socket_server, int index, int terminate_fd, std::vector<int> listener_fds);
+
+  // Destroy all suspended coroutines and remaining clients of this reactor.
+  ~Reactor();
+
+  Reactor(Reactor const&) = delete;
+  Reactor& operator=(Reactor const&) = delete;
+
+  // Register a client fd, connected through the listener with index `listener_index`, with this reactor and return the new client.
+  // Closes client_fd instead, and returns nullptr, if Application::max_clients() clients are connected.
+  SocketClient* add_client(int client_fd, int listener_index);
+
+  // Add a connection that was handed over by a previous instance of the daemon.
+  void adopt_client(SocketClient::HandoverState state);
+
+  // Run the event loop until termination is requested or, without a listener, the last client went away.
+  // When SocketServer::hand_over_on_exit() the loop first waits until the connections can be handed over.
+  void run();
+
+  // Move the connections that can be handed over to `states` (after run() returned).
+  void release_clients_for_handover(std::vector<SocketClient::HandoverState>& states);
+
+  // Close the connections of the clients for which `predicate` returns true.
+  template<typename Predicate>
+  void close_clients_if(Predicate predicate)
+  {
+    for (std::unique_ptr<SocketClient> const& client : clients_)
+      if (client && predicate(*client))
+        remove_client(client->fd());
+  }
+
+  // Called by SocketClient::end_request.
+  void request_finished(SocketClient& client);
+
+  // Called by SocketClient when it appended output.
+  void flush_at_end_of_iteration(SocketClient& client);
+
+  // Awaitables.
+  ReadableAwaiter wait_readable(int fd) { return {*this, fd}; }
+  ReadableAnyAwaiter wait_readable(int fd1, int fd2) { return {*this, fd1, fd2}; }
+  WritableAwaiter wait_writable(int fd) { return {*this, fd}; }
+  ChildAwaiter wait_for_child(pid_t pid) { return {*this, pid}; }
+  SleepAwaiter sleep_for(clock_type::duration duration) { return {*this, clock_type::now() + duration}; }
+
+  // Accessors.
+  SocketServer& socket_server() const { return socket_server_; }
+  int index() const { return index_; }
+  int max_in_flight() const { return max_in_flight_; }
+  std::size_t max_pending_output() const { return max_pending_output_; }
+};
+
+} // namespace remountd
@@ -27,24 +27,22 @@ namespace remountd {
 namespace {
 
 constexpr std::size_t k_max_reply_length = 4096;
+constexpr int k_exit_rate_limited = 75;         // EX_TEMPFAIL: the request may succeed when retried later (rate limited or busy).
+constexpr int k_exit_no_mount_point = 66;       // EX_NOINPUT: the requested path does not exist or is not a mount point.
 
 ScopedFd connect_unix_socket(std::filesystem::path const& socket_fs_path)
 {
   std::string const socket_native_path = socket_fs_path.string();
-  if (socket_native_path.size() >= sizeof(sockaddr_un::sun_path))
-    throw_error(errc::socket_path_too_long, "socket path is too long for AF_UNIX: '" + socket_native_path + "'");
+  sockaddr_un addr;
+  socklen_t const addr_length = make_unix_socket_address(socket_native_path, addr);
 
   ScopedFd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
   if (!fd.valid())
     throw std::system_error(errno, std::generic_category(), "socket(AF_UNIX) failed");
 
-  sockaddr_un addr{};
-  addr.sun_family = AF_UNIX;
-  std::copy(socket_native_path.begin(), socket_native_path.end(), addr.sun_path);
-  addr.sun_path[socket_native_path.size()] = '\0';
-
-  if (connect(fd.get(), reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0)
-    if (errno == ENOENT)
+  // Nobody listening on a name in the abstract namespace is reported as ECONNREFUSED.
+  if (connect(fd.get(), reinterpret_cast<sockaddr const*>(&addr), addr_length) != 0)
+    if (errno == ENOENT || (errno == ECONNREFUSED && is_abstract_socket_path(socket_native_path)))
       throw_error(errc::no_such_socket, "Failed to connect to '" + socket_native_path + "'. Is the remountd running?");
     else
       throw std::system_error(errno, std::generic_category(), "connect('" + socket_native_path + "') failed");
@@ -52,37 +50,37 @@ ScopedFd connect_unix_socket(std::filesystem::path const& socket_fs_path)
   return fd;
 }
 
-std::string receive_reply_line(int fd)
+// Read one reply line from `fd`. Bytes that were read beyond that line are kept in `unread` for the next call.
+std::string receive_reply_line(int fd, std::string* unread)
 {
   std::string reply;
-  bool saw_carriage_return = false;
   char buffer[512];
   for (;;)
   {
-    ssize_t const read_ret = read(fd, buffer, sizeof(buffer));
+    ssize_t read_ret;
+    if (!unread->empty())
+    {
+      read_ret = static_cast<ssize_t>(std::min(unread->size(), sizeof(buffer)));
+      std::copy_n(unread->begin(), read_ret, buffer);
+      unread->erase(0, read_ret);
+    }
+    else
+      read_ret = read(fd, buffer, sizeof(buffer));
     if (read_ret > 0)
     {
       for (ssize_t i = 0; i < read_ret; ++i)
       {
         char const byte = buffer[i];
-        // Skip a \n if that immediately follows a \r.
-        if (saw_carriage_return && byte == '\n')
-        {
-          saw_carriage_return = false;
-          continue;
-        }
-        saw_carriage_return = byte == '\r';
-
-        if (byte == '\r')
+        if (byte == '\r' || byte == '\n')
         {
+          // Skip a \n if that immediately follows a \r.
+          std::size_t const skip = byte == '\r' && i + 1 < read_ret && buffer[i + 1] == '\n' ? 2 : 1;
+          unread->insert(unread->begin(), buffer + i + skip, buffer + read_ret);
           reply.push_back('\n');
           return reply;
         }
 
         reply.push_back(byte);
-        if (byte == '\n')
-          return reply;
-
         if (reply.size() >= k_max_reply_length)
           throw std::system_error(EMSGSIZE, std::generic_category(), "reply line too long");
       }
@@ -120,7 +118,7 @@ bool RemountCtl::parse_command_line_parameter(std::string_view arg, int /*argc*/
 
 void RemountCtl::print_usage_extra(std::ostream& os) const
 {
-  os << " rw|ro <name> <path>";
+  os << " rw|ro <name> <path> | list-mounts <name>";
 }
 
 void RemountCtl::mainloop()
@@ -129,17 +127,18 @@ void RemountCtl::mainloop()
 
   exit_code_ = 0;
 
-  if (positional_args_.size() != 3)
+  bool const list_mounts = !positional_args_.empty() && positional_args_[0] == "list-mounts";
+  if (!list_mounts && !positional_args_.empty() && positional_args_[0] != "ro" && positional_args_[0] != "rw")
   {
-    std::cerr << "remountctl: invalid number of arguments.\n";
+    std::cerr << "remountctl: unknown command '" << positional_args_[0] << "'.\n";
     print_usage();
     exit_code_ = 1;
     return;
   }
 
-  if (positional_args_[0] != "ro" && positional_args_[0] != "rw")
+  if (positional_args_.size() != (list_mounts ? 2 : 3))
   {
-    std::cerr << "remountctl: unknown command '" << positional_args_[0] << "'.\n";
+    std::cerr << "remountctl: invalid number of arguments.\n";
     print_usage();
     exit_code_ = 1;
     return;
@@ -160,12 +159,26 @@ void RemountCtl::mainloop()
   ScopedFd fd = connect_unix_socket(socket_path());
   send_text_to_socket(fd.get(), message);
 
-  std::string const reply = receive_reply_line(fd.get());
+  std::string unread;
+  std::string reply = receive_reply_line(fd.get(), &unread);
+  // The reply to list-mounts is a line per mount, followed by OK.
+  while (list_mounts && (reply.starts_with("ro ") || reply.starts_with("rw ")))
+  {
+    std::cout << reply;
+    reply = receive_reply_line(fd.get(), &unread);
+  }
   if (reply == "OK\n")
     return;
 
   std::cerr << "remountd: " << reply;
-  exit_code_ = 1;
+  if (reply.starts_with("ERROR: " + make_error_code(errc::rate_limited).message()) ||
+      reply.starts_with("ERROR: " + make_error_code(errc::mount_busy).message()))
+    exit_code_ = k_exit_rate_limited;
+  else if (reply.starts_with("ERROR: " + make_error_code(errc::no_such_path).message()) ||
+      reply.starts_with("ERROR: " + make_error_code(errc::not_a_mount_point).message()))
+    exit_code_ = k_exit_no_mount_point;
+  else
+    exit_code_ = 1;
 }
 
 //virtual
@@ -1,19 +1,35 @@
 #include "sys.h"
 #include "Remountd.h"
+#include "Attachment.h"
+#include "AttachmentRegistry.h"
+#include "AuthorizationPolicy.h"
+#include "PrivilegedExecutor.h"
+#include "RateLimiter.h"
+#include "Reactor.h"
 #include "SocketServer.h"
+#include "RequestArena.h"
+#include "RequestStatistics.h"
 #include "ScopedFd.h"
+#include "StatePage.h"
+#include "Task.h"
+#include "remountd_error.h"
 #include "utils.h"
 
-#include <sys/wait.h>
+#include <grp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <syslog.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <charconv>
 #include <cerrno>
 #include <cstring>
 #include <filesystem>
 #include <limits>
 #include <memory>
-#include <optional>
+#include <memory_resource>
+#include <span>
 #include <string>
 #include <string_view>
 #include <system_error>
@@ -22,6 +38,10 @@
 namespace remountd {
 namespace {
 
+// Name of the saved rate limits in the systemd FD store.
+constexpr std::string_view rate_limiter_state_name_c = "state.rate-limiter";
+static_assert(rate_limiter_state_name_c.starts_with(SocketServer::stored_fd_prefix_c));
+
 // Parse pid from token and validate range.
 bool parse_pid_token(std::string_view pid_token, pid_t* pid)
 {
@@ -51,158 +71,434 @@ bool is_running_process(pid_t pid)
   return errno == EPERM;
 }
 
-// Return true when `path` starts with `prefix` on path-component boundaries.
-bool path_has_prefix(std::filesystem::path const& path, std::filesystem::path const& prefix)
+// Append `path` to `out`, escaping space, tab, newline and backslash as octal like /proc/<pid>/mountinfo does.
+void append_escaped_path(std::pmr::string* out, std::string_view path)
 {
-  auto path_iter = path.begin();
-  auto const path_end = path.end();
-  for (auto prefix_iter = prefix.begin(); prefix_iter != prefix.end(); ++prefix_iter, ++path_iter)
+  for (char const c : path)
   {
-    if (path_iter == path_end || *path_iter != *prefix_iter)
-      return false;
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\\')
+    {
+      out->push_back('\\');
+      out->push_back(static_cast<char>('0' + ((c >> 6) & 7)));
+      out->push_back(static_cast<char>('0' + ((c >> 3) & 7)));
+      out->push_back(static_cast<char>('0' + (c & 7)));
+    }
+    else
+      out->push_back(c);
   }
-
-  return true;
 }
 
-// Resolve the configured prefix and requested absolute path to one allowed path.
-std::optional<std::filesystem::path> resolve_allowed_path(std::string_view name, std::string_view requested_path, std::string* error_reply)
+// Append the lexically normalized form of absolute path `path` to `out` (which must be empty).
+// Like std::filesystem::path::lexically_normal, but without trailing slash and using the allocator of `out`.
+void append_lexically_normal(std::pmr::string* out, std::string_view path)
 {
-  std::optional<std::filesystem::path> const configured_path = find_allowed_path(name);
-  if (!configured_path.has_value())
+  std::size_t position = 0;
+  while (position < path.size())
   {
-    *error_reply = format_unknown_identifier_error(name);
-    return std::nullopt;
+    std::size_t end = path.find('/', position);
+    if (end == std::string_view::npos)
+      end = path.size();
+    std::string_view const component = path.substr(position, end - position);
+    position = end + 1;
+
+    if (component.empty() || component == ".")
+      continue;
+
+    if (component == "..")
+    {
+      // The parent of the root is the root.
+      out->resize(out->rfind('/') == std::string::npos ? 0 : out->rfind('/'));
+      continue;
+    }
+
+    out->push_back('/');
+    out->append(component);
   }
 
+  if (out->empty())
+    out->push_back('/');
+}
+
+// Resolve the configured prefix of `allowed_mount_point` and requested absolute path to one allowed path.
+// On failure an empty string is returned and `error_reply` is set. Both strings use `arena`.
+std::pmr::string resolve_allowed_path(RequestArena& arena, Application::AllowedMountPoint const& allowed_mount_point,
+    std::string_view requested_path, std::pmr::string* error_reply)
+{
+  std::pmr::string resolved_path(arena.resource());
+
   if (requested_path.empty() || requested_path.front() != '/')
   {
     *error_reply = "ERROR: path must start with '/'.\n";
-    return std::nullopt;
+    return resolved_path;
   }
 
-  std::filesystem::path const configured_prefix = configured_path->lexically_normal();
-  if (!configured_prefix.is_absolute())
+  std::string_view const configured_native = allowed_mount_point.path_.native();
+  if (configured_native.empty() || configured_native.front() != '/')
   {
-    *error_reply = "ERROR: configured path for '" + std::string(name) + "' is not absolute.\n";
-    return std::nullopt;
+    error_reply->append("ERROR: configured path for '").append(allowed_mount_point.name_).append("' is not absolute.\n");
+    return resolved_path;
   }
 
-  std::filesystem::path const requested_suffix{std::string(requested_path)};
-  std::filesystem::path const resolved_path = (configured_prefix / requested_suffix.relative_path()).lexically_normal();
+  std::pmr::string configured_prefix(arena.resource());
+  configured_prefix.reserve(configured_native.size() + 1);
+  append_lexically_normal(&configured_prefix, configured_native);
+
+  std::pmr::string joined_path(arena.resource());
+  joined_path.reserve(configured_prefix.size() + requested_path.size() + 1);
+  joined_path.append(configured_prefix).append(requested_path);
+  resolved_path.reserve(joined_path.size() + 1);
+  append_lexically_normal(&resolved_path, joined_path);
 
   if (!path_has_prefix(resolved_path, configured_prefix))
   {
     *error_reply = "ERROR: requested path escapes allowed prefix.\n";
-    return std::nullopt;
+    resolved_path.clear();
   }
 
   return resolved_path;
 }
 
-// Execute remount command in mount namespace of pid.
-// Returns empty string on success, otherwise a description.
-std::string execute_remount_command(pid_t pid, bool read_only, std::filesystem::path const& path)
+// Remountd:Client
+//
+// Concrete client used by remountd. Remount requests are handled by a
+// coroutine, so that the reactor is not blocked while the remount runs.
+// The sockets of the `attach` command are served by a coroutine too.
+// All transient strings of a request live in a RequestArena that is
+// released right after the reply was handed to SocketClient.
+class RemountdClient final : public SocketClient
 {
-  int stderr_pipe_fds[2];
-  if (pipe(stderr_pipe_fds) != 0)
-    return "pipe failed: " + std::string(std::strerror(errno));
-
-  ScopedFd read_end(stderr_pipe_fds[0]);
-  ScopedFd write_end(stderr_pipe_fds[1]);
-
-  std::string const pid_string = std::to_string(pid);
-  std::string const options = read_only ? "remount,ro,bind" : "remount,rw,bind";
-  std::string const path_string = path.string();
-  char const* args[] = {
-      "nsenter",
-      "-t",
-      pid_string.c_str(),
-      "-m",
-      "--",
-      "mount",
-      "-o",
-      options.c_str(),
-      path_string.c_str(),
-      nullptr
-  };
-
-  pid_t const child_pid = fork();
-  if (child_pid < 0)
-    return "fork failed: " + std::string(std::strerror(errno));
-
-  if (child_pid == 0)
+ private:
+  Remountd const& remountd_;                            // The application.
+  RateLimiter& rate_limiter_;                           // The rate limits shared by all clients.
+  AuthorizationPolicy const& authorization_policy_;     // The users and groups that may use each allow-entry.
+  ucred peer_credentials_;                              // Credentials of the peer, valid if have_peer_credentials_ is true.
+  std::vector<gid_t> peer_groups_;                      // Scratch buffer for the supplementary groups of the peer.
+  AuthorizationPolicy::Subject subject_;                // The peer as seen by authorization_policy_, valid if have_peer_credentials_ is true.
+  bool have_peer_credentials_ = false;                  // True once peer_credentials_ and subject_ were determined.
+  bool peer_admitted_ = false;                          // True if the peer may use an abstract socket, valid if have_peer_credentials_ is true.
+  std::shared_ptr<Attachment> attachment_;              // The attachment whose socket this client connected to, if any.
+
+ private:
+  // Read the supplementary groups of the peer into peer_groups_. Returns false with errno set on failure.
+  bool read_peer_groups()
   {
-    read_end.reset();
-    if (dup2(write_end.get(), STDERR_FILENO) < 0)
-      _exit(127);
-    write_end.reset();
-
-    execvp(args[0], const_cast<char* const*>(args));
-    int const exec_errno = errno;
-    dprintf(STDERR_FILENO, "execvp(nsenter) failed: %s", std::strerror(exec_errno));
-    _exit(127);
+    if (peer_groups_.empty())
+      peer_groups_.resize(64);
+    for (;;)
+    {
+      socklen_t length = static_cast<socklen_t>(peer_groups_.size() * sizeof(gid_t));
+      if (getsockopt(fd(), SOL_SOCKET, SO_PEERGROUPS, peer_groups_.data(), &length) == 0)
+      {
+        peer_groups_.resize(length / sizeof(gid_t));
+        return true;
+      }
+      // On ERANGE the kernel returns the required length.
+      if (errno != ERANGE || length <= peer_groups_.size() * sizeof(gid_t))
+        return false;
+      peer_groups_.resize(length / sizeof(gid_t));
+    }
   }
 
-  write_end.reset();
+  // Return the credentials of the peer process (determined once per connection), or nullptr with errno set.
+  ucred const* peer_credentials()
+  {
+    if (!have_peer_credentials_)
+    {
+      socklen_t length = sizeof(peer_credentials_);
+      if (getsockopt(fd(), SOL_SOCKET, SO_PEERCRED, &peer_credentials_, &length) != 0)
+        return nullptr;
+      peer_groups_.clear();
+      if (!attachment_)
+      {
+        bool const is_abstract = remountd_.abstract_listener(listener_index());
+        if ((authorization_policy_.uses_groups() || is_abstract) && !read_peer_groups())
+          return nullptr;
+        authorization_policy_.compile_subject(subject_, listener_index(), peer_credentials_.uid, peer_credentials_.gid, peer_groups_);
+        peer_admitted_ = !is_abstract || peer_credentials_.uid == 0 || in_socket_group();
+      }
+      have_peer_credentials_ = true;
+    }
+    return &peer_credentials_;
+  }
 
-  std::string stderr_text;
-  char buffer[512];
-  for (;;)
+  // Return true if the peer is a member of group "remountd"; peer_credentials_ and peer_groups_ must be valid.
+  bool in_socket_group() const
   {
-    ssize_t const read_ret = read(read_end.get(), buffer, sizeof(buffer));
-    if (read_ret > 0)
+    std::optional<gid_t> const socket_group = remountd_.socket_group();
+    if (!socket_group)
+      return false;
+    return peer_credentials_.gid == *socket_group || std::find(peer_groups_.begin(), peer_groups_.end(), *socket_group) != peer_groups_.end();
+  }
+
+  // Accept the connections to the socket of `attachment`, which is in `registry`, until the process that it is bound to exits;
+  // then close them.
+  static DetachedTask serve_attachment(Reactor& reactor, AttachmentRegistry& registry, std::shared_ptr<Attachment> attachment)
+  {
+    syslog(LOG_INFO, "Attached %s to pid %d.", attachment->socket_path().c_str(), attachment->pid());
+    while (co_await reactor.wait_readable(attachment->listener_fd(), attachment->pidfd()) == attachment->listener_fd())
     {
-      stderr_text.append(buffer, static_cast<std::size_t>(read_ret));
-      continue;
+      int client_fd;
+      while ((client_fd = accept4(attachment->listener_fd(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+      {
+        // The listener index of attached clients is not used.
+        if (SocketClient* const client = reactor.add_client(client_fd, -1))
+          static_cast<RemountdClient*>(client)->attachment_ = attachment;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+      {
+        syslog(LOG_ERR, "accept4 failed on %s: %m", attachment->socket_path().c_str());
+        break;
+      }
     }
+    syslog(LOG_INFO, "Detached %s from pid %d.", attachment->socket_path().c_str(), attachment->pid());
+    attachment->close_listener();
+    registry.remove(*attachment);
+    reactor.close_clients_if([&attachment](SocketClient const& client){
+      return static_cast<RemountdClient const&>(client).attachment_ == attachment;
+    });
+  }
 
-    if (read_ret == 0)
-      break;
+  // Perform the privileged `attach <pid> <name>...` request `request_id` and send the reply.
+  //
+  // The arguments are only valid until the first suspension point.
+  DetachedTask attach(uint64_t request_id, std::span<std::string_view const> arguments)
+  {
+    RequestArena arena;
+    std::pmr::string reply(arena.resource());
 
-    if (errno == EINTR)
-      continue;
+    ucred const* const peer = peer_credentials();
+    pid_t pid = 0;
+    if (!peer)
+      reply.append("ERROR: unable to determine peer credentials.\n");
+    else if (attachment_ || peer->uid != 0)
+      reply.append("ERROR: ").append(make_error_code(errc::not_authorized).message()).append(" to attach.\n");
+    else if (arguments.size() < 2 || !parse_pid_token(arguments[0], &pid))
+      reply.append("ERROR: invalid command format.\n");
+    else if (remountd_.inetd_mode())
+      reply.append("ERROR: attach is not supported in inetd mode.\n");
+    if (!reply.empty())
+    {
+      end_request(request_id, reply);
+      co_return;
+    }
+
+    std::shared_ptr<Attachment> attachment;
+    try
+    {
+      attachment = std::make_shared<Attachment>(pid, std::vector<std::string_view>(arguments.begin() + 1, arguments.end()));
+    }
+    catch (std::system_error const& error)
+    {
+      reply.append("ERROR: ").append(error.what()).append(".\n");
+      end_request(request_id, reply);
+      co_return;
+    }
 
-    break;
+    // Let the executor pin the namespace of the sandbox; if pid is still alive afterwards, that is the right one.
+    PrivilegedExecutor::Channel::Reply const result = co_await remountd_.executor().channel(reactor().index()).attach(reactor(), pid, attachment->id());
+    if (result->failed_)
+      reply.append("ERROR: ").append(result->text_).append("\n");
+    else if (attachment->exited())
+      reply.append("ERROR: ").append(make_error_code(errc::attachment_exited).message()).append(".\n");
+    else
+    {
+      reply.append("OK ").append(attachment->socket_path().native()).append("\n");
+      remountd_.attachments().add(attachment);
+      serve_attachment(reactor(), remountd_.attachments(), std::move(attachment));
+    }
+    end_request(request_id, reply);
   }
 
-  int status = 0;
-  while (waitpid(child_pid, &status, 0) < 0)
+  // Return the allow-entry `name` if the peer may use it now, or nullptr with the error reply appended to `reply`.
+  Application::AllowedMountPoint const* admit(std::string_view name, std::pmr::string* reply)
   {
-    if (errno == EINTR)
-      continue;
+    // Names that are not served on the socket that the client connected to do not exist for it.
+    Application::AllowedMountPoint const* const allowed_mount_point = find_allowed_mount_point(name);
+    std::size_t const allow_index = allowed_mount_point ? allowed_mount_point - Application::instance().allowed_mount_points().data() : 0;
+    if (!allowed_mount_point || !(attachment_ ? attachment_->serves(allow_index) : authorization_policy_.served(listener_index(), allow_index)))
+    {
+      reply->append(format_unknown_identifier_error(name, reply->get_allocator().resource()));
+      return nullptr;
+    }
+
+    ucred const* const peer = peer_credentials();
+    if (!peer)
+    {
+      reply->append("ERROR: unable to determine peer credentials: ").append(std::strerror(errno)).append("\n");
+      return nullptr;
+    }
+
+    // The socket of an attachment is its own authorization domain.
+    if (!attachment_ && !authorization_policy_.authorized(subject_, allow_index))
+    {
+      reply->append("ERROR: ").append(make_error_code(errc::not_authorized).message()).append(" to use '").append(name).append("'.\n");
+      return nullptr;
+    }
 
-    return "waitpid failed: " + std::string(std::strerror(errno));
+    // Reject floods immediately, before doing any work for them.
+    if (!rate_limiter_.try_acquire(peer->uid, allow_index))
+    {
+      reply->append("ERROR: ").append(make_error_code(errc::rate_limited).message()).append(".\n");
+      return nullptr;
+    }
+
+    return allowed_mount_point;
   }
 
-  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
-    return {};
+  // Determine the process, or the attachment, in whose mount namespace to execute a request from `pid_token`.
+  // Returns false with the error reply appended to `reply` on failure.
+  bool target_pid(std::string_view pid_token, pid_t* pid, uint64_t* attachment, std::pmr::string* reply) const
+  {
+    // Requests on the socket of an attachment are executed in the namespace that the executor pinned for the sandbox,
+    // as long as the attached process lives.
+    if (attachment_)
+    {
+      if (attachment_->exited())
+      {
+        reply->append("ERROR: ").append(make_error_code(errc::attachment_exited).message()).append(".\n");
+        return false;
+      }
+      *pid = attachment_->pid();
+      *attachment = attachment_->id();
+      return true;
+    }
+    *attachment = 0;
+    if (!parse_pid_token(pid_token, pid) || !is_running_process(*pid))
+    {
+      reply->append("ERROR: ").append(pid_token).append(" is not a running process.\n");
+      return false;
+    }
+    return true;
+  }
 
-  trim_right(&stderr_text);
-  if (!stderr_text.empty())
-    return stderr_text;
+  // Perform remount request `request_id` and send the reply.
+  //
+  // The string_view arguments point into the message that is being dispatched;
+  // they are only valid until the first suspension point.
+  DetachedTask remount(uint64_t request_id, bool read_only, std::string_view name, std::string_view requested_path, std::string_view pid_token)
+  {
+    RequestStatistics::Request const statistics_request(remountd_.request_statistics());
+    RequestArena arena;
+    std::pmr::string reply(arena.resource());
 
-  if (WIFEXITED(status))
-    return "nsenter/mount failed with exit status " + std::to_string(WEXITSTATUS(status));
-  if (WIFSIGNALED(status))
-    return "nsenter/mount terminated by signal " + std::to_string(WTERMSIG(status));
+    Application::AllowedMountPoint const* const allowed_mount_point = admit(name, &reply);
+    if (!allowed_mount_point)
+    {
+      end_request(request_id, reply);
+      co_return;
+    }
 
-  return "nsenter/mount failed";
-}
+    std::pmr::string const path = resolve_allowed_path(arena, *allowed_mount_point, requested_path, &reply);
+    if (path.empty())
+    {
+      end_request(request_id, reply);
+      co_return;
+    }
+
+    pid_t pid;
+    uint64_t attachment;
+    if (!target_pid(pid_token, &pid, &attachment, &reply))
+    {
+      end_request(request_id, reply);
+      co_return;
+    }
+
+    // The remount itself is done by the privileged executor.
+    PrivilegedExecutor::Channel::Reply const result =
+        co_await remountd_.executor().channel(reactor().index()).execute(reactor(), pid, attachment, read_only, path);
+
+    if (result->failed_)
+      reply.append("ERROR: ").append(result->text_).append("\n");
+    else
+    {
+      reply.append("OK\n");
+      // Note that `name` is no longer valid here.
+      if (StatePage* const state_page = remountd_.state_page())
+        state_page->publish(allowed_mount_point->name_, result->mount_namespace_, path, read_only);
+    }
+    end_request(request_id, reply);
+  }
+
+  // Perform list-mounts request `request_id`: reply with a line "ro|rw <path>" for every mount at or below
+  // the prefix of allow-entry `name`, with <path> relative to that prefix, followed by "OK".
+  //
+  // The string_view arguments are only valid until the first suspension point.
+  DetachedTask list_mounts(uint64_t request_id, std::string_view name, std::string_view pid_token)
+  {
+    RequestStatistics::Request const statistics_request(remountd_.request_statistics());
+    RequestArena arena;
+    std::pmr::string reply(arena.resource());
+
+    Application::AllowedMountPoint const* const allowed_mount_point = admit(name, &reply);
+    if (!allowed_mount_point)
+    {
+      end_request(request_id, reply);
+      co_return;
+    }
+
+    std::pmr::string const prefix = resolve_allowed_path(arena, *allowed_mount_point, "/", &reply);
+    pid_t pid;
+    uint64_t attachment;
+    if (prefix.empty() || !target_pid(pid_token, &pid, &attachment, &reply))
+    {
+      end_request(request_id, reply);
+      co_return;
+    }
+
+    std::vector<PrivilegedExecutor::MountState> mounts;
+    PrivilegedExecutor::Channel::Reply const result =
+        co_await remountd_.executor().channel(reactor().index()).list_mounts(reactor(), pid, attachment, prefix, mounts);
+
+    if (result->failed_)
+      reply.append("ERROR: ").append(result->text_).append("\n");
+    else
+    {
+      std::size_t const prefix_length = prefix == "/" ? 0 : prefix.size();
+      for (PrivilegedExecutor::MountState const& mount : mounts)
+      {
+        std::string_view const relative_path = std::string_view(mount.mount_point_).substr(std::min(prefix_length, mount.mount_point_.size()));
+        reply.append(mount.read_only_ ? "ro " : "rw ");
+        append_escaped_path(&reply, relative_path.empty() ? "/" : relative_path);
+        reply.push_back('\n');
+      }
+      reply.append("OK\n");
+    }
+    end_request(request_id, reply);
+  }
 
-// Remountd:Client
-//
-// Concrete client used by remountd. Protocol handling will be added later.
-class RemountdClient final : public SocketClient
-{
  public:
+  // Serve `attachment`, which the previous instance handed over, once the executor pinned its namespace again.
+  static DetachedTask adopt_attachment(Reactor& reactor, Remountd const& remountd, std::shared_ptr<Attachment> attachment)
+  {
+    PrivilegedExecutor::Channel::Reply const result =
+        co_await remountd.executor().channel(reactor.index()).attach(reactor, attachment->pid(), attachment->id());
+    // If the process exited during the restart, its pid might belong to another process by now; the pidfd tells.
+    if (result->failed_ || attachment->exited())
+    {
+      syslog(LOG_INFO, "Not continuing %s: %s.", attachment->socket_path().c_str(),
+          result->failed_ ? result->text_ : make_error_code(errc::attachment_exited).message().c_str());
+      // Destroying the attachment removes its socket.
+      co_return;
+    }
+    remountd.attachments().add(attachment);
+    serve_attachment(reactor, remountd.attachments(), std::move(attachment));
+  }
+
   // Construct a remountd client wrapper around a connected socket.
-  RemountdClient(SocketServer& socket_server, int fd) : SocketClient(socket_server, fd)
+  RemountdClient(Reactor& reactor, int fd, Remountd const& remountd) :
+    SocketClient(reactor, fd), remountd_(remountd), rate_limiter_(remountd.rate_limiter()), authorization_policy_(remountd.authorization_policy())
   {
     DoutEntering(dc::notice, "RemountdClient::RemountdClient(" << fd << ")");
   }
 
  protected:
+  // Forget the credentials of the previous connection.
+  void reset_client_state() override
+  {
+    have_peer_credentials_ = false;
+    attachment_.reset();
+  }
+
   // Handle one complete newline-terminated message.
   bool new_message(std::string_view message) override
   {
@@ -211,53 +507,59 @@ class RemountdClient final : public SocketClient
     if (message == "quit")
       return false;
 
+    // The file permissions of a socket path restrict who may connect; a socket in the abstract namespace
+    // does not have those, so root and group "remountd" are admitted based on the credentials of the peer.
+    if (remountd_.abstract_listener(listener_index()))
+    {
+      ucred const* const peer = peer_credentials();
+      if (!peer || !peer_admitted_)
+      {
+        send_reply("ERROR: " + make_error_code(errc::not_authorized).message() + " to use this socket.\n");
+        return false;
+      }
+    }
+
     if (message == "list")
     {
-      std::string const reply = Application::instance().format_allowed_mount_points(false);
-      send_text_to_socket(fd(), reply);
+      send_reply(attachment_ ? attachment_->list_reply() : remountd_.list_reply(listener_index()));
       return true;
     }
 
-    std::vector<std::string_view> const tokens = split_tokens(message);
+    RequestArena arena;
+    std::pmr::vector<std::string_view> const tokens = split_tokens(message, arena.resource());
     if (tokens.empty())
       return false;
 
-    bool const is_ro = tokens[0] == "ro";
-    bool const is_rw = tokens[0] == "rw";
-
-    if (!is_ro && !is_rw)
-      return false;
-
-    if (tokens.size() != 4)
+    if (tokens[0] == "attach")
     {
-      send_text_to_socket(fd(), "ERROR: invalid command format.\n");
+      attach(begin_request(), std::span<std::string_view const>(tokens).subspan(1));
       return true;
     }
 
-    std::string_view const name = tokens[1];
-    std::string error_reply;
-    std::optional<std::filesystem::path> const path = resolve_allowed_path(name, tokens[2], &error_reply);
-    if (!path.has_value())
+    if (tokens[0] == "list-mounts")
     {
-      send_text_to_socket(fd(), error_reply);
+      // On the socket of an attachment the pid is optional (and ignored).
+      if (tokens.size() != 3 && !(attachment_ && tokens.size() == 2))
+        send_reply("ERROR: invalid command format.\n");
+      else
+        list_mounts(begin_request(), tokens[1], tokens.size() == 3 ? tokens[2] : std::string_view{});
       return true;
     }
 
-    pid_t pid = 0;
-    if (!parse_pid_token(tokens[3], &pid) || !is_running_process(pid))
-    {
-      send_text_to_socket(fd(), "ERROR: " + std::string(tokens[3]) + " is not a running process.\n");
-      return true;
-    }
+    bool const is_ro = tokens[0] == "ro";
+    bool const is_rw = tokens[0] == "rw";
+
+    if (!is_ro && !is_rw)
+      return false;
 
-    std::string const error_description = execute_remount_command(pid, is_ro, *path);
-    if (!error_description.empty())
+    // On the socket of an attachment the pid is optional (and ignored).
+    if (tokens.size() != 4 && !(attachment_ && tokens.size() == 3))
     {
-      send_text_to_socket(fd(), "ERROR: " + error_description + "\n");
+      send_reply("ERROR: invalid command format.\n");
       return true;
     }
 
-    send_text_to_socket(fd(), "OK\n");
+    remount(begin_request(), is_ro, tokens[1], tokens[2], tokens.size() == 4 ? tokens[3] : std::string_view{});
     return true;
   }
 };
@@ -269,10 +571,71 @@ Remountd::Remountd(int argc, char* argv[])
   Application::initialize(argc, argv);
   // The Application base class must be initialized before we can create the SocketServer.
   socket_server_ = std::make_unique<SocketServer>(inetd_mode_);
+  // Everything after this runs without capabilities; remounts are done by the executor (one channel per reactor).
+  executor_ = std::make_unique<PrivilegedExecutor>(inetd_mode_ ? 1 : static_cast<int>(reactor_threads()));
+
+  std::vector<std::string> listener_names;
+  for (SocketServer::Listener const& listener : socket_server_->listeners())
+  {
+    listener_names.push_back(listener.name_);
+    abstract_listeners_.push_back(listener.abstract_);
+  }
+  // The same group that the standalone socket file is given.
+  if (group const* const grp = getgrnam("remountd"))
+    socket_group_ = grp->gr_gid;
+  authorization_policy_ = std::make_unique<AuthorizationPolicy>(listener_names);
+  rate_limiter_ = std::make_unique<RateLimiter>();
+  request_statistics_ = std::make_unique<RequestStatistics>();
+
+  // Every process of inetd mode serves one connection; publishing the state is left to a daemon.
+  if (!inetd_mode_ && !state_file().empty())
+  {
+    try
+    {
+      state_page_ = std::make_unique<StatePage>(state_file());
+    }
+    catch (std::system_error const& error)
+    {
+      syslog(LOG_WARNING, "Not publishing the mount state: %s", error.what());
+    }
+  }
+
+  // Continue serving the attachments of the instance that was restarted; the first reactor serves them (see below).
+  attachments_ = std::make_unique<AttachmentRegistry>();
+  attachments_->restore(*socket_server_);
+
+  // Continue with the rate limits of the instance that exited on idle.
+  if (ScopedFd const state = socket_server_->take_stored_fd(rate_limiter_state_name_c); state.valid())
+    rate_limiter_->restore_state(state.get());
+
+  // Format the reply to `list` once for every listener.
+  std::vector<AllowedMountPoint> const& mount_points = allowed_mount_points();
+  for (std::size_t listener_index = 0; listener_index < listener_names.size(); ++listener_index)
+  {
+    std::string& reply = list_replies_.emplace_back();
+    for (std::size_t allow_index = 0; allow_index < mount_points.size(); ++allow_index)
+      if (authorization_policy_->served(listener_index, allow_index))
+        reply.append(mount_points[allow_index].name_).append(" ").append(mount_points[allow_index].path_.native()).append("\n");
+  }
+
+  socket_server_->service_notifier().set_status_callback(
+      [this](ServiceNotifier::clock_type::duration elapsed)
+      {
+        return request_statistics_->status_line(elapsed);
+      });
+
+  socket_server_->set_reactor_start(
+      [this](Reactor& reactor)
+      {
+        if (reactor.index() == 0)
+          for (std::shared_ptr<Attachment>& attachment : attachments_->take_restored())
+            RemountdClient::adopt_attachment(reactor, *this, std::move(attachment));
+      });
+
   socket_server_->set_client_factory(
-      [](SocketServer& socket_server, int client_fd)
+      [this](Reactor& reactor, int client_fd)
       {
-        return std::make_unique<RemountdClient>(socket_server, client_fd);
+        return std::make_unique<RemountdClient>(reactor, client_fd, *this);
       });
 }
 
@@ -303,6 +666,15 @@ void Remountd::mainloop()
     throw std::system_error(EINVAL, std::generic_category(), "socket server is not initialized");
 
   socket_server_->mainloop(termination_fd());
+
+  // Let the next instance continue serving the attachments; they outlived the reactors in the registry.
+  if (socket_server_->hand_over_on_exit())
+    attachments_->hand_over();
+
+  // Let the next instance continue with the current rate limits.
+  if (socket_server_->mode() == SocketServer::Mode::k_systemd)
+    if (ScopedFd const state = rate_limiter_->save_state(); state.valid())
+      ServiceNotifier::store_fd(rate_limiter_state_name_c, state.get());
 }
 
 //virtual
@@ -2,12 +2,21 @@
 
 #include "Application.h"
 #include <memory>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <vector>
 
 namespace remountd {
 
-// Forward declaration.
+// Forward declarations.
 class SocketServer;
+class RateLimiter;
+class AuthorizationPolicy;
+class RequestStatistics;
+class PrivilegedExecutor;
+class AttachmentRegistry;
+class StatePage;
 
 // Remountd
 //
@@ -18,6 +27,15 @@ class Remountd final : public Application
  private:
   bool inetd_mode_ = false;                       // True when running as one-shot inetd/systemd Accept=yes handler.
   std::unique_ptr<SocketServer> socket_server_;   // Socket server that manages listeners, clients, and protocol I/O.
+  std::unique_ptr<PrivilegedExecutor> executor_;  // The process that performs the remounts, with the capabilities that this process dropped.
+  std::unique_ptr<AttachmentRegistry> attachments_;           // The attachments that are being served, shared by all reactors.
+  std::unique_ptr<AuthorizationPolicy> authorization_policy_;  // Sockets, users and groups that may use each allow-entry, shared by all clients.
+  std::unique_ptr<RateLimiter> rate_limiter_;     // Rate limits on remount requests, shared by all clients.
+  std::unique_ptr<RequestStatistics> request_statistics_;     // Throughput and latency of remount requests, reported to systemd.
+  std::unique_ptr<StatePage> state_page_;         // The published ro/rw state of the remounted mount points, if enabled.
+  std::vector<std::string> list_replies_;         // Reply to the `list` command, per listener.
+  std::vector<bool> abstract_listeners_;          // True for listeners in the abstract namespace, per listener.
+  std::optional<gid_t> socket_group_;             // The gid of group "remountd", if that exists.
 
  protected:
   // Parse remountd-specific command line parameters.
@@ -38,6 +56,27 @@ class Remountd final : public Application
 
   // Destroy remountd object and owned SocketServer.
   ~Remountd();
+
+  // Return true when running as inetd handler.
+  bool inetd_mode() const { return inetd_mode_; }
+
+  // Accessors for the state that is shared by all clients.
+  AuthorizationPolicy const& authorization_policy() const { return *authorization_policy_; }
+  RateLimiter& rate_limiter() const { return *rate_limiter_; }
+  RequestStatistics& request_statistics() const { return *request_statistics_; }
+  PrivilegedExecutor& executor() const { return *executor_; }
+  AttachmentRegistry& attachments() const { return *attachments_; }
+
+  // Return the StatePage to publish successful remounts to, or nullptr if there is none.
+  StatePage* state_page() const { return state_page_.get(); }
+
+  // Return the reply to `list` for clients connected to the listener with index `listener_index`: the allow-entries served there.
+  std::string const& list_reply(int listener_index) const { return list_replies_[listener_index]; }
+
+  // Return true if the listener with index `listener_index` is bound in the abstract namespace.
+  // Such a socket has no file permissions; only root and members of socket_group() may use it.
+  bool abstract_listener(int listener_index) const { return listener_index >= 0 && abstract_listeners_[listener_index]; }
+  std::optional<gid_t> socket_group() const { return socket_group_; }
 };
 
 } // namespace remountd
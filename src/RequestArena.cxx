@@ -0,0 +1,27 @@
+#include "sys.h"
+#include "RequestArena.h"
+#include "debug.h"
+
+namespace remountd {
+
+std::atomic<uint64_t> RequestArena::s_spilled_allocations_{0};
+
+RequestArena::~RequestArena()
+{
+  if (spill_resource_.spills_ > 0)
+    Dout(dc::notice, "RequestArena [" << this << "] needed " << spill_resource_.spills_ << " heap allocation(s).");
+}
+
+void* RequestArena::SpillResource::do_allocate(std::size_t bytes, std::size_t alignment)
+{
+  ++spills_;
+  s_spilled_allocations_.fetch_add(1, std::memory_order_relaxed);
+  return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void RequestArena::SpillResource::do_deallocate(void* p, std::size_t bytes, std::size_t alignment)
+{
+  std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+}
+
+} // namespace remountd
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+
+namespace remountd {
+
+// RequestArena
+//
+// Monotonic memory arena for the transient strings of one request
+// (error replies, the resolved path, captured stderr, ...).
+//
+// Usage:
+//
+//   RequestArena arena;
+//   std::pmr::string reply(arena.resource());
+//
+// Allocations are served from an inline buffer of inline_size_c bytes;
+// memory is only released when the arena is destroyed, which happens
+// right after the reply was handed to the client. Only when the inline
+// buffer is exhausted does the arena fall back to the heap; those spills
+// are counted so that it can be verified that the request path does not
+// call malloc (see spilled_allocations()).
+class RequestArena
+{
+ public:
+  static constexpr std::size_t inline_size_c = 1536;           // Size of the inline buffer.
+
+ private:
+  // Upstream resource of the arena: the heap, with counting.
+  class SpillResource final : public std::pmr::memory_resource
+  {
+   public:
+    uint64_t spills_ = 0;                                       // Number of heap allocations of the owning arena.
+
+   protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override;
+    bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override { return this == &other; }
+  };
+
+  static std::atomic<uint64_t> s_spilled_allocations_;          // Total number of heap allocations of all arenas.
+
+  alignas(std::max_align_t) std::array<std::byte, inline_size_c> buffer_;       // Inline storage.
+  SpillResource spill_resource_;                                // Must be constructed before resource_.
+  std::pmr::monotonic_buffer_resource resource_;                // The arena itself.
+
+ public:
+  RequestArena() : resource_(buffer_.data(), buffer_.size(), &spill_resource_) { }
+  ~RequestArena();
+
+  RequestArena(RequestArena const&) = delete;
+  RequestArena& operator=(RequestArena const&) = delete;
+
+  // Return the memory resource to construct pmr containers with.
+  std::pmr::memory_resource* resource() { return &resource_; }
+
+  // Return the total number of heap allocations that arenas needed since program start.
+  static uint64_t spilled_allocations() { return s_spilled_allocations_.load(std::memory_order_relaxed); }
+};
+
+} // namespace remountd
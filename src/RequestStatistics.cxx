@@ -0,0 +1,73 @@
+#include "sys.h"
+#include "RequestStatistics.h"
+#include <bit>
+#include <cstdio>
+#include "debug.h"
+
+namespace remountd {
+
+//static
+std::size_t RequestStatistics::bucket_index(uint64_t microseconds)
+{
+  // The first sub_buckets_c buckets are one microsecond wide.
+  if (microseconds < sub_buckets_c)
+    return microseconds;
+
+  int const exponent = std::bit_width(microseconds) - 1;
+  if (exponent > max_exponent_c)
+    return number_of_buckets_c - 1;
+  // The sub_buckets_log2_c bits below the most significant bit select the bucket within the power of two.
+  uint64_t const sub_bucket = (microseconds >> (exponent - sub_buckets_log2_c)) & (sub_buckets_c - 1);
+  return (exponent - sub_buckets_log2_c + 1) * sub_buckets_c + sub_bucket;
+}
+
+//static
+uint64_t RequestStatistics::bucket_upper_bound(std::size_t index)
+{
+  if (index < sub_buckets_c)
+    return index + 1;
+
+  int const exponent = static_cast<int>(index / sub_buckets_c) + sub_buckets_log2_c - 1;
+  uint64_t const sub_bucket = index % sub_buckets_c;
+  return (sub_buckets_c + sub_bucket + 1) << (exponent - sub_buckets_log2_c);
+}
+
+void RequestStatistics::finished(clock_type::duration latency)
+{
+  in_flight_.fetch_sub(1, std::memory_order_relaxed);
+  uint64_t const microseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+  latency_buckets_[bucket_index(microseconds)].fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string RequestStatistics::status_line(clock_type::duration elapsed)
+{
+  // Take the histogram of this interval; requests that finish meanwhile count towards the next one.
+  std::array<uint32_t, number_of_buckets_c> counts;
+  uint64_t total = 0;
+  for (std::size_t index = 0; index < number_of_buckets_c; ++index)
+    total += counts[index] = latency_buckets_[index].exchange(0, std::memory_order_relaxed);
+
+  double const seconds = std::chrono::duration<double>(elapsed).count();
+  double const requests_per_second = seconds > 0.0 ? total / seconds : 0.0;
+  int const in_flight = in_flight_.load(std::memory_order_relaxed);
+
+  char buffer[128];
+  if (total == 0)
+  {
+    std::snprintf(buffer, sizeof(buffer), "0 requests/s, %d in flight", in_flight);
+    return buffer;
+  }
+
+  // The smallest latency bound below which at least 99% of the requests finished.
+  uint64_t const rank = total - total / 100;
+  uint64_t seen = 0;
+  std::size_t index = 0;
+  while ((seen += counts[index]) < rank)
+    ++index;
+  double const p99_ms = bucket_upper_bound(index) / 1000.0;
+
+  std::snprintf(buffer, sizeof(buffer), "%.1f requests/s, %d in flight, p99 %.1f ms", requests_per_second, in_flight, p99_ms);
+  return buffer;
+}
+
+} // namespace remountd
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace remountd {
+
+// RequestStatistics
+//
+// Throughput and latency of remount requests, shared by all reactors.
+//
+// Latencies are counted in a log-linear histogram of microseconds: eight
+// buckets per power of two, so that a reported percentile is at most 12.5%
+// above the real value. Every bucket is an atomic counter, so recording a
+// request costs two relaxed atomic increments and no lock. status_line()
+// takes (and resets) the histogram of the interval since its previous call.
+//
+// Usage:
+//
+//   {
+//     RequestStatistics::Request const request(statistics);
+//     ... // Handle the request.
+//   } // Counted as finished here.
+class RequestStatistics
+{
+ public:
+  using clock_type = std::chrono::steady_clock;
+
+  // Request
+  //
+  // Scoped object that counts one request as in flight for its lifetime.
+  class Request
+  {
+   private:
+    RequestStatistics& statistics_;     // The statistics to report to.
+    clock_type::time_point start_;      // When the request started.
+
+   public:
+    explicit Request(RequestStatistics& statistics) : statistics_(statistics), start_(clock_type::now())
+    {
+      statistics_.in_flight_.fetch_add(1, std::memory_order_relaxed);
+    }
+    Request(Request const&) = delete;
+    ~Request() { statistics_.finished(clock_type::now() - start_); }
+  };
+
+ private:
+  static constexpr int sub_buckets_log2_c = 3;                                  // log2 of the number of buckets per power of two.
+  static constexpr int sub_buckets_c = 1 << sub_buckets_log2_c;
+  static constexpr int max_exponent_c = 40;                                     // Latencies of 2^41 microseconds and up share the last bucket.
+  static constexpr std::size_t number_of_buckets_c = (max_exponent_c - sub_buckets_log2_c + 2) * sub_buckets_c;
+
+  std::atomic<int> in_flight_{0};                                               // Number of requests that did not finish yet.
+  std::array<std::atomic<uint32_t>, number_of_buckets_c> latency_buckets_{};    // Number of finished requests per latency bucket.
+
+ private:
+  // Count a finished request that took `latency`.
+  void finished(clock_type::duration latency);
+
+  // Return the bucket of a latency of `microseconds`.
+  static std::size_t bucket_index(uint64_t microseconds);
+
+  // Return the smallest latency, in microseconds, that falls in the bucket after `index`.
+  static uint64_t bucket_upper_bound(std::size_t index);
+
+ public:
+  // Return "<n> requests/s, <n> in flight, p99 <t>" over the `elapsed` time since the previous call, and start a new interval.
+  std::string status_line(clock_type::duration elapsed);
+};
+
+} // namespace remountd
@@ -0,0 +1,102 @@
+#include "sys.h"
+#include "ServiceNotifier.h"
+#include <systemd/sd-daemon.h>
+#include <syslog.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include "debug.h"
+
+namespace remountd {
+
+void ServiceNotifier::initialize(int number_of_reactors)
+{
+  DoutEntering(dc::notice, "ServiceNotifier::initialize(" << number_of_reactors << ")");
+
+  enabled_ = std::getenv("NOTIFY_SOCKET") != nullptr;
+  if (!enabled_)
+    return;
+
+  uint64_t watchdog_usec = 0;
+  if (sd_watchdog_enabled(0, &watchdog_usec) > 0)
+    watchdog_interval_ = std::chrono::microseconds{watchdog_usec};
+
+  clock_type::rep const now = clock_type::now().time_since_epoch().count();
+  number_of_reactors_ = number_of_reactors;
+  heartbeats_ = std::make_unique<std::atomic<clock_type::rep>[]>(number_of_reactors);
+  for (int reactor_index = 0; reactor_index < number_of_reactors; ++reactor_index)
+    heartbeats_[reactor_index].store(now, std::memory_order_relaxed);
+}
+
+void ServiceNotifier::ready()
+{
+  if (!enabled_)
+    return;
+
+  last_status_ = clock_type::now();
+  sd_notify(0, "READY=1\nSTATUS=Serving requests.");
+}
+
+void ServiceNotifier::stopping()
+{
+  if (!enabled_)
+    return;
+
+  sd_notify(0, "STOPPING=1\nSTATUS=Shutting down.");
+}
+
+//static
+bool ServiceNotifier::store_fd(std::string_view name, int fd)
+{
+  std::string const state = "FDSTORE=1\nFDNAME=" + std::string(name);
+  int const ret = sd_pid_notify_with_fds(0, 0, state.c_str(), &fd, 1);
+  if (ret < 0)
+    syslog(LOG_WARNING, "Failed to store fd '%s' with systemd: %s", std::string(name).c_str(), std::strerror(-ret));
+  return ret > 0;
+}
+
+//static
+void ServiceNotifier::remove_stored_fd(std::string_view name)
+{
+  std::string const state = "FDSTOREREMOVE=1\nFDNAME=" + std::string(name);
+  sd_notify(0, state.c_str());
+}
+
+void ServiceNotifier::heartbeat(int reactor_index)
+{
+  heartbeats_[reactor_index].store(clock_type::now().time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+void ServiceNotifier::tick()
+{
+  clock_type::time_point const now = clock_type::now();
+
+  if (watchdog_interval_ > clock_type::duration::zero())
+  {
+    clock_type::rep const deadline = (now - watchdog_interval_).time_since_epoch().count();
+    int reactor_index = 0;
+    while (reactor_index < number_of_reactors_ && heartbeats_[reactor_index].load(std::memory_order_relaxed) >= deadline)
+      ++reactor_index;
+    if (reactor_index == number_of_reactors_)
+      sd_notify(0, "WATCHDOG=1");
+    else
+      syslog(LOG_WARNING, "Reactor %d is not responding; not pinging the watchdog.", reactor_index);
+  }
+
+  // Allow for timer jitter: status_interval_c might be a multiple of the tick interval.
+  if (status_callback_ && now - last_status_ + tick_interval() / 2 >= status_interval_c)
+  {
+    std::string const status = "STATUS=" + status_callback_(now - last_status_);
+    sd_notify(0, status.c_str());
+    last_status_ = now;
+  }
+}
+
+ServiceNotifier::clock_type::duration ServiceNotifier::tick_interval() const
+{
+  if (watchdog_interval_ == clock_type::duration::zero())
+    return status_interval_c;
+  return std::min<clock_type::duration>(watchdog_interval_ / 2, status_interval_c);
+}
+
+} // namespace remountd
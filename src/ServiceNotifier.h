@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace remountd {
+
+// ServiceNotifier
+//
+// Reports the state of the daemon to systemd when it runs as a Type=notify
+// service: READY=1 once all reactors exist, WATCHDOG=1 while every reactor
+// keeps running, a STATUS= line every status_interval_c and STOPPING=1 when
+// the mainloop returns. Without $NOTIFY_SOCKET nothing is sent and no
+// reactor arms a timer for it.
+//
+// Every reactor arms a periodic timerfd of tick_interval() and calls
+// heartbeat() when it expires; reactor 0 then also calls tick(), which only
+// pings the watchdog if every reactor had a heartbeat within the watchdog
+// interval. A reactor that is stuck therefore lets the watchdog expire, and
+// systemd restarts the service.
+//
+// Finally, store_fd() hands file descriptors to the FD store of the service
+// (FileDescriptorStoreMax=), so that the next instance can pick up state
+// where this one left off; systemd passes them back along with the
+// activated sockets, where SocketServer sets them apart by their name.
+class ServiceNotifier
+{
+ public:
+  using clock_type = std::chrono::steady_clock;
+  using status_callback_type = std::function<std::string(clock_type::duration)>;       // Returns the STATUS= text for the given time since the previous one.
+
+  static constexpr std::chrono::seconds status_interval_c{10};  // Time between two STATUS= updates.
+
+ private:
+  bool enabled_ = false;                                        // True if systemd listens for notifications.
+  clock_type::duration watchdog_interval_{};                    // WatchdogSec= of the service, or zero.
+  int number_of_reactors_ = 0;                                  // Number of entries in heartbeats_.
+  std::unique_ptr<std::atomic<clock_type::rep>[]> heartbeats_;  // Time of the last heartbeat of every reactor.
+  clock_type::time_point last_status_;                          // When the previous STATUS= was sent (only used by reactor 0).
+  status_callback_type status_callback_;                        // Produces the STATUS= text, if set.
+
+ public:
+  // Read the notification environment for a mainloop with `number_of_reactors` reactors.
+  void initialize(int number_of_reactors);
+
+  // Tell systemd that the service is up.
+  void ready();
+
+  // Tell systemd that the service is shutting down.
+  void stopping();
+
+  // Record that reactor `reactor_index` is alive.
+  void heartbeat(int reactor_index);
+
+  // Called by reactor 0 after its heartbeat: ping the watchdog and update the status when due.
+  void tick();
+
+  // Hand `fd` to the FD store of the service under `name`. Returns false if there is no FD store.
+  static bool store_fd(std::string_view name, int fd);
+
+  // Remove the fds named `name` from the FD store.
+  static void remove_stored_fd(std::string_view name);
+
+  // Set the function that produces the STATUS= text.
+  void set_status_callback(status_callback_type status_callback) { status_callback_ = std::move(status_callback); }
+
+  // Return true if reactors need to call heartbeat() every tick_interval().
+  bool enabled() const { return enabled_; }
+
+  // Return the period of the reactor timers: half the watchdog interval, or status_interval_c if that is shorter.
+  clock_type::duration tick_interval() const;
+};
+
+} // namespace remountd
@@ -1,14 +1,16 @@
 #include "sys.h"
 #include "SocketClient.h"
-#include "SocketServer.h"
+#include "Reactor.h"
+#include <sys/socket.h>
 #include <syslog.h>
+#include <algorithm>
 #include <cerrno>
 #include <system_error>
 #include "debug.h"
 
 namespace remountd {
 
-SocketClient::SocketClient(SocketServer& socket_server, int fd) : socket_server_(socket_server), fd_(fd)
+SocketClient::SocketClient(Reactor& reactor, int fd) : reactor_(reactor), fd_(fd)
 {
   DoutEntering(dc::notice, "SocketClient::SocketClient(" << fd << ") [" << this << "]");
 }
@@ -23,47 +25,204 @@ void SocketClient::disconnect() noexcept
   fd_.reset();
 }
 
-bool SocketClient::handle_readable()
+void SocketClient::reuse(int fd)
 {
-  //DoutEntering(dc::notice, "SocketClient::handle_readable()");
+  DoutEntering(dc::notice, "SocketClient::reuse(" << fd << ") [" << this << "]");
+
+  fd_.reset(fd);
+  partial_message_.clear();
+  saw_carriage_return_ = false;
+  input_begin_ = input_end_ = 0;
+  output_buffer_.clear();
+  output_begin_ = 0;
+  next_request_id_ = next_reply_id_ = 0;
+  early_replies_.clear();
+  in_flight_ = 0;
+  dispatching_ = false;
+  closing_ = false;
+  message_budget_ = 0;
+  epoll_events_ = 0;
+  queued_for_input_ = false;
+  queued_for_flush_ = false;
+  last_activity_tick_ = 0;
+  handing_over_ = false;
+  reset_client_state();
+}
+
+void SocketClient::end_request(uint64_t id, std::string_view reply)
+{
+  --in_flight_;
+  deliver_reply(id, reply);
+  // Let the reactor resume input that was paused for this request; when we
+  // are inside handle_readable then that simply continues dispatching.
+  if (!dispatching_)
+    reactor_.request_finished(*this);
+}
+
+bool SocketClient::accepts_input() const
+{
+  return !closing_ && !handing_over_ && in_flight_ < reactor_.max_in_flight() && pending_output() < reactor_.max_pending_output();
+}
+
+SocketClient::HandoverState SocketClient::release_for_handover()
+{
+  HandoverState state{
+    .fd_ = std::move(fd_),
+    .listener_index_ = listener_index_,
+    .partial_message_ = std::move(partial_message_),
+    .input_ = std::string(input_buffer_.data() + input_begin_, input_end_ - input_begin_),
+    .output_ = output_buffer_.substr(output_begin_),
+    .saw_carriage_return_ = saw_carriage_return_
+  };
+  partial_message_.clear();
+  input_begin_ = input_end_ = 0;
+  output_buffer_.clear();
+  output_begin_ = 0;
+  return state;
+}
+
+bool SocketClient::restore_handover_state(HandoverState const& state)
+{
+  if (state.input_.size() > input_buffer_.size() || state.partial_message_.size() >= max_message_length_c)
+    return false;
+
+  partial_message_ = state.partial_message_;
+  saw_carriage_return_ = state.saw_carriage_return_;
+  std::copy(state.input_.begin(), state.input_.end(), input_buffer_.begin());
+  input_begin_ = 0;
+  input_end_ = state.input_.size();
+  output_buffer_ = state.output_;
+  output_begin_ = 0;
+  return true;
+}
+
+void SocketClient::deliver_reply(uint64_t id, std::string_view reply)
+{
+  // The client might have disconnected while the request was running.
+  if (!fd_.valid())
+    return;
+
+  if (id != next_reply_id_)
+  {
+    early_replies_.emplace_back(id, reply);
+    return;
+  }
+
+  output_buffer_.append(reply);
+  ++next_reply_id_;
+  // Append the replies that were waiting for this one.
+  for (auto iter = early_replies_.begin(); iter != early_replies_.end();)
+  {
+    if (iter->first != next_reply_id_)
+    {
+      ++iter;
+      continue;
+    }
+    output_buffer_.append(iter->second);
+    ++next_reply_id_;
+    early_replies_.erase(iter);
+    iter = early_replies_.begin();
+  }
+
+  reactor_.flush_at_end_of_iteration(*this);
+}
+
+void SocketClient::flush_output()
+{
+  while (output_begin_ < output_buffer_.size())
+  {
+    ssize_t const sent = send(fd_.get(), output_buffer_.data() + output_begin_, output_buffer_.size() - output_begin_, MSG_NOSIGNAL);
+    if (sent > 0)
+    {
+      output_begin_ += static_cast<std::size_t>(sent);
+      continue;
+    }
+
+    if (sent < 0 && errno == EINTR)
+      continue;
+
+    // Keep the rest until the Reactor reports that the socket is writable again.
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      output_buffer_.erase(0, output_begin_);
+      output_begin_ = 0;
+      return;
+    }
+
+    // The connection is broken; the Reactor will see the hangup.
+    if (sent < 0)
+      syslog(LOG_ERR, "send failed for client fd %d: %m", fd_.get());
+    break;
+  }
+
+  output_buffer_.clear();
+  output_begin_ = 0;
+}
+
+bool SocketClient::process_input()
+{
+  while (input_begin_ < input_end_ && accepts_input() && message_budget_ > 0)
+  {
+    char const byte = input_buffer_[input_begin_++];
+    // Skip a \n if that immediately follows a \r.
+    if (saw_carriage_return_ && byte == '\n')
+    {
+      saw_carriage_return_ = false;
+      continue;
+    }
+    saw_carriage_return_ = byte == '\r';
+    if (byte == '\r' || byte == '\n')
+    {
+      --message_budget_;
+      if (!new_message(partial_message_))
+        return false;
+      partial_message_.clear();
+      if (!fd_.valid())
+        return false;
+      continue;
+    }
+
+    partial_message_.push_back(byte);
+    if (partial_message_.size() >= max_message_length_c)
+    {
+      syslog(LOG_ERR, "Dropping client fd %d: no newline within %zu characters", fd_.get(), max_message_length_c);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SocketClient::handle_readable(int message_budget)
+{
+  //DoutEntering(dc::notice, "SocketClient::handle_readable(" << message_budget << ")");
 
   if (!fd_.valid())
     return false;
 
-  char buffer[4096];
+  struct dispatching_guard
+  {
+    bool& dispatching_;
+    dispatching_guard(bool& dispatching) : dispatching_(dispatching) { dispatching_ = true; }
+    ~dispatching_guard() { dispatching_ = false; }
+  } const guard{dispatching_};
+
+  message_budget_ = message_budget;
   for (;;)
   {
-    ssize_t const read_ret = read(fd_.get(), buffer, sizeof(buffer));
+    if (!process_input())
+      return false;
+
+    // Leave the remaining input buffered until requests in flight finished and output drained,
+    // or until the Reactor gets back to this client.
+    if (!accepts_input() || message_budget_ == 0)
+      return true;
+
+    input_begin_ = input_end_ = 0;
+    ssize_t const read_ret = read(fd_.get(), input_buffer_.data(), input_buffer_.size());
     if (read_ret > 0)
     {
-      //Dout(dc::notice, "Received " << read_ret << " bytes: '" << libcwd::buf2str(buffer, read_ret) << "'");
-      for (ssize_t i = 0; i < read_ret; ++i)
-      {
-        char const byte = buffer[i];
-        // Skip a \n if that immediately follows a \r.
-        if (saw_carriage_return_ && byte == '\n')
-        {
-          saw_carriage_return_ = false;
-          continue;
-        }
-        saw_carriage_return_ = byte == '\r';
-        if (byte == '\r' || byte == '\n')
-        {
-          if (!new_message(partial_message_))
-            return false;
-          partial_message_.clear();
-          if (!fd_.valid())
-            return false;
-          continue;
-        }
-
-        partial_message_.push_back(byte);
-        if (partial_message_.size() >= max_message_length_c)
-        {
-          syslog(LOG_ERR, "Dropping client fd %d: no newline within %zu characters", fd_.get(), max_message_length_c);
-          return false;
-        }
-      }
+      //Dout(dc::notice, "Received " << read_ret << " bytes: '" << libcwd::buf2str(input_buffer_.data(), read_ret) << "'");
+      input_end_ = static_cast<std::size_t>(read_ret);
       continue;
     }
 
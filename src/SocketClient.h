@@ -1,34 +1,121 @@
 #pragma once
 
 #include "ScopedFd.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 namespace remountd {
 
-class SocketServer;
+class Reactor;
 
 // Client
 //
 // Represents a connected client socket and receives complete protocol
 // messages. Messages are ASCII/UTF-8 text lines terminated by '\n'.
+//
+// A derived class replies to a message with send_reply(), or handles it
+// asynchronously: it calls begin_request() from new_message() and passes
+// the returned id plus the reply to end_request() when the request
+// finished (typically at the end of a coroutine). Replies are always
+// written in the order of the messages they answer.
+//
+// Replies are collected in an output buffer that the Reactor writes with
+// a single send() at the end of the event loop iteration, so that a batch
+// of pipelined requests costs one system call for all replies. Output that
+// the socket does not accept stays buffered until it becomes writable.
+// While the client has Reactor::max_in_flight() requests in flight, or
+// more than Reactor::max_pending_output() bytes of pending output, no
+// further messages are dispatched: the remaining input stays buffered and
+// the Reactor stops listening for input on this client (EPOLL_CTL_MOD)
+// until it drained.
+//
+// Each call to handle_readable() dispatches at most a given number of
+// messages, so that one client that keeps its socket full can not starve
+// the other clients of the same Reactor.
+//
+// A client that did not send anything for Application::idle_timeout_seconds()
+// while it had no requests in flight and no pending output is disconnected.
 class SocketClient
 {
+ public:
+  // HandoverState
+  //
+  // A connection as it is passed to the next instance of the daemon (see SocketServer::hand_over).
+  struct HandoverState
+  {
+    ScopedFd fd_;                       // The connected socket.
+    int listener_index_;                // Index in SocketServer::listeners() of the socket it connected to.
+    std::string partial_message_;       // Bytes of the not-yet-terminated message.
+    std::string input_;                 // Read bytes that were not processed yet.
+    std::string output_;                // Reply bytes that were not written yet.
+    bool saw_carriage_return_;          // True if the last character received was a carriage-return ('\r').
+  };
+
  private:
   static constexpr std::size_t max_message_length_c = 256;    // Maximum number of non-newline characters per message.
-  SocketServer& socket_server_;                               // Owning socket server instance.
+  Reactor& reactor_;                                          // Owning reactor; the only thread that touches this client.
   ScopedFd fd_;                                               // Owned connected client socket.
+  int listener_index_ = 0;                                    // Index in SocketServer::listeners() of the socket this client connected to (maintained by Reactor).
   std::string partial_message_;                               // Bytes of the current not-yet-terminated message.
   bool saw_carriage_return_ = false;                          // True if the last character received was a carriage-return ('\r').
+  std::array<char, 4096> input_buffer_;                       // Bytes read from fd_ that were not processed yet.
+  std::size_t input_begin_ = 0;                               // Index of the first unprocessed byte in input_buffer_.
+  std::size_t input_end_ = 0;                                 // One past the last read byte in input_buffer_.
+  std::string output_buffer_;                                 // Reply bytes that could not be written yet, starting at output_begin_.
+  std::size_t output_begin_ = 0;                              // Index of the first unwritten byte in output_buffer_.
+  uint64_t next_request_id_ = 0;                              // Id of the next message that will be replied to.
+  uint64_t next_reply_id_ = 0;                                // Id of the message whose reply must be written next.
+  std::vector<std::pair<uint64_t, std::string>> early_replies_;       // Replies of requests that finished before an earlier request.
+  int in_flight_ = 0;                                         // Number of asynchronous requests that did not finish yet.
+  bool dispatching_ = false;                                  // True while inside handle_readable.
+  bool closing_ = false;                                      // True when the connection must be closed once all requests in flight finished (maintained by Reactor).
+  int message_budget_ = 0;                                    // Number of messages that may still be dispatched by the current handle_readable call.
+  uint32_t epoll_events_ = 0;                                 // The event mask that fd_ is currently registered with (maintained by Reactor).
+  bool queued_for_input_ = false;                             // True while this client is in the round-robin queue of its Reactor (maintained by Reactor).
+  bool queued_for_flush_ = false;                             // True while this client is in the flush queue of its Reactor (maintained by Reactor).
+  uint64_t last_activity_tick_ = 0;                           // Idle timer tick of the last received input (maintained by Reactor).
+  uint64_t idle_expiry_tick_ = 0;                             // Tick at which the idle timer entry of this client expires.
+  SocketClient* idle_prev_ = nullptr;                         // Previous client in the same IdleTimerWheel slot.
+  SocketClient* idle_next_ = nullptr;                         // Next client in the same IdleTimerWheel slot.
+  bool in_idle_wheel_ = false;                                // True while this client is linked into an IdleTimerWheel.
+  bool handing_over_ = false;                                 // True while the Reactor prepares to hand this connection over; no input is dispatched (maintained by Reactor).
+
+  friend class Reactor;
+  friend class IdleTimerWheel;
+
+  // Dispatch complete messages from input_buffer_ until it is empty, accepts_input() returns false or the message budget is used up.
+  // Returns false when the connection must be closed.
+  bool process_input();
+
+  // Append the reply with the given id to the output, or keep it until all earlier replies were appended.
+  // The Reactor writes the output at the end of the current event loop iteration.
+  void deliver_reply(uint64_t id, std::string_view reply);
 
  protected:
   // Handle one complete message (without trailing newline).
   // The client should be removed if this returns false.
   virtual bool new_message(std::string_view message) = 0;
 
+  // Reset derived-class state when this object is reused for a new connection.
+  virtual void reset_client_state() { }
+
+  // Reply to the message that is currently being handled by new_message.
+  void send_reply(std::string_view reply) { deliver_reply(next_request_id_++, reply); }
+
+  // Mark the start of an asynchronous request. Returns the id to pass to end_request.
+  uint64_t begin_request() { ++in_flight_; return next_request_id_++; }
+
+  // Mark the end of the asynchronous request `id` that was started with begin_request(), replying with `reply`.
+  void end_request(uint64_t id, std::string_view reply);
+
  public:
   // Take ownership of the connected client file descriptor.
-  SocketClient(SocketServer& socket_server, int fd);
+  SocketClient(Reactor& reactor, int fd);
 
   // Virtual destructor for polymorphic derived clients.
   virtual ~SocketClient();
@@ -39,12 +126,42 @@ class SocketClient
   // Return the owned client file descriptor.
   int fd() const { return fd_.get(); }
 
+  // Return the index in SocketServer::listeners() of the socket that this client connected to.
+  int listener_index() const { return listener_index_; }
+
+  // Return the reactor that owns this client.
+  Reactor& reactor() const { return reactor_; }
+
+  // Return true while an asynchronous request is in flight.
+  bool busy() const { return in_flight_ > 0; }
+
   // Cleanly disconnect this client: remove from epoll and close fd.
   void disconnect() noexcept;
 
-  // Consume currently available input data and dispatch complete messages.
+  // Reinitialize this (disconnected) object for a new connection `fd`, keeping allocated buffer capacity.
+  void reuse(int fd);
+
+  // Move the connection and its unprocessed input and output out of this (idle) client, leaving it disconnected.
+  HandoverState release_for_handover();
+
+  // Continue a connection of a previous instance of the daemon. Returns false if the state is invalid.
+  bool restore_handover_state(HandoverState const& state);
+
+  // Return true if already read input is waiting to be processed.
+  bool has_buffered_input() const { return input_begin_ < input_end_; }
+
+  // Return the number of reply bytes that are waiting to be written.
+  std::size_t pending_output() const { return output_buffer_.size() - output_begin_; }
+
+  // Return true if the number of requests in flight and the pending output allow dispatching another message.
+  bool accepts_input() const;
+
+  // Write as much of the pending output as the socket accepts.
+  void flush_output();
+
+  // Consume currently available input data and dispatch at most `message_budget` complete messages.
   // Returns false when the connection must be closed.
-  bool handle_readable();
+  bool handle_readable(int message_budget);
 };
 
 } // namespace remountd
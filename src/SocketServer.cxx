@@ -1,24 +1,33 @@
 #include "sys.h"
 #include "SocketServer.h"
+#include "Reactor.h"
 #include "Application.h"
 #include "remountd_error.h"
+#include "utils.h"
 
 #include <fcntl.h>
 #include <grp.h>
-#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
+#include <syslog.h>
 #include <unistd.h>
 #include <systemd/sd-daemon.h>
 
 #include <algorithm>
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <mutex>
 #include <optional>
 #include <string_view>
 #include <system_error>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "debug.h"
 #ifdef CWDEBUG
@@ -28,7 +37,6 @@
 namespace remountd {
 namespace {
 
-constexpr int k_listen_backlog = 4;
 constexpr int k_systemd_listen_fd_start = SD_LISTEN_FDS_START;
 
 // ScopedUmask
@@ -102,6 +110,70 @@ void configure_standalone_socket_permissions(std::filesystem::path const& socket
   }
 }
 
+// Return true if nobody listens on the socket file at `addr`.
+bool is_stale_socket(sockaddr_un const& addr, socklen_t addr_length)
+{
+  ScopedFd const fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  return fd.valid() && connect(fd.get(), reinterpret_cast<sockaddr const*>(&addr), addr_length) != 0 && errno == ECONNREFUSED;
+}
+
+// Format of the state.clients memfd: "RCH1", the number of connections, and per connection the
+// number of its fd in the FD store, listener name, saw-carriage-return flag, partial message, input and output.
+// It is only read by the next instance on the same host, so integers are stored in host byte order.
+constexpr uint32_t clients_state_magic_c = 0x52434831;
+
+void append_u32(std::string& out, uint32_t value)
+{
+  out.append(reinterpret_cast<char const*>(&value), sizeof(value));
+}
+
+void append_string(std::string& out, std::string_view str)
+{
+  append_u32(out, static_cast<uint32_t>(str.size()));
+  out.append(str);
+}
+
+// ClientsStateReader
+//
+// Reads the fields written by append_u32 and append_string; once the input is exhausted every read returns zero or empty, and ok() returns false.
+class ClientsStateReader
+{
+ private:
+  std::string_view in_;                 // The input that was not read yet.
+  bool ok_ = true;                      // False after reading past the end of the input.
+
+ public:
+  explicit ClientsStateReader(std::string_view in) : in_(in) { }
+
+  uint32_t u32()
+  {
+    uint32_t value = 0;
+    if (in_.size() < sizeof(value))
+    {
+      ok_ = false;
+      return 0;
+    }
+    std::memcpy(&value, in_.data(), sizeof(value));
+    in_.remove_prefix(sizeof(value));
+    return value;
+  }
+
+  std::string_view string()
+  {
+    uint32_t const size = u32();
+    if (in_.size() < size)
+    {
+      ok_ = false;
+      return {};
+    }
+    std::string_view const str = in_.substr(0, size);
+    in_.remove_prefix(size);
+    return str;
+  }
+
+  bool ok() const { return ok_; }
+};
+
 // NullClient
 //
 // Default client implementation that silently discards complete messages.
@@ -109,7 +181,7 @@ class NullClient final : public SocketClient
 {
  public:
   // Construct a null client for the given file descriptor.
-  explicit NullClient(SocketServer& socket_server, int fd) : SocketClient(socket_server, fd)
+  explicit NullClient(Reactor& reactor, int fd) : SocketClient(reactor, fd)
   {
   }
 
@@ -126,9 +198,9 @@ class NullClient final : public SocketClient
 
 SocketServer::SocketServer(bool inetd_mode) :
     client_factory_(
-        [](SocketServer& socket_server, int client_fd)
+        [](Reactor& reactor, int client_fd)
         {
-          return std::make_unique<NullClient>(socket_server, client_fd);
+          return std::make_unique<NullClient>(reactor, client_fd);
         })
 {
   initialize(inetd_mode);
@@ -143,14 +215,11 @@ void SocketServer::cleanup()
 {
   DoutEntering(dc::notice, "SocketServer::cleanup()");
 
-  Dout(dc::notice, "Calling clients_.clear()");
-  clients_.clear();
-  epoll_fd_.reset();
-
-  if (close_listener_on_cleanup_)
-    listener_fd_.reset();
-  else
-    listener_fd_.release();
+  if (!close_listener_on_cleanup_)
+    for (Listener& listener : listeners_)
+      listener.fd_.release();
+  listeners_.clear();
+  stored_fds_.clear();
 
   if (unlink_on_cleanup_ && !standalone_socket_path_.empty())
   {
@@ -177,7 +246,7 @@ void SocketServer::open_inetd()
     throw_error(errc::inetd_stdin_not_socket, "--inetd was specified but stdin is not a socket");
 
   make_nonblocking(STDIN_FILENO);
-  listener_fd_.reset(STDIN_FILENO);
+  listeners_.push_back({ScopedFd{STDIN_FILENO}, {}, is_abstract_socket_fd(STDIN_FILENO)});
   close_listener_on_cleanup_ = false;
   mode_ = Mode::k_inetd;
 }
@@ -186,22 +255,47 @@ bool SocketServer::open_systemd()
 {
   DoutEntering(dc::notice, "SocketServer::open_systemd()");
 
-  int const listen_fds = sd_listen_fds(0);
+  char** names = nullptr;
+  int const listen_fds = sd_listen_fds_with_names(0, &names);
   if (listen_fds < 0)
-    throw std::system_error(-listen_fds, std::system_category(), "sd_listen_fds failed");
+    throw std::system_error(-listen_fds, std::system_category(), "sd_listen_fds_with_names failed");
 
-  if (listen_fds == 0)
-    return false;
+  // Take ownership of the fds and names first, so that they are all released if one of them is rejected.
+  for (int i = 0; i < listen_fds; ++i)
+    listeners_.push_back({ScopedFd{k_systemd_listen_fd_start + i}, names && names[i] ? names[i] : ""});
+  if (names)
+  {
+    for (int i = 0; i < listen_fds; ++i)
+      free(names[i]);
+    free(names);
+  }
+
+  // The fds from the FD store are not sockets to listen on.
+  for (auto iter = listeners_.begin(); iter != listeners_.end();)
+  {
+    if (!iter->name_.starts_with(stored_fd_prefix_c))
+    {
+      ++iter;
+      continue;
+    }
+    Dout(dc::notice, "Received stored fd '" << iter->name_ << "' (fd " << iter->fd_.get() << ").");
+    stored_fds_.push_back({std::move(iter->fd_), std::move(iter->name_)});
+    iter = listeners_.erase(iter);
+  }
 
-  if (listen_fds > 1)
-    throw_error(errc::systemd_invalid_fd_count, "expected exactly one socket from systemd");
+  if (listeners_.empty())
+    return false;
 
-  int const fd = k_systemd_listen_fd_start;
-  if (!is_socket_fd(fd))
-    throw_error(errc::systemd_inherited_fd_not_socket, "inherited FD " + std::to_string(fd) + " is not a UNIX stream socket");
+  for (Listener const& listener : listeners_)
+  {
+    if (!is_socket_fd(listener.fd_.get()))
+      throw_error(errc::systemd_inherited_fd_not_socket, "inherited FD " + std::to_string(listener.fd_.get()) + " ('" + listener.name_ + "') is not a UNIX stream socket");
 
-  make_nonblocking(fd);
-  listener_fd_.reset(fd);
+    make_nonblocking(listener.fd_.get());
+    Dout(dc::notice, "Listening on systemd socket '" << listener.name_ << "' (fd " << listener.fd_.get() << ").");
+  }
+  for (Listener& listener : listeners_)
+    listener.abstract_ = is_abstract_socket_fd(listener.fd_.get());
   mode_ = Mode::k_systemd;
   return true;
 }
@@ -211,40 +305,48 @@ void SocketServer::create_standalone_listener(std::filesystem::path const& socke
   DoutEntering(dc::notice, "SocketServer::create_standalone_listener(" << socket_fs_path << ")");
 
   std::string const socket_native_path = socket_fs_path.string();
+  sockaddr_un addr;
+  socklen_t const addr_length = make_unix_socket_address(socket_native_path, addr);
 
-  if (socket_native_path.size() >= sizeof(sockaddr_un::sun_path))
-    throw_error(errc::socket_path_too_long, "socket path is too long for AF_UNIX: '" + socket_native_path + "'");
+  // A name in the abstract namespace has no inode: no stale file to check for and no permissions to set.
+  // Instead RemountdClient checks the credentials of the peer.
+  bool const abstract = is_abstract_socket_path(socket_native_path);
 
   std::error_code ec;
-  bool const exists = std::filesystem::exists(socket_fs_path, ec);
-  if (ec)
-    throw std::system_error(ec, "failed to inspect socket path '" + socket_native_path + "'");
-
-  if (exists)
+  if (!abstract)
   {
-    bool const is_socket = std::filesystem::is_socket(socket_fs_path, ec);
+    bool const exists = std::filesystem::exists(socket_fs_path, ec);
     if (ec)
       throw std::system_error(ec, "failed to inspect socket path '" + socket_native_path + "'");
 
-    if (!is_socket)
-      throw_error(errc::socket_path_not_socket, "path exists and is not a socket: '" + socket_native_path + "'");
+    if (exists)
+    {
+      bool const is_socket = std::filesystem::is_socket(socket_fs_path, ec);
+      if (ec)
+        throw std::system_error(ec, "failed to inspect socket path '" + socket_native_path + "'");
+
+      if (!is_socket)
+        throw_error(errc::socket_path_not_socket, "path exists and is not a socket: '" + socket_native_path + "'");
+
+      // Left over by an instance that was killed, or whose listener was handed to the FD store of a service that was then stopped.
+      if (is_stale_socket(addr, addr_length))
+      {
+        Dout(dc::notice, "Removing stale socket " << socket_fs_path);
+        std::filesystem::remove(socket_fs_path, ec);
+      }
+    }
   }
 
   ScopedFd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0));
   if (!fd.valid())
     throw std::system_error(errno, std::generic_category(), "socket(AF_UNIX) failed");
 
-  sockaddr_un addr{};
-  addr.sun_family = AF_UNIX;
-  std::copy(socket_native_path.begin(), socket_native_path.end(), addr.sun_path);
-  addr.sun_path[socket_native_path.size()] = '\0';
-
   // Reduce permissions from the moment of bind when running as root.
   std::optional<ScopedUmask> umask_guard;
-  if (geteuid() == 0)
+  if (geteuid() == 0 && !abstract)
     umask_guard.emplace(0177);
 
-  if (bind(fd.get(), reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0)
+  if (bind(fd.get(), reinterpret_cast<sockaddr const*>(&addr), addr_length) != 0)
   {
     int const bind_errno = errno;
     if (bind_errno == EADDRINUSE)
@@ -252,17 +354,19 @@ void SocketServer::create_standalone_listener(std::filesystem::path const& socke
     throw std::system_error(bind_errno, std::generic_category(), "bind('" + socket_native_path + "') failed");
   }
 
-  configure_standalone_socket_permissions(socket_fs_path, socket_native_path);
+  if (!abstract)
+    configure_standalone_socket_permissions(socket_fs_path, socket_native_path);
 
-  if (listen(fd.get(), k_listen_backlog) != 0)
+  if (listen(fd.get(), static_cast<int>(Application::instance().listen_backlog())) != 0)
   {
     int const err = errno;
-    std::filesystem::remove(socket_fs_path, ec);
+    if (!abstract)
+      std::filesystem::remove(socket_fs_path, ec);
     throw std::system_error(err, std::generic_category(), "listen('" + socket_native_path + "') failed");
   }
 
-  listener_fd_.reset(fd.release());
-  unlink_on_cleanup_ = true;
+  listeners_.push_back({std::move(fd), {}, abstract});
+  unlink_on_cleanup_ = !abstract;
   standalone_socket_path_ = socket_fs_path;
   mode_ = Mode::k_standalone;
 }
@@ -271,7 +375,26 @@ void SocketServer::open_standalone()
 {
   DoutEntering(dc::notice, "SocketServer::open_standalone()");
 
-  create_standalone_listener(Application::instance().socket_path());
+  std::filesystem::path const socket_fs_path = Application::instance().socket_path();
+
+  // Continue on the listener of the previous instance, so that no connection attempt failed during the restart.
+  if (ScopedFd listener = take_stored_fd(stored_listener_name_c); listener.valid())
+  {
+    if (socket_address_name(listener.get()) == socket_fs_path.native())
+    {
+      Dout(dc::notice, "Continuing on the stored listener of " << socket_fs_path);
+      make_nonblocking(listener.get());
+      bool const abstract = is_abstract_socket_fd(listener.get());
+      listeners_.push_back({std::move(listener), {}, abstract});
+      unlink_on_cleanup_ = !abstract;
+      standalone_socket_path_ = socket_fs_path;
+      mode_ = Mode::k_standalone;
+      return;
+    }
+    Dout(dc::notice, "The stored listener is not bound to " << socket_fs_path << "; closing it.");
+  }
+
+  create_standalone_listener(socket_fs_path);
 }
 
 void SocketServer::initialize(bool inetd_mode)
@@ -288,52 +411,14 @@ void SocketServer::initialize(bool inetd_mode)
     open_standalone();
 }
 
-void SocketServer::add_fd_to_epoll(int fd, uint32_t events)
-{
-  DoutEntering(dc::notice, "SocketServer::add_fd_to_epoll(" << fd << ", " << events << ")");
-
-  if (!epoll_fd_.valid())
-    throw std::system_error(EINVAL, std::generic_category(), "epoll instance is not initialized");
-
-  epoll_event event{};
-  event.events = events;
-  event.data.fd = fd;
-  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, fd, &event) != 0)
-    throw std::system_error(errno, std::generic_category(), "epoll_ctl(ADD) failed");
-}
-
-void SocketServer::remove_fd_from_epoll(int fd)
-{
-  DoutEntering(dc::notice, "SocketServer::remove_fd_from_epoll(" << fd << ")");
-
-  if (!epoll_fd_.valid())
-    return;
-
-  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fd, nullptr) == 0)
-    return;
-  if (errno == ENOENT || errno == EBADF)
-    return;
-  throw std::system_error(errno, std::generic_category(), "epoll_ctl(DEL) failed");
-}
-
-void SocketServer::add_client(int client_fd)
-{
-  DoutEntering(dc::notice, "SocketServer::add_client(" << client_fd << ")");
-
-  std::unique_ptr<SocketClient> client = create_client(client_fd);
-  add_fd_to_epoll(client_fd, EPOLLIN | EPOLLRDHUP);
-  Dout(dc::notice, "Adding client with fd " << client->fd() << " to clients_.");
-  clients_.emplace(client->fd(), std::move(client));
-}
-
-std::unique_ptr<SocketClient> SocketServer::create_client(int client_fd)
+std::unique_ptr<SocketClient> SocketServer::create_client(Reactor& reactor, int client_fd)
 {
   DoutEntering(dc::notice, "SocketServer::create_client(" << client_fd << ")");
 
   if (!client_factory_)
     throw std::system_error(EINVAL, std::generic_category(), "client factory is not configured");
 
-  std::unique_ptr<SocketClient> client = client_factory_(*this, client_fd);
+  std::unique_ptr<SocketClient> client = client_factory_(reactor, client_fd);
   if (!client)
     throw std::system_error(EINVAL, std::generic_category(), "client factory returned null");
 
@@ -343,28 +428,30 @@ std::unique_ptr<SocketClient> SocketServer::create_client(int client_fd)
   return client;
 }
 
-void SocketServer::remove_client(int client_fd)
+bool SocketServer::try_reserve_client()
 {
-  DoutEntering(dc::notice, "SocketServer::remove_client(" << client_fd << ")");
-  auto const iter = clients_.find(client_fd);
-  if (iter == clients_.end())
-    return;
-
-  remove_fd_from_epoll(client_fd);
-  Dout(dc::notice, "Erasing client with fd " << client_fd << " from clients_.");
-  clients_.erase(iter);
+  unsigned int const max_clients = Application::instance().max_clients();
+  unsigned int number_of_clients = number_of_clients_.load(std::memory_order_relaxed);
+  do
+  {
+    if (number_of_clients >= max_clients)
+      return false;
+  }
+  while (!number_of_clients_.compare_exchange_weak(number_of_clients, number_of_clients + 1, std::memory_order_relaxed));
+  return true;
 }
 
-void SocketServer::accept_new_clients()
+void SocketServer::drain_termination_fd(int terminate_fd)
 {
+  char buffer[128];
   for (;;)
   {
-    int const client_fd = accept4(listener_fd_.get(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
-    if (client_fd >= 0)
-    {
-      add_client(client_fd);
+    ssize_t const read_ret = read(terminate_fd, buffer, sizeof(buffer));
+    if (read_ret > 0)
       continue;
-    }
+
+    if (read_ret == 0)
+      return;
 
     if (errno == EINTR)
       continue;
@@ -372,43 +459,172 @@ void SocketServer::accept_new_clients()
     if (errno == EAGAIN || errno == EWOULDBLOCK)
       return;
 
-    throw std::system_error(errno, std::generic_category(), "accept4 failed");
+    throw std::system_error(errno, std::generic_category(), "read(terminate_fd) failed");
   }
 }
 
-void SocketServer::handle_client_readable(int client_fd)
+ScopedFd SocketServer::take_stored_fd(std::string_view name)
 {
-  //DoutEntering(dc::notice, "SocketServer::handle_client_readable(" << client_fd << ")");
-
-  auto iter = clients_.find(client_fd);
-  if (iter == clients_.end())
-    return;
+  auto const stored_fd = std::find_if(stored_fds_.begin(), stored_fds_.end(), [name](StoredFd const& stored_fd){ return stored_fd.name_ == name; });
+  if (stored_fd == stored_fds_.end())
+    return {};
+
+  ScopedFd fd = std::move(stored_fd->fd_);
+  stored_fds_.erase(stored_fd);
+  // We own it now; the next instance gets whatever we store on exit.
+  ServiceNotifier::remove_stored_fd(name);
+  return fd;
+}
 
-  bool const keep_client = iter->second->handle_readable();
-  if (!keep_client)
-    remove_client(client_fd);
+void SocketServer::discard_stored_fds()
+{
+  for (StoredFd const& stored_fd : stored_fds_)
+  {
+    Dout(dc::notice, "Discarding stored fd '" << stored_fd.name_ << "'.");
+    ServiceNotifier::remove_stored_fd(stored_fd.name_);
+  }
+  stored_fds_.clear();
 }
 
-void SocketServer::drain_termination_fd(int terminate_fd)
+void SocketServer::hand_over(std::vector<std::unique_ptr<Reactor>> const& reactors)
 {
-  char buffer[128];
-  for (;;)
+  DoutEntering(dc::notice, "SocketServer::hand_over()");
+
+  std::vector<SocketClient::HandoverState> states;
+  for (std::unique_ptr<Reactor> const& reactor : reactors)
+    reactor->release_clients_for_handover(states);
+
+  // Our copies of the fds are closed when `states` is destroyed; the FD store keeps the connections open.
+  std::string records;
+  uint32_t number_of_stored_clients = 0;
+  for (SocketClient::HandoverState const& state : states)
   {
-    ssize_t const read_ret = read(terminate_fd, buffer, sizeof(buffer));
-    if (read_ret > 0)
+    if (!ServiceNotifier::store_fd(std::string(stored_client_name_prefix_c) + std::to_string(number_of_stored_clients), state.fd_.get()))
       continue;
+    append_u32(records, number_of_stored_clients++);
+    append_string(records, listeners_[state.listener_index_].name_);
+    append_u32(records, state.saw_carriage_return_);
+    append_string(records, state.partial_message_);
+    append_string(records, state.input_);
+    append_string(records, state.output_);
+  }
 
-    if (read_ret == 0)
-      return;
+  if (number_of_stored_clients > 0)
+  {
+    std::string header;
+    append_u32(header, clients_state_magic_c);
+    append_u32(header, number_of_stored_clients);
+    ScopedFd const memfd(memfd_create("remountd-clients", MFD_CLOEXEC));
+    if (!memfd.valid())
+      throw std::system_error(errno, std::generic_category(), "memfd_create failed");
+    if (write(memfd.get(), header.data(), header.size()) != static_cast<ssize_t>(header.size()) ||
+        write(memfd.get(), records.data(), records.size()) != static_cast<ssize_t>(records.size()))
+      throw std::system_error(errno, std::generic_category(), "write(memfd) failed");
+    ServiceNotifier::store_fd(stored_clients_name_c, memfd.get());
+  }
 
-    if (errno == EINTR)
+  // The next instance continues on the same socket file.
+  if (mode_ == Mode::k_standalone && ServiceNotifier::store_fd(stored_listener_name_c, listeners_[0].fd_.get()))
+    unlink_on_cleanup_ = false;
+
+  syslog(LOG_INFO, "Handed over %u of %zu connection(s) to the next instance.", number_of_stored_clients, states.size());
+}
+
+void SocketServer::adopt_clients(std::vector<std::unique_ptr<Reactor>> const& reactors)
+{
+  ScopedFd const memfd = take_stored_fd(stored_clients_name_c);
+  if (!memfd.valid())
+    return;
+
+  DoutEntering(dc::notice, "SocketServer::adopt_clients()");
+
+  struct stat memfd_stat;
+  if (fstat(memfd.get(), &memfd_stat) != 0)
+    throw std::system_error(errno, std::generic_category(), "fstat(memfd) failed");
+  std::string data(static_cast<std::size_t>(memfd_stat.st_size), '\0');
+  if (pread(memfd.get(), data.data(), data.size(), 0) != static_cast<ssize_t>(data.size()))
+    throw std::system_error(errno, std::generic_category(), "pread(memfd) failed");
+
+  ClientsStateReader reader(data);
+  if (reader.u32() != clients_state_magic_c)
+  {
+    syslog(LOG_WARNING, "Ignoring the handed over connections: unknown format.");
+    return;
+  }
+
+  uint32_t const number_of_stored_clients = reader.u32();
+  unsigned int adopted = 0;
+  for (uint32_t i = 0; i < number_of_stored_clients; ++i)
+  {
+    uint32_t const number = reader.u32();
+    std::string_view const listener_name = reader.string();
+    bool const saw_carriage_return = reader.u32() != 0;
+    std::string_view const partial_message = reader.string();
+    std::string_view const input = reader.string();
+    std::string_view const output = reader.string();
+    if (!reader.ok())
+    {
+      syslog(LOG_WARNING, "The state of the handed over connections is truncated.");
+      break;
+    }
+
+    // Connections to a socket that this instance no longer listens on are closed.
+    ScopedFd fd = take_stored_fd(std::string(stored_client_name_prefix_c) + std::to_string(number));
+    auto const listener = std::find_if(listeners_.begin(), listeners_.end(), [listener_name](Listener const& listener){ return listener.name_ == listener_name; });
+    if (!fd.valid() || listener == listeners_.end())
       continue;
 
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
-      return;
+    reactors[adopted++ % reactors.size()]->adopt_client({
+      .fd_ = std::move(fd),
+      .listener_index_ = static_cast<int>(listener - listeners_.begin()),
+      .partial_message_ = std::string(partial_message),
+      .input_ = std::string(input),
+      .output_ = std::string(output),
+      .saw_carriage_return_ = saw_carriage_return
+    });
+  }
 
-    throw std::system_error(errno, std::generic_category(), "read(terminate_fd) failed");
+  syslog(LOG_INFO, "Continuing %u connection(s) of the previous instance.", adopted);
+}
+
+void SocketServer::arm_exit_timer(bool arm)
+{
+  std::chrono::seconds const timeout{arm ? Application::instance().exit_on_idle_seconds() : 0};
+  itimerspec const spec{ .it_interval = {}, .it_value = { .tv_sec = timeout.count(), .tv_nsec = 0 } };
+  if (timerfd_settime(exit_timer_fd_.get(), 0, &spec, nullptr) != 0)
+    throw std::system_error(errno, std::generic_category(), "timerfd_settime failed");
+}
+
+void SocketServer::reactor_busy(bool busy)
+{
+  // Races between reactors that become busy and idle at the same time can leave the timer armed while a reactor is busy;
+  // that is harmless because handle_exit_timer checks again.
+  if (busy)
+  {
+    if (number_of_busy_reactors_.fetch_add(1, std::memory_order_relaxed) == 0)
+      arm_exit_timer(false);
   }
+  else if (number_of_busy_reactors_.fetch_sub(1, std::memory_order_relaxed) == 1)
+    arm_exit_timer(true);
+}
+
+void SocketServer::handle_exit_timer()
+{
+  uint64_t expirations;
+  if (read(exit_timer_fd_.get(), &expirations, sizeof(expirations)) != sizeof(expirations))
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
+    throw std::system_error(errno, std::generic_category(), "read(timerfd) failed");
+  }
+
+  if (number_of_busy_reactors_.load(std::memory_order_relaxed) != 0)
+    return;
+
+  // Connections that arrive from now on wait in the listen backlog of the socket, which systemd keeps open;
+  // it starts a new instance for them.
+  syslog(LOG_INFO, "No clients for %u seconds; exiting until the next connection.", Application::instance().exit_on_idle_seconds());
+  Application::instance().quit();
 }
 
 void SocketServer::set_client_factory(client_factory_type client_factory)
@@ -426,74 +642,104 @@ void SocketServer::mainloop(int terminate_fd)
   if (terminate_fd < 0)
     throw std::system_error(EINVAL, std::generic_category(), "invalid terminate fd");
 
-  if (epoll_fd_.valid())
+  if (running_)
     throw std::system_error(EALREADY, std::generic_category(), "mainloop already running");
 
-  epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
-  if (!epoll_fd_.valid())
-    throw std::system_error(errno, std::generic_category(), "epoll_create1 failed");
-
-  struct epoll_reset_guard
+  struct running_reset_guard
   {
-    ScopedFd& epoll_fd_;
+    bool& running_;
 
-    ~epoll_reset_guard()
+    ~running_reset_guard()
     {
-      epoll_fd_.reset();
+      running_ = false;
     }
-  } const reset_guard {epoll_fd_};
-
-  add_fd_to_epoll(terminate_fd, EPOLLIN);
+  } const reset_guard {running_};
+  running_ = true;
 
   if (mode_ == Mode::k_inetd)
   {
-    int const client_fd = listener_fd_.release();
+    // A single reactor serves the one already connected client and returns when it is gone.
+    Reactor reactor(*this, 0, terminate_fd, {});
+    int const client_fd = listeners_[0].fd_.release();
     close_listener_on_cleanup_ = true;
-    add_client(client_fd);
+    reactor.add_client(client_fd, 0);
+    reactor.run();
+    return;
   }
-  else
-    add_fd_to_epoll(listener_fd_.get(), EPOLLIN);
 
-  epoll_event events[32];
-  for (;;)
+  unsigned int const number_of_reactors = Application::instance().reactor_threads();
+  Dout(dc::notice, "Starting " << number_of_reactors << " reactor(s).");
+
+  // Every reactor serves all listeners.
+  std::vector<int> listener_fds;
+  for (Listener const& listener : listeners_)
+    listener_fds.push_back(listener.fd_.get());
+
+  // Only a socket-activated daemon can exit on idle: systemd starts it again on the next connection.
+  bool const exit_on_idle = mode_ == Mode::k_systemd && Application::instance().exit_on_idle_seconds() > 0;
+  if (exit_on_idle)
   {
-    int const event_count = epoll_wait(epoll_fd_.get(), events, 32, -1);
-    if (event_count < 0)
+    exit_timer_fd_.reset(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (!exit_timer_fd_.valid())
+      throw std::system_error(errno, std::generic_category(), "timerfd_create failed");
+    number_of_busy_reactors_ = 0;
+  }
+
+  // All reactors are created up front so that any setup error is reported before threads are started.
+  service_notifier_.initialize(number_of_reactors);
+  hand_over_on_exit_ = service_notifier_.enabled();
+  std::vector<std::unique_ptr<Reactor>> reactors;
+  for (unsigned int index = 0; index < number_of_reactors; ++index)
+    reactors.push_back(std::make_unique<Reactor>(*this, index, terminate_fd, listener_fds));
+  adopt_clients(reactors);
+  discard_stored_fds();
+  service_notifier_.ready();
+
+  // The reactors start out idle.
+  if (exit_on_idle)
+    arm_exit_timer(true);
+
+  // The first reactor that fails stores its exception and wakes up all others through the termination fd.
+  std::mutex first_error_mutex;
+  std::exception_ptr first_error;
+  auto run_reactor = [&](Reactor& reactor)
+  {
+    try
     {
-      if (errno == EINTR)
-        continue;
-      throw std::system_error(errno, std::generic_category(), "epoll_wait failed");
+      reactor.run();
     }
-
-    for (int i = 0; i < event_count; ++i)
+    catch (...)
     {
-      int const fd = events[i].data.fd;
-      uint32_t const epoll_events = events[i].events;
-
-      if (fd == terminate_fd)
-      {
-        drain_termination_fd(terminate_fd);
-        return;
-      }
-
-      if (mode_ != Mode::k_inetd && fd == listener_fd_.get())
-      {
-        if ((epoll_events & EPOLLIN) != 0)
-          accept_new_clients();
-        continue;
-      }
-
-      if ((epoll_events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0)
       {
-        remove_client(fd);
+        std::lock_guard<std::mutex> lock(first_error_mutex);
+        if (!first_error)
+          first_error = std::current_exception();
       }
-      else if ((epoll_events & EPOLLIN) != 0)
-        handle_client_readable(fd);
+      Application::instance().quit();
     }
+  };
 
-    if (mode_ == Mode::k_inetd && clients_.empty())
-      return;
-  }
+  {
+    std::vector<std::jthread> threads;
+    for (unsigned int index = 1; index < number_of_reactors; ++index)
+      threads.emplace_back(
+          [&run_reactor, &reactor = *reactors[index]]()
+          {
+            Debug(NAMESPACE_DEBUG::init_thread("Reactor" + std::to_string(reactor.index())));
+            run_reactor(reactor);
+          });
+    run_reactor(*reactors[0]);
+  } // Join all reactor threads.
+
+  if (hand_over_on_exit_ && !first_error)
+    hand_over(reactors);
+  service_notifier_.stopping();
+  exit_timer_fd_.reset();
+
+  drain_termination_fd(terminate_fd);
+
+  if (first_error)
+    std::rethrow_exception(first_error);
 }
 
 } // namespace remountd
@@ -1,7 +1,9 @@
 #pragma once
 
+#include "ServiceNotifier.h"
 #include "SocketClient.h"
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
@@ -9,22 +11,59 @@
 #include <memory>
 #include <string>
 #include <string_view>
-#include <unordered_map>
+#include <vector>
 
 namespace remountd {
 
+class Reactor;
+
 // SocketServer
 //
 // Encapsulates socket setup and runtime I/O multiplexing for remountd.
 // The server supports inetd mode (already connected socket) and listener
-// mode (standalone or systemd-activated listening socket). Runtime I/O
-// is handled by mainloop() using a single epoll instance.
+// mode (standalone listening socket, or one or more systemd-activated
+// listening sockets identified by their FileDescriptorName=). Runtime I/O
+// is handled by mainloop() using one or more Reactor's, each running
+// its own epoll instance on its own thread.
+//
+// When running under systemd, a restart does not drop the connections:
+// on termination every connection that has no request in flight is passed
+// to the FD store of the service, together with a memfd that describes
+// its unprocessed input and output (hand_over), and the next instance
+// continues them (adopt_clients). A standalone listener is passed on too,
+// so that no connection attempt fails during the restart.
 class SocketServer
 {
  public:
-  using client_factory_type = std::function<std::unique_ptr<SocketClient>(SocketServer&, int)>;   // Creates one client object for an accepted fd.
+  using client_factory_type = std::function<std::unique_ptr<SocketClient>(Reactor&, int)>;        // Creates one client object for an accepted fd.
+  using reactor_start_type = std::function<void(Reactor&)>;                                       // Starts the coroutines of the application on a reactor.
 
  public:
+  // Listener
+  //
+  // One listening socket (or, in inetd mode, the connected socket).
+  struct Listener
+  {
+    ScopedFd fd_;                       // The socket.
+    std::string name_;                  // FileDescriptorName= of a systemd-activated socket, otherwise empty.
+    bool abstract_ = false;             // True if the socket is bound in the abstract namespace (it has no file permissions).
+  };
+
+  // StoredFd
+  //
+  // A file descriptor that a previous instance handed to the systemd FD store.
+  struct StoredFd
+  {
+    ScopedFd fd_;                       // The file descriptor.
+    std::string name_;                  // Its FDNAME=, starting with stored_fd_prefix_c.
+  };
+
+  // Names of fds in the FD store start with this, to tell them apart from the FileDescriptorName= of sockets.
+  static constexpr std::string_view stored_fd_prefix_c = "state.";
+  static constexpr std::string_view stored_listener_name_c = "state.listener";          // The standalone listener.
+  static constexpr std::string_view stored_clients_name_c = "state.clients";            // memfd with the HandoverState of the stored connections.
+  static constexpr std::string_view stored_client_name_prefix_c = "state.client.";      // Followed by the number of the connection in the state.clients memfd.
+
   // Runtime mode selected during initialization.
   enum class Mode
   {
@@ -35,14 +74,20 @@ class SocketServer
   };
 
  private:
-  ScopedFd listener_fd_;                                                // Listener socket (or connected inetd socket) initialized by initialize().
-  ScopedFd epoll_fd_;                                                   // epoll instance used by mainloop.
+  std::vector<Listener> listeners_;                                     // Listener sockets (or connected inetd socket) initialized by initialize().
+  std::vector<StoredFd> stored_fds_;                                    // Fds passed back from the FD store that were not taken yet.
+  bool running_ = false;                                                // True while mainloop() is running.
   Mode mode_ = Mode::k_none;                                            // Active socket server mode.
-  bool close_listener_on_cleanup_ = true;                               // Close listener_fd_ when cleanup() is called.
+  bool close_listener_on_cleanup_ = true;                               // Close listeners_ when cleanup() is called.
   std::filesystem::path standalone_socket_path_;                        // Path to standalone socket file for cleanup.
   bool unlink_on_cleanup_ = false;                                      // Remove standalone_socket_path_ during cleanup().
   client_factory_type client_factory_;                                  // Factory that creates concrete SocketClient instances for accepted fds.
-  std::unordered_map<int, std::unique_ptr<SocketClient>> clients_;      // Active clients keyed by file descriptor.
+  reactor_start_type reactor_start_;                                    // Called by every reactor before it enters its event loop, or empty.
+  std::atomic<unsigned int> number_of_clients_ = 0;                     // Number of connected clients, over all reactors.
+  ServiceNotifier service_notifier_;                                    // Readiness, watchdog and status notifications to systemd.
+  ScopedFd exit_timer_fd_;                                              // timerfd that expires Application::exit_on_idle_seconds() after the last reactor became idle.
+  std::atomic<unsigned int> number_of_busy_reactors_ = 0;               // Number of reactors with clients or running requests.
+  bool hand_over_on_exit_ = false;                                      // True if the connections are passed to the FD store when the mainloop ends.
 
  private:
   // Release all runtime resources and restore default state.
@@ -54,7 +99,7 @@ class SocketServer
   // Configure inetd mode using stdin as connected client socket.
   void open_inetd();
 
-  // Configure systemd socket activation; returns false if no activation socket exists.
+  // Configure systemd socket activation of one or more named sockets; returns false if no activation socket exists.
   bool open_systemd();
 
   // Configure standalone listening socket from Application configuration.
@@ -66,26 +111,17 @@ class SocketServer
   // Initialize socket mode and base listener file descriptor.
   void initialize(bool inetd_mode);
 
-  // Add `fd` to epoll with given event mask.
-  void add_fd_to_epoll(int fd, uint32_t events);
-
-  // Remove `fd` from epoll.
-  void remove_fd_from_epoll(int fd);
-
-  // Accept all currently pending connections from listener_fd_.
-  void accept_new_clients();
-
-  // Register a newly accepted client with epoll and client map.
-  void add_client(int client_fd);
+  // Start (or stop) the countdown to exiting on idle.
+  void arm_exit_timer(bool arm);
 
-  // Construct one concrete client object for the given connected fd.
-  std::unique_ptr<SocketClient> create_client(int client_fd);
+  // Pass the connections of `reactors` (and a standalone listener) to the systemd FD store, for the next instance.
+  void hand_over(std::vector<std::unique_ptr<Reactor>> const& reactors);
 
-  // Disconnect client and erase it from client map.
-  void remove_client(int client_fd);
+  // Continue the connections that a previous instance handed over, distributing them over `reactors`.
+  void adopt_clients(std::vector<std::unique_ptr<Reactor>> const& reactors);
 
-  // Invoke readable handler for a client and remove it if connection is closed.
-  void handle_client_readable(int client_fd);
+  // Close the stored fds that nobody took, and remove them from the FD store.
+  void discard_stored_fds();
 
   // Drain all bytes currently available from termination fd.
   void drain_termination_fd(int terminate_fd);
@@ -103,14 +139,48 @@ class SocketServer
   // Set or replace the concrete client factory.
   void set_client_factory(client_factory_type client_factory);
 
-  // Run epoll loop until termination fd becomes readable.
+  // Set the function that every reactor calls, on its own thread, right before it enters its event loop.
+  void set_reactor_start(reactor_start_type reactor_start) { reactor_start_ = std::move(reactor_start); }
+
+  // Called by `reactor` when it starts running.
+  void start_reactor(Reactor& reactor) { if (reactor_start_) reactor_start_(reactor); }
+
+  // Construct one concrete client object for the given connected fd, owned by `reactor`.
+  std::unique_ptr<SocketClient> create_client(Reactor& reactor, int client_fd);
+
+  // Account for one more connected client; returns false when Application::max_clients() clients are already connected.
+  bool try_reserve_client();
+
+  // Account for a client that disconnected.
+  void release_client() { number_of_clients_.fetch_sub(1, std::memory_order_relaxed); }
+
+  // Run Application::reactor_threads() epoll loops until termination fd becomes readable.
   void mainloop(int terminate_fd);
 
+  // Return the fd that a previous instance stored as `name`, removing it from the FD store; invalid if there is none.
+  ScopedFd take_stored_fd(std::string_view name);
+
+  // Return true if the reactors should prepare their connections for hand_over when termination is requested.
+  bool hand_over_on_exit() const { return hand_over_on_exit_; }
+
+  // Return the timerfd that reactor 0 watches to exit on idle, or -1 if the daemon does not exit on idle.
+  int exit_timer_fd() const { return exit_timer_fd_.get(); }
+
+  // Called by a reactor when it gets its first client or request (busy) or finished its last one (not busy).
+  void reactor_busy(bool busy);
+
+  // Called by reactor 0 when exit_timer_fd() expires: quit if all reactors are still idle.
+  void handle_exit_timer();
+
+  // Return the systemd notifier; reactors drive its heartbeat.
+  ServiceNotifier& service_notifier() { return service_notifier_; }
+
   // Return current mode.
   Mode mode() const { return mode_; }
 
-  // Return listener or inetd-connected FD used at initialization.
-  int listener_fd() const { return listener_fd_.get(); }
+  // Return the listeners (or the inetd-connected socket) opened at initialization.
+  // The index in this vector is what SocketClient::listener_index() refers to.
+  std::vector<Listener> const& listeners() const { return listeners_; }
 };
 
 } // namespace remountd
@@ -0,0 +1,173 @@
+#include "sys.h"
+#include "StatePage.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <system_error>
+
+#include "debug.h"
+
+namespace remountd {
+namespace {
+
+// Wake all readers that wait for a change of `generation`.
+void wake_waiters(std::atomic<uint32_t>& generation)
+{
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&generation), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Copy `text` to the zero-terminated character array `out` of `size` bytes; `text` must fit.
+void copy_string(char* out, std::size_t size, std::string_view text)
+{
+  std::fill(std::copy(text.begin(), text.end(), out), out + size, '\0');
+}
+
+} // namespace
+
+StatePage::StatePage(std::filesystem::path const& path) : path_(path)
+{
+  DoutEntering(dc::notice, "StatePage::StatePage(" << path << ")");
+
+  std::filesystem::path const directory = path_.parent_path();
+  if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+    throw std::system_error(errno, std::generic_category(), "mkdir('" + directory.native() + "') failed");
+
+  // Prepare the new file next to the old one, and only replace that once it is complete.
+  std::filesystem::path new_path = path_;
+  new_path += ".new";
+  unlink(new_path.c_str());
+  fd_.reset(open(new_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+  if (!fd_.valid())
+    throw std::system_error(errno, std::generic_category(), "open('" + new_path.native() + "') failed");
+
+  if (fchmod(fd_.get(), 0644) != 0 || ftruncate(fd_.get(), file_size_c) != 0)
+  {
+    int const err = errno;
+    unlink(new_path.c_str());
+    throw std::system_error(err, std::generic_category(), "failed to initialize '" + new_path.native() + "'");
+  }
+
+  void* const mapping = mmap(nullptr, file_size_c, PROT_READ | PROT_WRITE, MAP_SHARED, fd_.get(), 0);
+  if (mapping == MAP_FAILED)
+  {
+    int const err = errno;
+    unlink(new_path.c_str());
+    throw std::system_error(err, std::generic_category(), "mmap('" + new_path.native() + "') failed");
+  }
+
+  header_ = static_cast<Header*>(mapping);
+  entries_ = reinterpret_cast<Entry*>(header_ + 1);
+  header_->magic_ = magic_c;
+  header_->version_ = version_c;
+  header_->capacity_ = capacity_c;
+  header_->entry_size_ = sizeof(Entry);
+
+  inherit_entries();
+
+  if (rename(new_path.c_str(), path_.c_str()) != 0)
+  {
+    int const err = errno;
+    unlink(new_path.c_str());
+    munmap(header_, file_size_c);
+    throw std::system_error(err, std::generic_category(), "rename('" + new_path.native() + "') failed");
+  }
+}
+
+StatePage::~StatePage()
+{
+  // Tell the readers to open the file of the next instance.
+  header_->closed_.store(1, std::memory_order_release);
+  header_->generation_.fetch_add(1, std::memory_order_release);
+  wake_waiters(header_->generation_);
+  munmap(header_, file_size_c);
+}
+
+void StatePage::inherit_entries()
+{
+  ScopedFd const old_fd(open(path_.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat st;
+  if (!old_fd.valid() || fstat(old_fd.get(), &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(Header))
+    return;
+
+  void* const mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, old_fd.get(), 0);
+  if (mapping == MAP_FAILED)
+    return;
+
+  Header const* const old_header = static_cast<Header const*>(mapping);
+  Entry const* const old_entries = reinterpret_cast<Entry const*>(old_header + 1);
+  std::size_t const old_capacity = (st.st_size - sizeof(Header)) / sizeof(Entry);
+  if (old_header->magic_ == magic_c && old_header->version_ == version_c && old_header->entry_size_ == sizeof(Entry))
+  {
+    // The previous instance is normally gone by now, but read it like any reader would.
+    uint32_t sequence;
+    uint32_t count;
+    do
+    {
+      sequence = old_header->sequence_.load(std::memory_order_acquire);
+      count = std::min<uint32_t>({old_header->count_, capacity_c, static_cast<uint32_t>(old_capacity)});
+      std::memcpy(entries_, old_entries, count * sizeof(Entry));
+      header_->generation_.store(old_header->generation_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    while ((sequence & 1) || sequence != old_header->sequence_.load(std::memory_order_relaxed));
+
+    for (uint32_t index = 0; index < count; ++index)
+    {
+      entries_[index].name_[name_size_c - 1] = '\0';
+      entries_[index].path_[path_size_c - 1] = '\0';
+    }
+    header_->count_ = count;
+  }
+
+  munmap(mapping, st.st_size);
+}
+
+void StatePage::publish(std::string_view name, uint64_t mount_namespace, std::string_view path, bool read_only)
+{
+  if (name.size() >= name_size_c || path.size() >= path_size_c)
+    return;
+
+  std::lock_guard<std::mutex> const lock(mutex_);
+
+  // Find the entry of this mount point, or else a free entry, or else the one that was changed longest ago.
+  uint32_t const count = header_->count_;
+  uint32_t index = 0;
+  while (index < count &&
+      !(entries_[index].mount_namespace_ == mount_namespace && entries_[index].name_ == name && entries_[index].path_ == path))
+    ++index;
+  uint32_t const generation = header_->generation_.load(std::memory_order_relaxed) + 1;
+  bool const unchanged = index < count && entries_[index].read_only_ == (read_only ? 1U : 0U);
+  if (unchanged)
+    return;
+  if (index == count && count == capacity_c)
+    index = std::min_element(entries_, entries_ + count,
+        [](Entry const& lhs, Entry const& rhs){ return lhs.generation_ < rhs.generation_; }) - entries_;
+
+  uint32_t const sequence = header_->sequence_.load(std::memory_order_relaxed);
+  header_->sequence_.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  Entry& entry = entries_[index];
+  entry.mount_namespace_ = mount_namespace;
+  entry.generation_ = generation;
+  entry.read_only_ = read_only ? 1 : 0;
+  copy_string(entry.name_, name_size_c, name);
+  copy_string(entry.path_, path_size_c, path);
+  if (index == count)
+    header_->count_ = count + 1;
+
+  header_->sequence_.store(sequence + 2, std::memory_order_release);
+  header_->generation_.store(generation, std::memory_order_release);
+  wake_waiters(header_->generation_);
+}
+
+} // namespace remountd
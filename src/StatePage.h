@@ -0,0 +1,111 @@
+#pragma once
+
+#include "ScopedFd.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string_view>
+
+namespace remountd {
+
+// StatePage
+//
+// The ro/rw state of the mount points that remountd remounted, published in
+// a memory-mapped file (Application::state_file(), on tmpfs) so that
+// supervisors can check it with plain memory loads instead of connecting.
+//
+// The file consists of a Header followed by Header::capacity_ Entry records,
+// of which the first Header::count_ are in use. Every successful remount
+// updates (or adds) the entry of its (name, mount namespace, path), evicting
+// the least recently changed entry if the table is full.
+//
+// The table is protected by a seqlock. A reader does:
+//
+//   do
+//   {
+//     s1 = atomic load-acquire of header->sequence_;
+//     copy what it needs;
+//     atomic thread fence (acquire);
+//     s2 = atomic load of header->sequence_;
+//   }
+//   while ((s1 & 1) || s1 != s2);
+//
+// Header::generation_ is incremented after every change; a reader can wait
+// for the next one with futex(&header->generation_, FUTEX_WAIT, seen, ...)
+// (a shared futex: do not use FUTEX_PRIVATE_FLAG). When the daemon stops
+// updating a file it sets Header::closed_ and wakes the waiters; the next
+// instance continues with the entries of the old file in a new file at the
+// same path, so readers should then open the path again.
+//
+// Writes from several reactors are serialized with a mutex; they only
+// happen once per successful remount.
+class StatePage
+{
+ public:
+  static constexpr uint32_t magic_c = 0x54534d52;                       // "RMST" in little endian.
+  static constexpr uint32_t version_c = 1;
+  static constexpr uint32_t capacity_c = 1024;                          // Number of entries in the file.
+  static constexpr std::size_t name_size_c = 64;                        // Size of Entry::name_, including the terminating zero.
+  static constexpr std::size_t path_size_c = 944;                       // Size of Entry::path_, including the terminating zero.
+
+  // Header
+  //
+  // The start of the file.
+  struct Header
+  {
+    uint32_t magic_;                            // magic_c.
+    uint32_t version_;                          // version_c.
+    std::atomic<uint32_t> sequence_;            // The seqlock: odd while the table is being changed.
+    std::atomic<uint32_t> generation_;          // Incremented after every change (futex word).
+    uint32_t capacity_;                         // Number of Entry records after the header.
+    uint32_t count_;                            // Number of entries in use.
+    uint32_t entry_size_;                       // sizeof(Entry).
+    std::atomic<uint32_t> closed_;              // Non-zero once the daemon stopped updating this file.
+  };
+
+  // Entry
+  //
+  // The state of one mount point.
+  struct Entry
+  {
+    uint64_t mount_namespace_;                  // Inode number of the mount namespace (as in /proc/<pid>/ns/mnt), or 0 if unknown.
+    uint32_t generation_;                       // Header::generation_ after the last change of this entry.
+    uint32_t read_only_;                        // 1 if the last remount made it read-only, 0 if read-write.
+    char name_[name_size_c];                    // Zero-terminated name of the allow-entry.
+    char path_[path_size_c];                    // Zero-terminated path that was remounted.
+  };
+
+  static_assert(std::atomic<uint32_t>::is_always_lock_free && sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+  static_assert(sizeof(Header) == 32 && sizeof(Entry) == 1024);
+
+  static constexpr std::size_t file_size_c = sizeof(Header) + capacity_c * sizeof(Entry);
+
+ private:
+  std::filesystem::path path_;                  // Where the file is published.
+  ScopedFd fd_;                                 // The file.
+  Header* header_ = nullptr;                    // The shared mapping of the file.
+  Entry* entries_ = nullptr;                    // The entries, right after header_.
+  std::mutex mutex_;                            // Serializes writers.
+
+  // Copy the entries of the file of a previous instance at path_, if any.
+  void inherit_entries();
+
+ public:
+  // Create the file at `path`. Throws on failure.
+  explicit StatePage(std::filesystem::path const& path);
+
+  // Mark the file closed and unmap it. The file is left in place for the next instance.
+  ~StatePage();
+
+  StatePage(StatePage const&) = delete;
+  StatePage& operator=(StatePage const&) = delete;
+
+  // Record that `path` of allow-entry `name` was remounted read-only (or read-write) in mount namespace `mount_namespace`.
+  // Names and paths that do not fit in an Entry are not published.
+  void publish(std::string_view name, uint64_t mount_namespace, std::string_view path, bool read_only);
+};
+
+} // namespace remountd
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "FramePool.h"
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace remountd {
+
+// PooledFrame
+//
+// Base class of all promise types: coroutine frames are allocated from the FramePool of the running thread.
+struct PooledFrame
+{
+  static void* operator new(std::size_t size) { return FramePool::allocate(size); }
+  static void operator delete(void* frame, std::size_t size) noexcept { FramePool::deallocate(frame, size); }
+};
+
+// DetachedTask
+//
+// Return type of a root coroutine that is started by the event loop and not awaited by anyone.
+//
+// The coroutine runs eagerly until its first suspension point and destroys
+// its own frame when it finishes. While it exists its promise is linked into
+// the DetachedTask::Registry of the Reactor thread that created it; the
+// Reactor destroys all still suspended root coroutines when it is destroyed.
+// Destroying a root destroys the Task<T> temporaries it is awaiting, and the
+// awaiters in those frames unregister themselves from the Reactor.
+//
+// An exception that escapes the coroutine body propagates to whoever resumed
+// it (the Reactor, or the caller for the part before the first suspension).
+class DetachedTask
+{
+ public:
+  class Registry;
+
+  struct promise_type : PooledFrame
+  {
+    Registry* registry_;                        // The registry this coroutine is linked into, or nullptr.
+    promise_type* prev_ = nullptr;              // Previous root in registry_.
+    promise_type* next_ = nullptr;              // Next root in registry_.
+
+    promise_type();
+    ~promise_type();
+
+    DetachedTask get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept { }
+    void unhandled_exception() { throw; }
+  };
+
+  // Registry
+  //
+  // Intrusive list of the root coroutines of one Reactor.
+  class Registry
+  {
+   private:
+    friend struct promise_type;
+    static inline thread_local Registry* s_current_ = nullptr;  // Registry that new root coroutines of this thread are linked into.
+    promise_type* head_ = nullptr;                              // First linked root coroutine.
+
+   public:
+    // Make this registry the one that new root coroutines of the calling thread are linked into.
+    void make_current() { s_current_ = this; }
+
+    // Destroy all linked (suspended) root coroutines.
+    void destroy_all()
+    {
+      while (head_)
+        std::coroutine_handle<promise_type>::from_promise(*head_).destroy();
+      if (s_current_ == this)
+        s_current_ = nullptr;
+    }
+
+    // Return true if no root coroutine is linked.
+    bool empty() const { return head_ == nullptr; }
+  };
+};
+
+inline DetachedTask::promise_type::promise_type() : registry_(Registry::s_current_)
+{
+  if (!registry_)
+    return;
+  next_ = registry_->head_;
+  if (next_)
+    next_->prev_ = this;
+  registry_->head_ = this;
+}
+
+inline DetachedTask::promise_type::~promise_type()
+{
+  if (!registry_)
+    return;
+  if (prev_)
+    prev_->next_ = next_;
+  else
+    registry_->head_ = next_;
+  if (next_)
+    next_->prev_ = prev_;
+}
+
+// Task<T>
+//
+// A lazily started coroutine that produces a value of type T and must be co_await-ed.
+//
+// Usage:
+//
+//   Task<std::string> read_all(Reactor& reactor, int fd);
+//   ...
+//   std::string text = co_await read_all(reactor, fd);
+//
+// The awaiting coroutine is resumed through symmetric transfer when the task
+// finishes, so nested tasks do not grow the stack of the event loop.
+template<typename T>
+class Task
+{
+ public:
+  struct promise_type : PooledFrame
+  {
+    std::coroutine_handle<> continuation_;      // The coroutine that co_await-ed this task.
+    std::optional<T> value_;                    // Result, set by co_return.
+    std::exception_ptr exception_;              // Exception that escaped the coroutine body, if any.
+
+    // Resume the awaiting coroutine when this task finishes.
+    struct FinalAwaiter
+    {
+      bool await_ready() const noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept { return handle.promise().continuation_; }
+      void await_resume() const noexcept { }
+    };
+
+    Task get_return_object() noexcept { return Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_value(T value) { value_.emplace(std::move(value)); }
+    void unhandled_exception() noexcept { exception_ = std::current_exception(); }
+  };
+
+ private:
+  std::coroutine_handle<promise_type> handle_;  // Owned coroutine frame.
+
+  explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) { }
+
+ public:
+  Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) { }
+  Task(Task const&) = delete;
+  Task& operator=(Task const&) = delete;
+  Task& operator=(Task&&) = delete;
+
+  // Destroy the coroutine frame (also when it is still suspended).
+  ~Task()
+  {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  // Start the task; it resumes `awaiting` when done.
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+  {
+    handle_.promise().continuation_ = awaiting;
+    return handle_;
+  }
+
+  // Return the produced value, or rethrow the exception that escaped the task.
+  T await_resume()
+  {
+    promise_type& promise = handle_.promise();
+    if (promise.exception_)
+      std::rethrow_exception(promise.exception_);
+    return std::move(*promise.value_);
+  }
+};
+
+} // namespace remountd
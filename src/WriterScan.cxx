@@ -0,0 +1,194 @@
+#include "sys.h"
+#include "WriterScan.h"
+#include "ScopedFd.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/nsfs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "debug.h"
+
+namespace remountd {
+namespace {
+
+// Closes a directory stream.
+struct DirectoryCloser
+{
+  void operator()(DIR* directory) const { closedir(directory); }
+};
+
+using ScopedDirectory = std::unique_ptr<DIR, DirectoryCloser>;
+
+// Return the numeric value after `key` (e.g. "mnt_id:") in the contents of an fdinfo file, in `base`.
+bool fdinfo_value(std::string_view fdinfo, std::string_view key, int base, uint64_t* value)
+{
+  std::size_t position = 0;
+  while (position < fdinfo.size())
+  {
+    std::size_t line_end = fdinfo.find('\n', position);
+    if (line_end == std::string_view::npos)
+      line_end = fdinfo.size();
+    std::string_view line = fdinfo.substr(position, line_end - position);
+    position = line_end + 1;
+    if (!line.starts_with(key))
+      continue;
+    line.remove_prefix(key.size());
+    while (!line.empty() && (line.front() == ' ' || line.front() == '\t'))
+      line.remove_prefix(1);
+    return std::from_chars(line.data(), line.data() + line.size(), *value, base).ec == std::errc();
+  }
+  return false;
+}
+
+// Return true if process `pid` has a file on mount `mount_id` open for writing.
+bool is_writer(pid_t pid, uint64_t mount_id)
+{
+  std::string const fdinfo_path = "/proc/" + std::to_string(pid) + "/fdinfo";
+  ScopedDirectory const directory(opendir(fdinfo_path.c_str()));
+  if (!directory)
+    return false;
+
+  char buffer[1024];
+  while (dirent const* entry = readdir(directory.get()))
+  {
+    if (entry->d_name[0] == '.')
+      continue;
+    ScopedFd const fd(openat(dirfd(directory.get()), entry->d_name, O_RDONLY | O_CLOEXEC));
+    if (!fd.valid())
+      continue;
+    ssize_t const length = read(fd.get(), buffer, sizeof(buffer));
+    if (length <= 0)
+      continue;
+    std::string_view const fdinfo(buffer, length);
+    uint64_t flags;
+    uint64_t fd_mount_id;
+    if (fdinfo_value(fdinfo, "mnt_id:", 10, &fd_mount_id) && fd_mount_id == mount_id &&
+        fdinfo_value(fdinfo, "flags:", 8, &flags) && (flags & O_ACCMODE) != O_RDONLY)
+      return true;
+  }
+  return false;
+}
+
+// Return the pids of `pid` in its pid namespace and the ones above it, innermost last (the NSpid field of its status).
+std::vector<pid_t> namespace_pids(pid_t pid)
+{
+  std::vector<pid_t> pids;
+  ScopedFd const fd(open(("/proc/" + std::to_string(pid) + "/status").c_str(), O_RDONLY | O_CLOEXEC));
+  if (!fd.valid())
+    return pids;
+  char buffer[4096];
+  ssize_t const length = read(fd.get(), buffer, sizeof(buffer));
+  if (length <= 0)
+    return pids;
+  std::string_view status(buffer, length);
+  std::size_t const position = status.find("\nNSpid:");
+  if (position == std::string_view::npos)
+    return pids;
+  status.remove_prefix(position + 7);
+  status = status.substr(0, status.find('\n'));
+  while (!status.empty())
+  {
+    while (!status.empty() && (status.front() == ' ' || status.front() == '\t'))
+      status.remove_prefix(1);
+    pid_t namespace_pid;
+    auto const [end, error] = std::from_chars(status.data(), status.data() + status.size(), namespace_pid);
+    if (error != std::errc())
+      break;
+    pids.push_back(namespace_pid);
+    status.remove_prefix(end - status.data());
+  }
+  return pids;
+}
+
+} // namespace
+
+//static
+pid_t WriterScan::translate_pid(pid_t pid, pid_t observer)
+{
+  std::vector<pid_t> const pids = namespace_pids(pid);
+  std::vector<pid_t> const observer_pids = namespace_pids(observer);
+  if (observer_pids.empty() || pids.size() < observer_pids.size())
+    return 0;
+
+  // The pid namespace of `pid` at the depth of the one of `observer` must be that one.
+  ScopedFd namespace_fd(open(("/proc/" + std::to_string(pid) + "/ns/pid").c_str(), O_RDONLY | O_CLOEXEC));
+  for (std::size_t depth = pids.size(); namespace_fd.valid() && depth > observer_pids.size(); --depth)
+    namespace_fd = ScopedFd(ioctl(namespace_fd.get(), NS_GET_PARENT));
+  struct stat namespace_stat;
+  struct stat observer_namespace_stat;
+  if (!namespace_fd.valid() || fstat(namespace_fd.get(), &namespace_stat) != 0 ||
+      stat(("/proc/" + std::to_string(observer) + "/ns/pid").c_str(), &observer_namespace_stat) != 0 ||
+      namespace_stat.st_ino != observer_namespace_stat.st_ino || namespace_stat.st_dev != observer_namespace_stat.st_dev)
+    return 0;
+  return pids[observer_pids.size() - 1];
+}
+
+//static
+std::vector<pid_t> WriterScan::find_writers(uint64_t mount_namespace, uint64_t mount_id, clock_type::time_point deadline)
+{
+  DoutEntering(dc::notice, "WriterScan::find_writers(" << mount_namespace << ", " << mount_id << ")");
+
+  // The processes in the mount namespace.
+  std::vector<pid_t> candidates;
+  {
+    ScopedDirectory const proc(opendir("/proc"));
+    if (!proc)
+      return {};
+    pid_t const self = getpid();
+    while (dirent const* entry = readdir(proc.get()))
+    {
+      pid_t pid = 0;
+      std::string_view const name(entry->d_name);
+      if (std::from_chars(name.data(), name.data() + name.size(), pid).ptr != name.data() + name.size() || pid == self)
+        continue;
+      struct stat namespace_stat;
+      if (stat(("/proc/" + std::string(name) + "/ns/mnt").c_str(), &namespace_stat) == 0 && namespace_stat.st_ino == mount_namespace)
+        candidates.push_back(pid);
+    }
+  }
+
+  // Every thread takes the next candidate until none are left, enough writers were found, or time is up.
+  std::atomic<std::size_t> next_candidate = 0;
+  std::atomic<std::size_t> number_of_writers = 0;
+  std::vector<std::vector<pid_t>> writers(std::min(max_threads_c, std::max<std::size_t>(1, candidates.size() / 16)));
+  auto scan = [&](std::vector<pid_t>& found)
+  {
+    std::size_t index;
+    while ((index = next_candidate++) < candidates.size() && number_of_writers < max_writers_c && clock_type::now() < deadline)
+    {
+      if (is_writer(candidates[index], mount_id))
+      {
+        found.push_back(candidates[index]);
+        ++number_of_writers;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (std::size_t thread = 1; thread < writers.size(); ++thread)
+    threads.emplace_back(scan, std::ref(writers[thread]));
+  scan(writers[0]);
+  for (std::thread& thread : threads)
+    thread.join();
+
+  std::vector<pid_t> result;
+  for (std::vector<pid_t> const& found : writers)
+    result.insert(result.end(), found.begin(), found.end());
+  std::sort(result.begin(), result.end());
+  if (result.size() > max_writers_c)
+    result.resize(max_writers_c);
+  return result;
+}
+
+} // namespace remountd
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace remountd {
+
+// WriterScan
+//
+// Finds the processes that keep a read-only remount from succeeding: those
+// with a file open for writing on the mount (which makes the kernel return
+// EBUSY).
+//
+// Only the processes in the mount namespace of the mount are considered.
+// For each of them every /proc/<pid>/fdinfo/<fd> is read, which reports the
+// open flags and the mount id (the one of statx(2) STATX_MNT_ID) of the fd.
+// The processes are divided over up to max_threads_c threads, and the scan
+// stops after max_writers_c writers were found or when the deadline passed,
+// whichever comes first. Reading the fdinfo of other users' processes needs
+// CAP_SYS_PTRACE.
+//
+// The executor runs the scan in a forked child, so that it does not hold
+// up other commands, and the threads are joined before find_writers()
+// returns. The pids that are found are those of the pid namespace of the
+// executor; translate_pid() converts them to the pids that the requesting
+// process sees, from the NSpid field of /proc/<pid>/status.
+class WriterScan
+{
+ public:
+  static constexpr std::size_t max_threads_c = 4;       // Maximum number of threads that scan in parallel.
+  static constexpr std::size_t max_writers_c = 16;      // The scan stops when this many writers were found.
+
+  using clock_type = std::chrono::steady_clock;
+
+  // Return the processes in mount namespace `mount_namespace` (its inode number) that have a file on mount
+  // `mount_id` open for writing, sorted. Stops at `deadline`, so the result can be incomplete.
+  static std::vector<pid_t> find_writers(uint64_t mount_namespace, uint64_t mount_id, clock_type::time_point deadline);
+
+  // Return the pid of process `pid` in the pid namespace of process `observer`,
+  // or 0 if it is not in that pid namespace (or one below it).
+  static pid_t translate_pid(pid_t pid, pid_t observer);
+};
+
+} // namespace remountd
@@ -32,6 +32,8 @@ struct remountd_error_category final : std::error_category
         return "config socket key missing";
       case remountd::errc::config_socket_empty:
         return "config socket key empty";
+      case remountd::errc::config_invalid_value:
+        return "invalid config value";
       case remountd::errc::socket_path_too_long:
         return "socket path too long";
       case remountd::errc::socket_path_not_socket:
@@ -46,6 +48,22 @@ struct remountd_error_category final : std::error_category
         return "application is already initialized";
       case remountd::errc::application_not_initialized:
         return "application is not initialized";
+      case remountd::errc::rate_limited:
+        return "rate limit exceeded";
+      case remountd::errc::not_authorized:
+        return "not authorized";
+      case remountd::errc::executor_unavailable:
+        return "privileged executor is unavailable";
+      case remountd::errc::no_such_path:
+        return "path does not exist";
+      case remountd::errc::not_a_mount_point:
+        return "path is not a mount point";
+      case remountd::errc::mount_busy:
+        return "mount point is busy";
+      case remountd::errc::attachment_exited:
+        return "the attached process exited";
+      case remountd::errc::remount_superseded:
+        return "superseded by a later remount of the same path";
       default:
         return "unknown remountd error " + std::to_string(error_value);
     }
@@ -16,13 +16,22 @@ enum class errc
   no_such_socket,
   config_socket_missing,
   config_socket_empty,
+  config_invalid_value,
   socket_path_too_long,
   socket_path_not_socket,
   inetd_stdin_not_socket,
   systemd_invalid_fd_count,
   systemd_inherited_fd_not_socket,
   application_already_initialized,
-  application_not_initialized
+  application_not_initialized,
+  rate_limited,
+  not_authorized,
+  executor_unavailable,
+  no_such_path,
+  not_a_mount_point,
+  mount_busy,
+  attachment_exited,
+  remount_superseded
 };
 
 std::error_code make_error_code(errc code);
@@ -1,8 +1,13 @@
 #include "sys.h"
 #include "utils.h"
 #include "Application.h"
+#include "remountd_error.h"
 #include <syslog.h>
 #include <sys/socket.h>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <cstddef>
 
 namespace remountd {
 
@@ -34,16 +39,66 @@ void send_text_to_socket(int fd, std::string_view text)
   }
 }
 
-std::string format_unknown_identifier_error(std::string_view name)
+// Return true if `socket_native_path` names a socket in the abstract namespace ("@name").
+bool is_abstract_socket_path(std::string_view socket_native_path)
 {
-  return "ERROR: " + std::string(name) + " is not an allowed identifier in " +
-      Application::instance().config_path().native() + ".\n";
+  return !socket_native_path.empty() && socket_native_path[0] == '@';
+}
+
+// Fill in `addr` for `socket_native_path` and return the length of the address.
+//
+// A path that starts with '@' is a name in the abstract namespace: its address
+// begins with a NUL byte instead of the '@' and is not NUL terminated, so that
+// the length is significant.
+socklen_t make_unix_socket_address(std::string const& socket_native_path, sockaddr_un& addr)
+{
+  if (socket_native_path.size() >= sizeof(sockaddr_un::sun_path))
+    throw_error(errc::socket_path_too_long, "socket path is too long for AF_UNIX: '" + socket_native_path + "'");
+
+  addr = sockaddr_un{};
+  addr.sun_family = AF_UNIX;
+  std::copy(socket_native_path.begin(), socket_native_path.end(), addr.sun_path);
+  if (!is_abstract_socket_path(socket_native_path))
+    return sizeof(addr);
+
+  addr.sun_path[0] = '\0';
+  return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + socket_native_path.size());
+}
+
+// Return true if the local address of socket `fd` is in the abstract namespace.
+bool is_abstract_socket_fd(int fd)
+{
+  sockaddr_un addr{};
+  socklen_t length = sizeof(addr);
+  if (getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length) != 0)
+    return false;
+  return addr.sun_family == AF_UNIX && length > offsetof(sockaddr_un, sun_path) && addr.sun_path[0] == '\0';
+}
+
+// Return the local address of socket `fd` in the form that make_unix_socket_address accepts, or an empty string.
+std::string socket_address_name(int fd)
+{
+  sockaddr_un addr{};
+  socklen_t length = sizeof(addr);
+  if (getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length) != 0 || addr.sun_family != AF_UNIX || length <= offsetof(sockaddr_un, sun_path))
+    return {};
+  std::size_t const path_length = length - offsetof(sockaddr_un, sun_path);
+  if (addr.sun_path[0] == '\0')
+    return "@" + std::string(addr.sun_path + 1, path_length - 1);
+  return std::string(addr.sun_path, strnlen(addr.sun_path, path_length));
+}
+
+std::pmr::string format_unknown_identifier_error(std::string_view name, std::pmr::memory_resource* resource)
+{
+  std::pmr::string error(resource);
+  error.append("ERROR: ").append(name).append(" is not an allowed identifier in ").append(Application::instance().config_path().native()).append(".\n");
+  return error;
 }
 
 // Split one command line into whitespace-separated tokens.
-std::vector<std::string_view> split_tokens(std::string_view message)
+std::pmr::vector<std::string_view> split_tokens(std::string_view message, std::pmr::memory_resource* resource)
 {
-  std::vector<std::string_view> tokens;
+  std::pmr::vector<std::string_view> tokens(resource);
   std::size_t position = 0;
   while (position < message.size())
   {
@@ -63,16 +118,25 @@ std::vector<std::string_view> split_tokens(std::string_view message)
   return tokens;
 }
 
-// Find path for allowed identifier.
-std::optional<std::filesystem::path> find_allowed_path(std::string_view allowed_name)
+// Find the allow-entry of an identifier; returns nullptr if there is no such identifier.
+Application::AllowedMountPoint const* find_allowed_mount_point(std::string_view allowed_name)
 {
   for (Application::AllowedMountPoint const& allowed_mount_point : Application::instance().allowed_mount_points())
   {
     if (allowed_mount_point.name_ == allowed_name)
-      return allowed_mount_point.path_;
+      return &allowed_mount_point;
   }
 
-  return std::nullopt;
+  return nullptr;
+}
+
+// Return true when `path` starts with `prefix` on path-component boundaries. Both must be normalized.
+bool path_has_prefix(std::string_view path, std::string_view prefix)
+{
+  if (prefix == "/")
+    return true;
+
+  return path.starts_with(prefix) && (path.size() == prefix.size() || path[prefix.size()] == '/');
 }
 
 // Trim trailing whitespace/newlines.
@@ -122,6 +186,18 @@ std::string_view unquote(std::string_view in)
   return in;
 }
 
+// Parse a non-negative decimal integer; returns std::nullopt if `token` is not exactly that.
+std::optional<unsigned long> parse_unsigned(std::string_view token)
+{
+  unsigned long value = 0;
+  char const* const end = token.data() + token.size();
+  std::from_chars_result const conversion_result = std::from_chars(token.data(), end, value);
+  if (token.empty() || conversion_result.ec != std::errc() || conversion_result.ptr != end)
+    return std::nullopt;
+
+  return value;
+}
+
 std::string utf8_to_string(std::u8string const& text)
 {
   return std::string(reinterpret_cast<char const*>(text.data()), text.size());
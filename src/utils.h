@@ -1,22 +1,32 @@
 #pragma once
 
+#include "Application.h"
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <string_view>
 #include <vector>
 #include <optional>
 #include <filesystem>
+#include <memory_resource>
 #include <string>
 
 namespace remountd {
 
 void send_text_to_socket(int fd, std::string_view text);
-std::string format_unknown_identifier_error(std::string_view name);
-std::vector<std::string_view> split_tokens(std::string_view message);
-std::optional<std::filesystem::path> find_allowed_path(std::string_view allowed_name);
+bool is_abstract_socket_path(std::string_view socket_native_path);
+socklen_t make_unix_socket_address(std::string const& socket_native_path, sockaddr_un& addr);
+bool is_abstract_socket_fd(int fd);
+std::string socket_address_name(int fd);
+std::pmr::string format_unknown_identifier_error(std::string_view name, std::pmr::memory_resource* resource);
+std::pmr::vector<std::string_view> split_tokens(std::string_view message, std::pmr::memory_resource* resource);
+Application::AllowedMountPoint const* find_allowed_mount_point(std::string_view allowed_name);
+bool path_has_prefix(std::string_view path, std::string_view prefix);
 void trim_right(std::string* text);
 std::string_view trim(std::string_view in);
 std::string_view trim_left(std::string_view in);
 std::string_view trim_right(std::string_view in);
 std::string_view unquote(std::string_view in);
+std::optional<unsigned long> parse_unsigned(std::string_view token);
 std::string utf8_to_string(std::u8string const& text);
 
 } // namespace remountd